@@ -0,0 +1,242 @@
+/*
+ * Coroutine interfaces to the decoder, for C++20 and later. Everything else
+ * builds as C++11 and doesn't include this header.
+ *
+ * decode_frames() is a generator of the frames of a buffer:
+ *
+ *     for (const decoded_frame &frame : decode_frames(data, size))
+ *         consume(frame.samples, frame.count);
+ *
+ * async_stream decodes input that arrives in pieces. A coroutine awaits its
+ * frames and is suspended while the input doesn't hold a whole frame; the
+ * event loop feeds input as it arrives, which resumes the coroutine once it
+ * can continue. Thousands of streams can share one thread this way, each
+ * costing a decoder and a coroutine frame rather than a thread and a stack:
+ *
+ *     decode_task play(async_stream &stream)
+ *     {
+ *         while (const decoded_frame *frame = co_await stream.next())
+ *             consume(frame->samples, frame->count);
+ *     }
+ */
+
+#ifndef ASYNC_DECODER_H
+#define ASYNC_DECODER_H
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include "stream.h"
+
+struct decoded_frame {
+	/* Interleaved, and valid until the stream decodes another frame. */
+	const float *samples;
+	/* Samples per channel. */
+	unsigned count;
+	unsigned channels;
+	unsigned sampling_rate;
+};
+
+/** Yields the frames of a stream. Exceptions of the decoder are rethrown. */
+class frame_generator {
+public:
+	struct promise_type {
+		decoded_frame current;
+		std::exception_ptr error;
+
+		frame_generator get_return_object()
+		{
+			return frame_generator(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		std::suspend_always yield_value(const decoded_frame &frame)
+		{
+			current = frame;
+			return {};
+		}
+		void return_void() {}
+		void unhandled_exception() { error = std::current_exception(); }
+	};
+
+	class iterator {
+	public:
+		using iterator_category = std::input_iterator_tag;
+		using value_type = decoded_frame;
+		using difference_type = std::ptrdiff_t;
+
+		explicit iterator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+		const decoded_frame &operator*() const { return handle.promise().current; }
+		iterator &operator++()
+		{
+			resume(handle);
+			return *this;
+		}
+		bool operator==(std::default_sentinel_t) const { return handle.done(); }
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	explicit frame_generator(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	frame_generator(frame_generator &&orig) : handle(orig.handle) { orig.handle = nullptr; }
+	~frame_generator()
+	{
+		if (handle)
+			handle.destroy();
+	}
+	frame_generator(const frame_generator &) = delete;
+	frame_generator &operator=(const frame_generator &) = delete;
+
+	iterator begin()
+	{
+		resume(handle);
+		return iterator(handle);
+	}
+	std::default_sentinel_t end() { return {}; }
+
+private:
+	std::coroutine_handle<promise_type> handle;
+
+	static void resume(std::coroutine_handle<promise_type> handle)
+	{
+		handle.resume();
+		if (handle.promise().error)
+			std::rethrow_exception(handle.promise().error);
+	}
+};
+
+/**
+ * A coroutine that starts at once and frees itself when it returns. Nothing
+ * waits for it, so it must not throw.
+ */
+struct decode_task {
+	struct promise_type {
+		decode_task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/** Decodes input that is fed to it in pieces, for coroutines to await. */
+class async_stream {
+public:
+	/** @param work A workspace shared by the streams of this thread, or nullptr. */
+	explicit async_stream(mp3::workspace *work = nullptr) : work(work) {}
+	async_stream(const async_stream &) = delete;
+	async_stream &operator=(const async_stream &) = delete;
+
+	class awaiter {
+	public:
+		explicit awaiter(async_stream &stream) : stream(stream) {}
+		bool await_ready() { return stream.decode(); }
+		void await_suspend(std::coroutine_handle<> handle) { stream.waiting = handle; }
+		const decoded_frame *await_resume() { return stream.get_frame(); }
+
+	private:
+		async_stream &stream;
+	};
+
+	/**
+	 * The next frame, or nullptr at the end of the stream. Suspends until
+	 * enough input has been fed.
+	 * @throws std::bad_alloc
+	 */
+	awaiter next() { return awaiter(*this); }
+
+	/**
+	 * Add input, and resume the coroutine that awaits next() if the input now
+	 * holds a frame. Input that doesn't fit has to be fed again once the
+	 * coroutine has taken a frame, which is how a slow consumer holds back
+	 * its producer.
+	 * @return Bytes taken.
+	 */
+	unsigned feed(const unsigned char *data, unsigned size)
+	{
+		unsigned n = stream.feed(data, size);
+		wake();
+		return n;
+	}
+
+	/** Mark the end of the input. The awaiting coroutine sees the last frames. */
+	void close()
+	{
+		stream.set_end_of_input();
+		wake();
+	}
+
+	/** True if a coroutine waits for input. */
+	bool is_waiting() { return (bool)waiting; }
+
+private:
+	stream_decoder stream;
+	mp3::workspace *work;
+	std::coroutine_handle<> waiting;
+	stream_decoder::Status status = stream_decoder::NeedInput;
+	decoded_frame frame;
+
+	/** @return False if more input is needed. */
+	bool decode()
+	{
+		status = stream.decode(work);
+		return status != stream_decoder::NeedInput;
+	}
+
+	const decoded_frame *get_frame()
+	{
+		if (status != stream_decoder::Frame)
+			return nullptr;
+		mp3 *decoder = stream.get_decoder();
+		frame.samples = decoder->get_samples();
+		frame.count = decoder->get_sample_count();
+		frame.channels = stream.get_channels();
+		frame.sampling_rate = decoder->get_output_rate();
+		return &frame;
+	}
+
+	void wake()
+	{
+		if (waiting && decode()) {
+			std::coroutine_handle<> handle = waiting;
+			waiting = nullptr;
+			handle.resume();
+		}
+	}
+};
+
+/**
+ * Decode a whole stream in memory.
+ * @param data Held by the caller until the generator is done.
+ * @param size
+ * @param work A workspace shared by the streams of this thread, or nullptr.
+ */
+inline frame_generator decode_frames(const unsigned char *data, size_t size, mp3::workspace *work = nullptr)
+{
+	stream_decoder stream;
+	while (true) {
+		stream_decoder::Status status = stream.decode(work);
+		if (status == stream_decoder::End)
+			break;
+		if (status == stream_decoder::NeedInput) {
+			unsigned n = stream.feed(data, size < 0xFFFFFFFF ? size : 0xFFFFFFFF);
+			data += n;
+			size -= n;
+			if (size == 0)
+				stream.set_end_of_input();
+			continue;
+		}
+		mp3 *decoder = stream.get_decoder();
+		co_yield decoded_frame{decoder->get_samples(), decoder->get_sample_count(),
+			stream.get_channels(), decoder->get_output_rate()};
+	}
+}
+
+#endif
+#endif
+
+#endif	/* ASYNC_DECODER_H */
@@ -0,0 +1,127 @@
+/*
+ * Keeps decoded frames in memory so that parts of a file that are requested
+ * again, such as its first seconds or a seek point, are copied rather than
+ * decoded. Frames are looked up by the identity of their file and their index
+ * in it, and the least recently used frames are dropped to stay within a
+ * budget of bytes. The cache can be shared by threads.
+ */
+
+#include <string.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+bool pcm_cache::file_id::operator==(const file_id &other) const
+{
+	return device == other.device && inode == other.inode && size == other.size && modified == other.modified;
+}
+
+bool pcm_cache::identify(const char *path, file_id &id)
+{
+	struct stat status;
+	if (stat(path, &status) != 0)
+		return false;
+	id.device = status.st_dev;
+	id.inode = status.st_ino;
+	id.size = status.st_size;
+	id.modified = (long long)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+	return true;
+}
+
+bool pcm_cache::key::operator==(const key &other) const
+{
+	return frame == other.frame && file == other.file;
+}
+
+size_t pcm_cache::hash::operator()(const key &k) const
+{
+	unsigned long long h = k.file.inode * 0x9E3779B97F4A7C15ull;
+	h ^= k.file.device + (h << 6) + (h >> 2);
+	h ^= (unsigned long long)k.file.modified + (h << 6) + (h >> 2);
+	h ^= k.frame + (h << 6) + (h >> 2);
+	return h;
+}
+
+pcm_cache::pcm_cache(size_t budget)
+{
+	this->budget = budget;
+	size = 0;
+	hits = 0;
+	misses = 0;
+	evictions = 0;
+}
+
+/** A frame also costs its list and index nodes, roughly. */
+size_t pcm_cache::get_cost(const entry &e)
+{
+	return sizeof(entry) + 4 * sizeof(void *) + e.samples.size() * sizeof(float);
+}
+
+bool pcm_cache::read(const file_id &file, unsigned frame, float *samples, unsigned &count)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = index.find(key{file, frame});
+	if (found == index.end()) {
+		misses++;
+		return false;
+	}
+	hits++;
+	entries.splice(entries.begin(), entries, found->second);
+	const entry &e = *found->second;
+	memcpy(samples, e.samples.data(), e.samples.size() * sizeof(float));
+	count = e.count;
+	return true;
+}
+
+void pcm_cache::write(const file_id &file, unsigned frame, const float *samples, unsigned count, unsigned channels)
+{
+	key id{file, frame};
+	std::list<entry> added;
+	added.push_back(entry{id, count, std::vector<float>(samples, samples + count * channels)});
+	size_t cost = get_cost(added.front());
+	if (cost > budget)
+		return;
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (index.find(id) != index.end())
+		return;
+	while (size + cost > budget) {
+		entry &oldest = entries.back();
+		size -= get_cost(oldest);
+		index.erase(oldest.id);
+		entries.pop_back();
+		evictions++;
+	}
+	/* The node keeps its place in memory when it moves to the list. */
+	index[id] = added.begin();
+	entries.splice(entries.begin(), added);
+	size += cost;
+}
+
+unsigned long long pcm_cache::get_hits()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return hits;
+}
+
+unsigned long long pcm_cache::get_misses()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return misses;
+}
+
+unsigned long long pcm_cache::get_evictions()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return evictions;
+}
+
+size_t pcm_cache::get_size()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return size;
+}
+
+size_t pcm_cache::get_budget()
+{
+	return budget;
+}
@@ -0,0 +1,98 @@
+/*
+ * Keeps decoded frames in memory so that parts of a file that are requested
+ * again, such as its first seconds or a seek point, are copied rather than
+ * decoded. Frames are looked up by the identity of their file and their index
+ * in it, and the least recently used frames are dropped to stay within a
+ * budget of bytes. The cache can be shared by threads.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class pcm_cache {
+public:
+	/** Identifies a file and its version, so that a changed file isn't served from the cache. */
+	struct file_id {
+		unsigned long long device;
+		unsigned long long inode;
+		unsigned long long size;
+		long long modified;
+
+		bool operator==(const file_id &other) const;
+	};
+
+	/**
+	 * @param path
+	 * @param id Receives the identity of the file.
+	 * @return False if the file can't be found.
+	 */
+	static bool identify(const char *path, file_id &id);
+
+	/** @param budget Bytes of samples and bookkeeping that may be kept. */
+	pcm_cache(size_t budget);
+	pcm_cache(const pcm_cache &) = delete;
+	pcm_cache &operator=(const pcm_cache &) = delete;
+
+	/**
+	 * Copy the samples of a frame if they are cached, and count a hit or miss.
+	 * @param file
+	 * @param frame
+	 * @param samples Receives the interleaved samples, room for a frame.
+	 * @param count Receives the samples per channel.
+	 * @return False if the frame isn't cached.
+	 */
+	bool read(const file_id &file, unsigned frame, float *samples, unsigned &count);
+	/**
+	 * Add the samples of a frame, dropping the least recently used frames
+	 * until they fit.
+	 * @param file
+	 * @param frame
+	 * @param samples Interleaved.
+	 * @param count Samples per channel.
+	 * @param channels
+	 * @throws std::bad_alloc
+	 */
+	void write(const file_id &file, unsigned frame, const float *samples, unsigned count, unsigned channels);
+
+	unsigned long long get_hits();
+	unsigned long long get_misses();
+	unsigned long long get_evictions();
+	/** Bytes in use. */
+	size_t get_size();
+	size_t get_budget();
+
+private:
+	struct key {
+		file_id file;
+		unsigned frame;
+
+		bool operator==(const key &other) const;
+	};
+	struct hash {
+		size_t operator()(const key &k) const;
+	};
+	struct entry {
+		key id;
+		unsigned count;
+		std::vector<float> samples;
+	};
+
+	std::mutex lock;
+	/* Most recently used first. */
+	std::list<entry> entries;
+	std::unordered_map<key, std::list<entry>::iterator, hash> index;
+	size_t budget;
+	size_t size;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+
+	static size_t get_cost(const entry &e);
+};
+
+#endif	/* CACHE_H */
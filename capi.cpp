@@ -0,0 +1,225 @@
+/*
+ * The C interface of libmp3decoder, for embedding the decoder in programs that
+ * aren't written in C++. A decoder is an opaque handle that is fed the bytes of
+ * a stream in pieces of any size and decodes a frame at a time. No exception
+ * leaves these functions.
+ */
+
+#include <string.h>
+#include <new>
+#include "mp3decoder.h"
+#include "probe.h"
+#include "stream.h"
+#include "xing.h"
+
+struct mp3d_decoder {
+	stream_decoder stream;
+	/* Learned from the first frame, for seeking. */
+	bool known;
+	unsigned long long audio_start;
+	unsigned long long audio_bytes;
+	double duration;
+	bool has_toc;
+	unsigned char toc[100];
+};
+
+int mp3d_version(void)
+{
+	return MP3D_VERSION;
+}
+
+mp3d_decoder *mp3d_create(void)
+{
+	mp3d_decoder *decoder = new (std::nothrow) mp3d_decoder;
+	if (decoder != nullptr)
+		decoder->known = false;
+	return decoder;
+}
+
+void mp3d_destroy(mp3d_decoder *decoder)
+{
+	delete decoder;
+}
+
+size_t mp3d_feed(mp3d_decoder *decoder, const void *data, size_t size)
+{
+	if (decoder == nullptr || data == nullptr)
+		return 0;
+	unsigned n = size < 0xFFFFFFFF ? size : 0xFFFFFFFF;
+	return decoder->stream.feed(static_cast<const unsigned char *>(data), n);
+}
+
+int mp3d_end_of_input(mp3d_decoder *decoder)
+{
+	if (decoder == nullptr)
+		return MP3D_ERROR_ARGUMENT;
+	decoder->stream.set_end_of_input();
+	return MP3D_OK;
+}
+
+/**
+ * Keep what the first frame tells about the layout of the stream: where the
+ * audio starts, and a Xing table of contents if it has one.
+ * @param decoder
+ */
+static void learn_layout(mp3d_decoder *decoder)
+{
+	mp3 *frame = decoder->stream.get_decoder();
+	unsigned char *buffer = const_cast<unsigned char *>(decoder->stream.get_frame());
+	unsigned frame_size = frame->get_frame_size();
+	unsigned samples_per_frame = frame->get_mpeg_version() == 1 ? 1152 : 576;
+	unsigned side_info;
+	if (frame->get_mpeg_version() == 1)
+		side_info = frame->get_channel_mode() == mp3::Mono ? 17 : 32;
+	else
+		side_info = frame->get_channel_mode() == mp3::Mono ? 9 : 17;
+
+	xing tag(buffer, (frame->get_crc() == 0 ? 6 : 4) + side_info, frame_size);
+	decoder->known = true;
+	decoder->audio_start = decoder->stream.get_frame_offset();
+	decoder->audio_bytes = 0;
+	decoder->duration = 0;
+	decoder->has_toc = false;
+	if (!tag.is_valid())
+		return;
+	/* The frame with the tag has no audio. */
+	decoder->audio_start += frame_size;
+	const bool *extensions = tag.get_xing_extensions();
+	if (extensions[xing::ByteField] && tag.get_byte_quantity() > 0)
+		decoder->audio_bytes = tag.get_byte_quantity();
+	if (extensions[xing::FrameField] && tag.get_frame_quantity() > 0)
+		decoder->duration = (double)tag.get_frame_quantity() * samples_per_frame / frame->get_sampling_rate();
+	if (!extensions[xing::TOC] || decoder->audio_bytes == 0 || decoder->duration == 0)
+		return;
+	/* Some encoders leave the table zeroed in constant bit rate files. */
+	const unsigned char *toc = tag.get_toc();
+	bool increasing = toc[99] > 0;
+	for (int i = 1; i < 100; i++)
+		increasing = increasing && toc[i] >= toc[i - 1];
+	if (increasing) {
+		memcpy(decoder->toc, toc, sizeof(decoder->toc));
+		decoder->has_toc = true;
+	}
+}
+
+int mp3d_decode(mp3d_decoder *decoder, float *pcm, size_t capacity, size_t *count)
+{
+	if (count != nullptr)
+		*count = 0;
+	if (decoder == nullptr || pcm == nullptr || count == nullptr || capacity < MP3D_MAX_SAMPLES)
+		return MP3D_ERROR_ARGUMENT;
+
+	stream_decoder::Status status;
+	try {
+		status = decoder->stream.decode();
+	} catch (const std::bad_alloc &) {
+		return MP3D_ERROR_MEMORY;
+	} catch (...) {
+		return MP3D_END;
+	}
+	if (status == stream_decoder::NeedInput)
+		return MP3D_NEED_INPUT;
+	if (status == stream_decoder::End)
+		return MP3D_END;
+
+	if (!decoder->known)
+		learn_layout(decoder);
+	mp3 *frame = decoder->stream.get_decoder();
+	unsigned samples = frame->get_sample_count();
+	memcpy(pcm, frame->get_samples(), (size_t)samples * decoder->stream.get_channels() * sizeof(float));
+	*count = samples;
+	return MP3D_FRAME;
+}
+
+int mp3d_get_format(mp3d_decoder *decoder, unsigned *sampling_rate, unsigned *channels)
+{
+	if (decoder == nullptr)
+		return MP3D_ERROR_ARGUMENT;
+	mp3 *frame = decoder->stream.get_decoder();
+	if (frame == nullptr || !decoder->known)
+		return MP3D_ERROR_STATE;
+	if (sampling_rate != nullptr)
+		*sampling_rate = frame->get_output_rate();
+	if (channels != nullptr)
+		*channels = decoder->stream.get_channels();
+	return MP3D_OK;
+}
+
+int mp3d_set_output_rate(mp3d_decoder *decoder, unsigned rate, enum mp3d_quality quality)
+{
+	if (decoder == nullptr || quality < MP3D_QUALITY_LOW || quality > MP3D_QUALITY_HIGH)
+		return MP3D_ERROR_ARGUMENT;
+	static const resampler::Quality qualities[] = {resampler::Low, resampler::Medium, resampler::High};
+	try {
+		if (!decoder->stream.set_output_rate(rate, qualities[quality]))
+			return MP3D_ERROR_RATE;
+	} catch (const std::bad_alloc &) {
+		return MP3D_ERROR_MEMORY;
+	} catch (...) {
+		return MP3D_ERROR_RATE;
+	}
+	return MP3D_OK;
+}
+
+/**
+ * The TOC holds the position of each percent of the duration in 256ths of the
+ * audio; positions in between are interpolated. Without one, the average bit
+ * rate follows from the byte and frame counts of the tag, or else from the bit
+ * rate of the first frame.
+ */
+int mp3d_seek(mp3d_decoder *decoder, double seconds, unsigned long long *offset)
+{
+	if (decoder == nullptr || offset == nullptr || !(seconds >= 0))
+		return MP3D_ERROR_ARGUMENT;
+	if (seconds == 0) {
+		*offset = 0;
+		decoder->stream.restart(0);
+		return MP3D_OK;
+	}
+	if (!decoder->known)
+		return MP3D_ERROR_STATE;
+
+	unsigned long long position = decoder->audio_start;
+	if (decoder->has_toc) {
+		double percent = seconds / decoder->duration * 100;
+		if (percent > 99.999)
+			percent = 99.999;
+		int index = (int)percent;
+		double first = decoder->toc[index];
+		double second = index < 99 ? decoder->toc[index + 1] : 256;
+		double fraction = first + (second - first) * (percent - index);
+		position += (unsigned long long)(fraction / 256 * decoder->audio_bytes);
+	} else if (decoder->audio_bytes > 0 && decoder->duration > 0) {
+		position += (unsigned long long)(seconds / decoder->duration * decoder->audio_bytes);
+	} else {
+		mp3 *frame = decoder->stream.get_decoder();
+		position += (unsigned long long)(seconds * frame->get_bit_rate() / 8);
+	}
+	*offset = position;
+	decoder->stream.restart(position);
+	return MP3D_OK;
+}
+
+int mp3d_probe(const char *path, struct mp3d_info *info)
+{
+	if (path == nullptr || info == nullptr)
+		return MP3D_ERROR_ARGUMENT;
+	memset(info, 0, sizeof(*info));
+	try {
+		probe file(path);
+		if (!file.is_valid())
+			return MP3D_ERROR_FILE;
+		info->sampling_rate = file.get_sampling_rate();
+		info->channels = file.get_channel_mode() == mp3::Mono ? 1 : 2;
+		info->bit_rate = file.get_bit_rate();
+		info->vbr = file.is_vbr();
+		info->frames = file.get_frames();
+		info->duration = file.get_duration();
+		info->estimated = file.is_estimated();
+	} catch (const std::bad_alloc &) {
+		return MP3D_ERROR_MEMORY;
+	} catch (...) {
+		return MP3D_ERROR_FILE;
+	}
+	return MP3D_OK;
+}
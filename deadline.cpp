@@ -0,0 +1,104 @@
+/*
+ * Chooses how much of each frame to decode so that it is done before its
+ * samples are due, such as when a live stream would otherwise run out of
+ * samples on a loaded host. The time each degradation takes is learned as
+ * frames are decoded. When a frame wouldn't fit in the time left, decoding
+ * steps down as far as it has to at once. It steps back up one degradation at
+ * a time, and only after a run of frames that would have fitted, so that it
+ * doesn't swing back and forth.
+ */
+
+#include "deadline.h"
+
+deadline_scheduler::deadline_scheduler(unsigned recovery)
+{
+	this->recovery = recovery > 0 ? recovery : 1;
+	level = mp3::Intact;
+	changed = false;
+	calm = 0;
+	step_downs = 0;
+	step_ups = 0;
+	misses = 0;
+	for (int i = 0; i < levels; i++) {
+		cost[i] = 0;
+		frames[i] = 0;
+	}
+}
+
+/**
+ * Until a degradation has been measured, it is guessed from the cost of
+ * decoding whole frames, by how much of the work it leaves out.
+ */
+double deadline_scheduler::get_cost(mp3::Degradation degradation)
+{
+	static const double fractions[levels] = {1, 0.65, 0.45, 0.05};
+	if (cost[degradation] > 0)
+		return cost[degradation];
+	for (int i = 0; i < levels; i++)
+		if (cost[i] > 0)
+			return cost[i] / fractions[i] * fractions[degradation];
+	return 0;
+}
+
+mp3::Degradation deadline_scheduler::plan(double slack)
+{
+	int next = level;
+	while (next < mp3::Concealed && get_cost((mp3::Degradation)next) * margin > slack)
+		next++;
+
+	if (next == level && level > mp3::Intact &&
+		get_cost((mp3::Degradation)(level - 1)) * margin * 2 < slack) {
+		if (++calm >= recovery)
+			next = level - 1;
+	} else
+		calm = 0;
+
+	changed = next != level;
+	if (next > level)
+		step_downs++;
+	else if (next < level) {
+		step_ups++;
+		calm = 0;
+	}
+	level = next;
+	return (mp3::Degradation)level;
+}
+
+void deadline_scheduler::record(double seconds, double slack)
+{
+	/* Follows changes in load within a few dozen frames. */
+	cost[level] = cost[level] > 0 ? cost[level] + (seconds - cost[level]) / 16 : seconds;
+	frames[level]++;
+	if (seconds > slack)
+		misses++;
+}
+
+bool deadline_scheduler::has_changed()
+{
+	return changed;
+}
+
+mp3::Degradation deadline_scheduler::get_degradation()
+{
+	return (mp3::Degradation)level;
+}
+
+unsigned long deadline_scheduler::get_frames(mp3::Degradation degradation)
+{
+	return frames[degradation];
+}
+
+unsigned long deadline_scheduler::get_step_downs()
+{
+	return step_downs;
+}
+
+unsigned long deadline_scheduler::get_step_ups()
+{
+	return step_ups;
+}
+
+unsigned long deadline_scheduler::get_misses()
+{
+	return misses;
+}
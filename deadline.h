@@ -0,0 +1,64 @@
+/*
+ * Chooses how much of each frame to decode so that it is done before its
+ * samples are due, such as when a live stream would otherwise run out of
+ * samples on a loaded host. The time each degradation takes is learned as
+ * frames are decoded. When a frame wouldn't fit in the time left, decoding
+ * steps down as far as it has to at once. It steps back up one degradation at
+ * a time, and only after a run of frames that would have fitted, so that it
+ * doesn't swing back and forth.
+ */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include "mp3.h"
+
+class deadline_scheduler {
+public:
+	/**
+	 * @param recovery Frames in a row that must have room to spare for the
+	 * next degradation up before stepping up to it.
+	 */
+	deadline_scheduler(unsigned recovery = 20);
+
+	/**
+	 * Choose the degradation of the next frame.
+	 * @param slack Seconds until the samples of the frame are due, negative if
+	 * they are already late.
+	 */
+	mp3::Degradation plan(double slack);
+	/**
+	 * Learn from the frame that was planned last, and count it.
+	 * @param seconds How long it took to decode.
+	 * @param slack The slack it was planned with, to count missed deadlines.
+	 */
+	void record(double seconds, double slack);
+
+	/** True if the last plan changed the degradation. */
+	bool has_changed();
+	mp3::Degradation get_degradation();
+	/** The seconds a frame is expected to take at a degradation. */
+	double get_cost(mp3::Degradation level);
+	unsigned long get_frames(mp3::Degradation level);
+	unsigned long get_step_downs();
+	unsigned long get_step_ups();
+	unsigned long get_misses();
+
+private:
+	static const int levels = 4;
+	/* Room that is left over for the time a frame takes to vary. */
+	static constexpr double margin = 1.5;
+
+	unsigned recovery;
+	int level;
+	bool changed;
+	unsigned calm;
+	/* Averages of the time frames took, or 0 before one was measured. */
+	double cost[levels];
+	unsigned long frames[levels];
+	unsigned long step_downs;
+	unsigned long step_ups;
+	unsigned long misses;
+};
+
+#endif	/* DEADLINE_H */
@@ -0,0 +1,91 @@
+/*
+ * Decodes a file with the coroutine interfaces of async_decoder.h, which need
+ * C++20: once with the decode_frames() generator, and once with many
+ * async_streams on this thread, each awaited by a coroutine and fed the file
+ * in pieces of uneven sizes. The generator's PCM is written raw, and every
+ * stream must decode the same samples. "make check-cxx20" compares the PCM
+ * with what "mp3decoder --out" writes.
+ */
+
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../async_decoder.h"
+
+#ifndef ASYNC_DECODER_H
+#error "async_decoder.h needs C++20 and <coroutine>."
+#endif
+
+/** Collects the PCM of a stream. */
+decode_task collect(async_stream &stream, std::vector<float> &pcm, bool &done)
+{
+	while (const decoded_frame *frame = co_await stream.next())
+		pcm.insert(pcm.end(), frame->samples, frame->samples + frame->count * frame->channels);
+	done = true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		printf("Usage: coroutines file.mp3 out.raw [streams]\n");
+		return -1;
+	}
+	unsigned count = argc > 3 ? atoi(argv[3]) : 100;
+
+	std::ifstream input(argv[1], std::ios::binary);
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+	if (!input.eof() && !input) {
+		printf("Could not read %s.\n", argv[1]);
+		return -1;
+	}
+
+	mp3::workspace work;
+	std::vector<float> expected;
+	for (const decoded_frame &frame : decode_frames(data.data(), data.size(), &work))
+		expected.insert(expected.end(), frame.samples, frame.samples + frame.count * frame.channels);
+	std::ofstream output(argv[2], std::ios::binary);
+	output.write(reinterpret_cast<const char *>(expected.data()), expected.size() * sizeof(float));
+	if (!output) {
+		printf("Could not write %s.\n", argv[2]);
+		return -1;
+	}
+
+	/* Each stream is fed a piece in turn, as an event loop would when input
+	 * arrives on many connections. */
+	std::vector<async_stream *> streams;
+	std::vector<std::vector<float>> results(count);
+	std::vector<size_t> fed(count, 0);
+	bool *done = new bool[count]();
+	for (unsigned i = 0; i < count; i++) {
+		streams.push_back(new async_stream(&work));
+		collect(*streams[i], results[i], done[i]);
+	}
+	for (bool feeding = true; feeding;) {
+		feeding = false;
+		for (unsigned i = 0; i < count; i++) {
+			if (fed[i] == data.size())
+				continue;
+			size_t piece = 1 + (i * 7919 + fed[i]) % 3001;
+			if (piece > data.size() - fed[i])
+				piece = data.size() - fed[i];
+			fed[i] += streams[i]->feed(&data[fed[i]], piece);
+			if (fed[i] == data.size())
+				streams[i]->close();
+			feeding = true;
+		}
+	}
+
+	unsigned differing = 0;
+	for (unsigned i = 0; i < count; i++) {
+		if (!done[i] || results[i] != expected)
+			differing++;
+		delete streams[i];
+	}
+	delete[] done;
+	printf("%zu samples from the generator, %u of %u streams differing.\n",
+		expected.size(), differing, count);
+	return differing == 0 ? 0 : -1;
+}
@@ -4,39 +4,97 @@
  * ID3 contains meta data irrelevant to the decoder. The header contains an
  * offset used to determine the location of the first MP3 header.
  * | Header | Additional header (optional) | Meta Data | Footer (optional) |
+ *
+ * Frames aren't copied. They are read from the buffer when they are asked for,
+ * and their text and pictures are only decoded on demand.
  */
 
-#include <regex>
-#include "util.h"
+#include <stdio.h>
+#include <string.h>
 #include "id3.h"
 
-id3::id3(unsigned char *buffer)
+/** Sizes in version 2.4 and the tag header use seven bits per byte. */
+static unsigned syncsafe(const unsigned char *buffer, int bytes)
 {
-	this->buffer = buffer;
+	unsigned num = 0;
+	for (int i = 0; i < bytes; i++)
+		num = (num << 7) | (buffer[i] & 0x7F);
+	return num;
+}
 
-	if (buffer[0] == 'I' && buffer[1] == 'D' && buffer[2] == '3') {
-		set_version(buffer[3], buffer[4]);
-		if(set_flags(buffer[5])) {
-			valid = true;
-			set_offset(char_to_int(&buffer[6]));
-			set_extended_header_size(char_to_int(&buffer[10]));
-			set_fields(&buffer[10 + extended_header_size]);
-		} else
-			valid = false;
-	} else
-		valid = false;
+static bool is_syncsafe(const unsigned char *buffer, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		if (buffer[i] & 0x80)
+			return false;
+	return true;
+}
+
+static unsigned big_endian(const unsigned char *buffer, int bytes)
+{
+	unsigned num = 0;
+	for (int i = 0; i < bytes; i++)
+		num = (num << 8) | buffer[i];
+	return num;
 }
 
-id3::id3(const id3 &orig)
+/**
+ * Read bytes, skipping the 0x00 that unsynchronisation puts after every 0xFF.
+ * @param buffer
+ * @param available Bytes in the buffer.
+ * @param count Bytes to read.
+ * @param unsync
+ * @param out Receives count bytes, or null to skip them.
+ * @return Bytes used from the buffer, or 0 if there aren't enough.
+ */
+static unsigned read_bytes(const unsigned char *buffer, unsigned available, unsigned count,
+	bool unsync, unsigned char *out)
+{
+	if (!unsync) {
+		if (count > available)
+			return 0;
+		if (out != nullptr)
+			memcpy(out, buffer, count);
+		return count;
+	}
+
+	unsigned i = 0;
+	for (unsigned n = 0; n < count; n++) {
+		if (i >= available)
+			return 0;
+		unsigned char byte = buffer[i++];
+		if (out != nullptr)
+			out[n] = byte;
+		if (byte == 0xFF && i < available && buffer[i] == 0x00)
+			i++;
+	}
+	return i;
+}
+
+id3::id3(unsigned char *buffer, unsigned size)
 {
-	this->start = orig.start;
-	this->version = orig.version;
-	this->offset = orig.offset;
-	for (int i = 0; i < 4; i++)
-		this->id3_flags[i] = orig.id3_flags[i];
-	this->extended_header_size = orig.extended_header_size;
-	for (int i = 0; i < 2; i++)
-		this->id3_frames[i] = orig.id3_frames[i];
+	this->buffer = buffer;
+	this->base = 0;
+	this->available = size;
+	valid = false;
+	major = 0;
+	version[0] = '\0';
+	offset = 0;
+	extended_header_size = 0;
+	first_frame = 0;
+	tag_end = 0;
+	end = 0;
+
+	if (size >= 10 && buffer[0] == 'I' && buffer[1] == 'D' && buffer[2] == '3' &&
+			buffer[3] >= 2 && buffer[3] != 0xFF && buffer[4] != 0xFF && is_syncsafe(&buffer[6], 4)) {
+		set_version(buffer[3], buffer[4]);
+		if (set_flags(buffer[5])) {
+			valid = true;
+			set_offset(&buffer[6]);
+			set_extended_header_size(&buffer[10]);
+			set_frames();
+		}
+	}
 }
 
 bool id3::is_valid()
@@ -46,24 +104,28 @@ bool id3::is_valid()
 
 void id3::set_version(unsigned char version, unsigned char revision)
 {
-	char v[6];
-	sprintf(v, "2.%u.%u", version, revision);
-	this->version = (string)v;
+	major = version;
+	snprintf(this->version, sizeof(this->version), "2.%u.%u", version, revision);
 }
 
-string id3::get_id3_version()
+const char *id3::get_id3_version()
 {
-	return this->version;
+	return version;
 }
 
-void id3::set_offset(int offset)
+void id3::set_offset(unsigned char *buffer)
 {
-	this->offset = offset;
+	offset = syncsafe(buffer, 4);
 }
 
 int id3::get_id3_offset()
 {
-	return this->offset;
+	return offset;
+}
+
+unsigned id3::get_id3_size()
+{
+	return offset + (id3_flags[FooterPresent] ? 20 : 10);
 }
 
 bool id3::set_flags(unsigned char flags)
@@ -75,68 +137,353 @@ bool id3::set_flags(unsigned char flags)
 
 	for (int bit_num = 4; bit_num < 8; bit_num++)
 		if (flags >> bit_num & 1)
-			this->id3_flags[bit_num-4] = true;
+			id3_flags[bit_num-4] = true;
 		else
-			this->id3_flags[bit_num-4] = false;
+			id3_flags[bit_num-4] = false;
+
+	/* Only version 2.4 has a footer. */
+	if (major < 4)
+		id3_flags[FooterPresent] = false;
 
 	return true;
 }
 
 const bool *id3::get_id3_flags()
 {
-	return this->id3_flags;
+	return id3_flags;
 }
 
-void id3::set_extended_header_size(int size)
+/**
+ * The size of the extended header excludes its size field in version 2.3 and
+ * is syncsafe in version 2.4. In version 2.2 the flag means that the tag is
+ * compressed.
+ */
+void id3::set_extended_header_size(unsigned char *buffer)
 {
-	if (this->id3_flags[ExtendedHeader] == 1)
-		this->extended_header_size = size;
+	if (!id3_flags[ExtendedHeader] || major == 2 || available < 14)
+		extended_header_size = 0;
+	else if (major == 3)
+		extended_header_size = big_endian(buffer, 4) + 4;
 	else
-		this->extended_header_size = 0;
+		extended_header_size = syncsafe(buffer, 4);
 }
 
 int id3::get_id3_extended_header_size()
 {
-	return this->extended_header_size;
+	return extended_header_size;
+}
+
+void id3::set_frames()
+{
+	first_frame = 10 + extended_header_size;
+	tag_end = 10 + offset;
+	end = tag_end < available ? tag_end : available;
+	if (first_frame > tag_end || (major == 2 && id3_flags[ExtendedHeader]))
+		first_frame = tag_end;
 }
 
-void id3::set_fields(unsigned char *buffer)
+void id3::set_window(unsigned char *buffer, unsigned size, unsigned position)
 {
-	int footer_size = id3_flags[FooterPresent] * 10;
-	int size = offset - extended_header_size - footer_size;
-	int i = 0;
+	this->buffer = buffer;
+	base = position;
+	available = size;
+	end = tag_end - base < available ? tag_end : base + available;
+}
+
+/**
+ * Frame headers are ten bytes (six in version 2.2): an ID, the size and two
+ * bytes of flags. Only the frame headers are read, so a tag with large frames
+ * is indexed as quickly as a small one.
+ */
+bool id3::get_frame(unsigned &position, frame &f)
+{
+	if (!valid)
+		return false;
+	if (position < first_frame)
+		position = first_frame;
+	if (position < base || position >= end)
+		return false;
 
-	std::regex re("[A-Z0-9]");
-	string str(1, (char)buffer[i]);
+	/* In versions 2.2 and 2.3 unsynchronisation applies to the whole tag. */
+	bool tag_unsync = id3_flags[Unsynchronisation] && major < 4;
+	unsigned header_size = major == 2 ? 6 : 10;
+	unsigned id_length = major == 2 ? 3 : 4;
+	unsigned char header[10];
+	unsigned used = read_bytes(&buffer[position - base], end - position, header_size, tag_unsync, header);
+	if (used == 0)
+		return false;
 
-	while (!std::regex_match(str, re) && i < size) {
-		string id = "";
-		string content = "";
-		int field_size = 0;
+	/* Padding or garbage follows the last frame. */
+	for (unsigned i = 0; i < id_length; i++)
+		if (!((header[i] >= 'A' && header[i] <= 'Z') || (header[i] >= '0' && header[i] <= '9')))
+			return false;
 
-		for (int j = i; j < i + 4; j++)
-			id += buffer[j];
-		this->id3_frames[0].push_back(id);
+	unsigned size;
+	unsigned flags = 0;
+	if (major == 2)
+		size = big_endian(&header[3], 3);
+	else if (major == 3)
+		size = big_endian(&header[4], 4);
+	else if (is_syncsafe(&header[4], 4))
+		size = syncsafe(&header[4], 4);
+	else
+		/* Some writers don't use syncsafe sizes in version 2.4. */
+		size = big_endian(&header[4], 4);
+	if (major > 2)
+		flags = header[9];
 
-		i += 4;
-		field_size = char_to_int(&buffer[i]);
+	unsigned start = position + used;
+	unsigned raw = read_bytes(&buffer[start - base], end - start, size, tag_unsync, nullptr);
+	f.truncated = false;
+	if (raw == 0 && size > 0) {
+		/* Without unsynchronisation the rest of the frame can be skipped. */
+		if (tag_unsync || start + size > tag_end)
+			return false;
+		raw = end - start;
+		f.truncated = true;
+	}
 
-		i += 6;
-		for (int j = i; j < field_size + i; j++)
-			content += buffer[j];
-		this->id3_frames[1].push_back(content);
+	f.id = &buffer[position - base];
+	f.id_length = id_length;
+	f.data = &buffer[start - base];
+	f.size = raw;
 
-		i += field_size;
-		str = (char)buffer[i];
+	/* Some flags add bytes between the header and the body. */
+	unsigned extra = 0;
+	if (major == 3) {
+		f.compressed = flags & 0x80;
+		f.encrypted = flags & 0x40;
+		f.unsynchronised = tag_unsync;
+		extra = (f.compressed ? 4 : 0) + (f.encrypted ? 1 : 0) + (flags & 0x20 ? 1 : 0);
+	} else if (major > 3) {
+		f.compressed = flags & 0x08;
+		f.encrypted = flags & 0x04;
+		f.unsynchronised = (flags & 0x02) || id3_flags[Unsynchronisation];
+		extra = (flags & 0x40 ? 1 : 0) + (f.encrypted ? 1 : 0) + (flags & 0x01 ? 4 : 0);
+	} else {
+		f.compressed = false;
+		f.encrypted = false;
+		f.unsynchronised = tag_unsync;
 	}
+
+	used = read_bytes(f.data, f.size, extra, tag_unsync, nullptr);
+	if (used == 0 && extra > 0)
+		return false;
+	f.data += used;
+	f.size -= used;
+
+	position = start + (f.truncated ? size : raw);
+	return true;
+}
+
+bool id3::find_frame(const char *id, frame &f)
+{
+	unsigned length = strlen(id);
+	unsigned position = 0;
+	while (get_frame(position, f))
+		if (f.id_length == length && memcmp(f.id, id, length) == 0)
+			return true;
+	return false;
 }
 
-const vector<string> *id3::get_id3_fields()
+unsigned id3::resync(const unsigned char *data, unsigned size, unsigned char *out)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < size; i++) {
+		out[n++] = data[i];
+		if (data[i] == 0xFF && i + 1 < size && data[i + 1] == 0x00)
+			i++;
+	}
+	return n;
+}
+
+/* Reads the body of a frame, undoing unsynchronisation. */
+struct frame_reader {
+	const unsigned char *position;
+	const unsigned char *end;
+	bool unsync;
+
+	bool more()
+	{
+		return position < end;
+	}
+
+	unsigned char next()
+	{
+		unsigned char byte = *position++;
+		if (unsync && byte == 0xFF && position < end && *position == 0x00)
+			position++;
+		return byte;
+	}
+};
+
+/** Append a code point as UTF-8 if it fits, leaving room for the terminator. */
+static unsigned put_utf8(unsigned code, char *text, unsigned length, unsigned capacity)
 {
-	return this->id3_frames;
+	unsigned char bytes[4];
+	unsigned n;
+	if (code < 0x80) {
+		bytes[0] = code;
+		n = 1;
+	} else if (code < 0x800) {
+		bytes[0] = 0xC0 | (code >> 6);
+		bytes[1] = 0x80 | (code & 0x3F);
+		n = 2;
+	} else if (code < 0x10000) {
+		bytes[0] = 0xE0 | (code >> 12);
+		bytes[1] = 0x80 | ((code >> 6) & 0x3F);
+		bytes[2] = 0x80 | (code & 0x3F);
+		n = 3;
+	} else {
+		bytes[0] = 0xF0 | (code >> 18);
+		bytes[1] = 0x80 | ((code >> 12) & 0x3F);
+		bytes[2] = 0x80 | ((code >> 6) & 0x3F);
+		bytes[3] = 0x80 | (code & 0x3F);
+		n = 4;
+	}
+
+	if (text == nullptr || length + n >= capacity)
+		return length;
+	memcpy(&text[length], bytes, n);
+	return length + n;
 }
 
-unsigned int id3::get_id3_fields_length()
+/**
+ * Decode one string up to its terminator.
+ * @param reader
+ * @param encoding 0: ISO-8859-1, 1: UTF-16 with BOM, 2: UTF-16BE, 3: UTF-8.
+ * @param text Null to skip the string.
+ * @param length Bytes already in text.
+ * @param capacity
+ * @return The new length.
+ */
+static unsigned decode_string(frame_reader &reader, int encoding, char *text,
+	unsigned length, unsigned capacity)
 {
-	return this->id3_frames[1].size();
+	bool little_endian = false;
+	bool first = true;
+
+	while (reader.more()) {
+		unsigned code;
+		if (encoding == 0) {
+			code = reader.next();
+		} else if (encoding == 3) {
+			code = reader.next();
+			int follow = code >= 0xF0 ? 3 : (code >= 0xE0 ? 2 : (code >= 0xC0 ? 1 : 0));
+			code &= follow == 0 ? 0x7F : 0x3F >> follow;
+			for (int i = 0; i < follow && reader.more(); i++)
+				code = (code << 6) | (reader.next() & 0x3F);
+		} else {
+			if (!reader.more())
+				break;
+			unsigned char a = reader.next();
+			if (!reader.more())
+				break;
+			unsigned char b = reader.next();
+			code = little_endian ? (b << 8 | a) : (a << 8 | b);
+			if (first && encoding == 1 && (code == 0xFEFF || code == 0xFFFE)) {
+				little_endian = code == 0xFFFE;
+				first = false;
+				continue;
+			}
+			if (code >= 0xD800 && code < 0xDC00 && reader.more()) {
+				unsigned char c = reader.next();
+				unsigned char d = reader.more() ? reader.next() : 0;
+				unsigned low = little_endian ? (d << 8 | c) : (c << 8 | d);
+				code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+			}
+		}
+		first = false;
+
+		if (code == 0)
+			break;
+		unsigned next = put_utf8(code, text, length, capacity);
+		if (text != nullptr && next == length) {
+			/* The text is full. */
+			reader.position = reader.end;
+			break;
+		}
+		length = next;
+	}
+
+	return length;
+}
+
+unsigned id3::get_text(const frame &f, char *text, unsigned capacity)
+{
+	if (capacity == 0)
+		return 0;
+	text[0] = '\0';
+	if (f.compressed || f.encrypted || f.size == 0)
+		return 0;
+
+	bool comment = f.id_length == 4 ? memcmp(f.id, "COMM", 4) == 0 || memcmp(f.id, "USLT", 4) == 0 :
+		memcmp(f.id, "COM", 3) == 0 || memcmp(f.id, "ULT", 3) == 0;
+	bool user_text = f.id_length == 4 ? memcmp(f.id, "TXXX", 4) == 0 : memcmp(f.id, "TXX", 3) == 0;
+	if (f.id[0] != 'T' && !comment)
+		return 0;
+
+	frame_reader reader {f.data, f.data + f.size, f.unsynchronised};
+	int encoding = reader.next();
+	if (encoding > 3)
+		return 0;
+
+	/* A language, then a description precedes the text of a comment. */
+	if (comment)
+		for (int i = 0; i < 3 && reader.more(); i++)
+			reader.next();
+	if (comment || user_text)
+		decode_string(reader, encoding, nullptr, 0, 0);
+
+	unsigned length = 0;
+	while (reader.more()) {
+		unsigned start = length;
+		if (length > 0)
+			length = put_utf8('/', text, length, capacity);
+		unsigned before = length;
+		length = decode_string(reader, encoding, text, length, capacity);
+		/* Drop the separator of an empty string, such as a trailing one. */
+		if (length == before)
+			length = start;
+	}
+
+	text[length] = '\0';
+	return length;
+}
+
+bool id3::get_picture(const frame &f, picture &p)
+{
+	bool v22 = f.id_length == 3;
+	if (f.compressed || f.encrypted || memcmp(f.id, v22 ? "PIC" : "APIC", f.id_length) != 0)
+		return false;
+
+	frame_reader reader {f.data, f.data + f.size, f.unsynchronised};
+	if (!reader.more())
+		return false;
+	int encoding = reader.next();
+	if (encoding > 3)
+		return false;
+
+	p.mime = reader.position;
+	if (v22) {
+		for (int i = 0; i < 3 && reader.more(); i++)
+			reader.next();
+		p.mime_length = 3;
+	} else {
+		while (reader.more() && *reader.position != 0)
+			reader.next();
+		p.mime_length = reader.position - p.mime;
+		if (reader.more())
+			reader.next();
+	}
+
+	if (!reader.more())
+		return false;
+	p.type = reader.next();
+	decode_string(reader, encoding, nullptr, 0, 0);
+
+	p.data = const_cast<unsigned char *>(reader.position);
+	p.size = reader.end - reader.position;
+	p.unsynchronised = f.unsynchronised;
+	return true;
 }
@@ -4,35 +4,15 @@
  * ID3 contains meta data irrelevant to the decoder. The header contains an
  * offset used to determine the location of the first MP3 header.
  * | Header | Additional header (optional) | Meta Data | Footer (optional) |
+ *
+ * Frames aren't copied. They are read from the buffer when they are asked for,
+ * and their text and pictures are only decoded on demand.
  */
 
 #ifndef ID3_H
 #define ID3_H
 
-#include <string>
-#include <vector>
-#include <stdio.h>
-
-using std::string;
-using std::vector;
-
 class id3 {
-private:
-	unsigned char *buffer;
-	bool valid;
-	unsigned int start;
-	string version;
-	unsigned int offset;
-	bool id3_flags[4];
-	unsigned int extended_header_size;
-	vector<string> id3_frames[2];
-
-	void set_version(unsigned char version, unsigned char revision);
-	bool set_flags(unsigned char flags);
-	void set_offset(int offset);
-	void set_extended_header_size(int size);
-	void set_fields(unsigned char *buffer);
-
 public:
 	enum Flags {
 		FooterPresent = 0,
@@ -41,16 +21,119 @@ public:
 		Unsynchronisation = 3
 	};
 
-	id3(unsigned char *buffer);
-	id3(const id3 &orig);
+	/** A view of a frame in the tag. */
+	struct frame {
+		/* Four characters, or three in version 2.2. Not terminated. */
+		const unsigned char *id;
+		unsigned id_length;
+		/* The frame body, without the extra bytes that some flags add. */
+		unsigned char *data;
+		unsigned size;
+		bool compressed;
+		bool encrypted;
+		/* Every 0xFF in data is followed by a 0x00 that isn't part of the body. */
+		bool unsynchronised;
+		/* The body continues past the end of the buffer. */
+		bool truncated;
+	};
+
+	/** A view of an attached picture (APIC, or PIC in version 2.2). */
+	struct picture {
+		/* A MIME type, or a three letter format in version 2.2. Not terminated. */
+		const unsigned char *mime;
+		unsigned mime_length;
+		unsigned char type;
+		unsigned char *data;
+		unsigned size;
+		/* See frame::unsynchronised and resync(). */
+		bool unsynchronised;
+	};
+
+	/**
+	 * @param buffer Points to where a tag might start.
+	 * @param size Number of bytes available in buffer.
+	 */
+	id3(unsigned char *buffer, unsigned size);
 
 	bool is_valid();
-	string get_id3_version();
+	const char *get_id3_version();
 	const bool *get_id3_flags();
+	/** Size of the tag, excluding the header and the footer. */
 	int get_id3_offset();
+	/** Size of the tag, including the header and the footer. */
+	unsigned get_id3_size();
 	int get_id3_extended_header_size();
-	const vector<string> *get_id3_fields();
-	unsigned int get_id3_fields_length();
+
+	/**
+	 * Step through the frames.
+	 * @param position Zero for the first frame. Updated to point to the next one.
+	 * @param f
+	 * @return False after the last frame.
+	 */
+	bool get_frame(unsigned &position, frame &f);
+
+	/**
+	 * @param id A frame ID such as "TIT2".
+	 * @param f
+	 * @return False if the tag has no such frame.
+	 */
+	bool find_frame(const char *id, frame &f);
+
+	/**
+	 * Continue with another part of a tag that doesn't fit in the buffer. Frames
+	 * can then be read from position onwards. Unsynchronised tags of version 2.2
+	 * and 2.3 can't be skipped through, and must be read as a whole.
+	 * @param buffer Bytes of the tag, starting at position.
+	 * @param size Number of bytes in buffer.
+	 * @param position Relative to the start of the tag, as used by get_frame().
+	 */
+	void set_window(unsigned char *buffer, unsigned size, unsigned position);
+
+	/**
+	 * Decode the text of a text frame (T***), or of a comment or lyrics frame
+	 * (COMM, USLT). Multiple strings are separated by '/'.
+	 * @param f
+	 * @param text Receives UTF-8, always terminated.
+	 * @param capacity Size of text in bytes. Longer text is cut off.
+	 * @return Length of the text, or 0 if the frame can't be decoded.
+	 */
+	static unsigned get_text(const frame &f, char *text, unsigned capacity);
+
+	/**
+	 * @param f
+	 * @param p
+	 * @return False if the frame isn't a picture or can't be decoded.
+	 */
+	static bool get_picture(const frame &f, picture &p);
+
+	/**
+	 * Remove unsynchronisation. Output can't be larger than input.
+	 * @return Size of the output.
+	 */
+	static unsigned resync(const unsigned char *data, unsigned size, unsigned char *out);
+
+private:
+	unsigned char *buffer;
+	/* The buffer holds the tag from base onwards. */
+	unsigned base;
+	unsigned available;
+	bool valid;
+	unsigned major;
+	char version[12];
+	unsigned int offset;
+	bool id3_flags[4];
+	unsigned int extended_header_size;
+	/* Frames lie between first_frame and tag_end, relative to the start of the
+	 * tag. The buffer ends at end. */
+	unsigned first_frame;
+	unsigned tag_end;
+	unsigned end;
+
+	void set_version(unsigned char version, unsigned char revision);
+	bool set_flags(unsigned char flags);
+	void set_offset(unsigned char *buffer);
+	void set_extended_header_size(unsigned char *buffer);
+	void set_frames();
 };
 
 #endif	/* ID3_H */
@@ -4,100 +4,1317 @@
  * A simplistic MPEG-1 layer 3 decoder.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <errno.h>
 #include <fstream>
+#include <mutex>
 #include <stdio.h>
-#include <alsa/asoundlib.h> /* dnf install alsa-lib-devel */ /* apt install libasound2-dev */
+#include <string>
+#include <signal.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unordered_set>
 #include <vector>
+#include <new>
+#include <string.h>
+#include <stdlib.h>
+#include "deadline.h"
 #include "id3.h"
+#include "mapped_file.h"
 #include "mp3.h"
+#include "player.h"
+#include "pool.h"
+#include "probe.h"
+#include "range.h"
+#include "reader.h"
+#include "server.h"
+#include "shm_ring.h"
+#include "sink.h"
+#include "splice.h"
+#include "util.h"
 #include "xing.h"
 
-#define ALSA_PCM_NEW_HW_PARAMS_API
+/* Set by --check-alloc. Allocations are counted both with new and with the
+ * allocator that decoders use. */
+static bool count_allocations = false;
+static unsigned long allocations = 0;
+
+void *operator new(size_t size)
+{
+	if (count_allocations)
+		allocations++;
+	void *pointer = malloc(size > 0 ? size : 1);
+	if (pointer == nullptr)
+		throw std::bad_alloc();
+	return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+	free(pointer);
+}
+
+static void *counting_allocate(size_t size, void *)
+{
+	if (count_allocations)
+		allocations++;
+	return malloc(size);
+}
+
+static void counting_release(void *pointer, void *)
+{
+	free(pointer);
+}
+
+/**
+ * Decode a granule of the frame at offset, and move offset to the next frame
+ * after the second granule.
+ * @param gr 0 or 1.
+ * @return False if there is no complete frame at offset.
+ */
+bool decode_granule(mp3 &decoder, mapped_file &buffer, unsigned &offset, int gr)
+{
+	if (gr == 0) {
+		if (!decoder.is_valid() || buffer.size() < offset + decoder.get_header_size())
+			return false;
+		decoder.init_header_params(&buffer[offset]);
+		if (!decoder.is_valid() || buffer.size() < offset + decoder.get_frame_size())
+			return false;
+	}
+	decoder.init_granule_params(&buffer[offset], gr);
+	if (gr == 1)
+		offset += decoder.get_frame_size();
+	return true;
+}
 
+/**
+ * Decode the frame at offset and move offset to the next frame.
+ * @return False if there is no complete frame at offset.
+ */
+bool decode_frame(mp3 &decoder, mapped_file &buffer, unsigned &offset)
+{
+	return decode_granule(decoder, buffer, offset, 0) && decode_granule(decoder, buffer, offset, 1);
+}
+
+static const char *degradation_names[] = {"whole", "half band", "quarter band", "concealed"};
+
+/**
+ * Let a scheduler choose the degradation of the next frame, and report when it
+ * changes.
+ * @param decoder
+ * @param scheduler
+ * @param frame
+ * @param slack Seconds until the samples of the frame are due.
+ */
+void plan_frame(mp3 &decoder, deadline_scheduler &scheduler, unsigned frame, double slack)
+{
+	decoder.set_degradation(scheduler.plan(slack));
+	if (scheduler.has_changed())
+		fprintf(stderr, "Frame %u: %s, %.1f ms to spare.\n", frame,
+			degradation_names[scheduler.get_degradation()], slack * 1e3);
+}
+
+/** Report how many frames were degraded and how often. */
+void report_degradation(deadline_scheduler &scheduler)
+{
+	fprintf(stderr, "Frames %lu whole, %lu half band, %lu quarter band, %lu concealed; "
+		"%lu steps down, %lu up, %lu late.\n",
+		scheduler.get_frames(mp3::Intact), scheduler.get_frames(mp3::HalfBand),
+		scheduler.get_frames(mp3::QuarterBand), scheduler.get_frames(mp3::Concealed),
+		scheduler.get_step_downs(), scheduler.get_step_ups(), scheduler.get_misses());
+}
+
+#ifdef HAVE_ALSA
 /**
  * Start decoding the MP3 and let ALSA hand the PCM stream over to a driver.
+ * Decoding runs ahead of playback on another thread.
  * @param decoder
  * @param buffer A buffer containing the MP3 bit stream.
  * @param offset An offset to a MP3 frame header.
+ * @param ahead Frames to decode ahead of the device, or 0 to play each granule
+ * as soon as it is decoded.
+ * @param deadline Degrade frames that would be decoded after the samples
+ * before them have been played.
  */
-inline void stream(mp3 &decoder, std::vector<unsigned char> &buffer, unsigned offset)
+inline void stream(mp3 &decoder, mapped_file &buffer, unsigned offset, unsigned ahead, bool deadline)
 {
-	unsigned sampling_rate = decoder.get_sampling_rate();
 	unsigned channels = decoder.get_channel_mode() == mp3::Mono ? 1 : 2;
-	snd_pcm_t *handle;
-	snd_pcm_hw_params_t *hw = NULL;
-	snd_pcm_uframes_t frames = 128;
-
-	if (snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0)
+	player output(decoder.get_output_rate(), channels, ahead * decoder.get_sample_count(), ahead > 0 ? player::Buffered : player::Live);
+	if (!output.is_valid())
 		exit(1);
 
-	snd_pcm_hw_params_alloca(&hw);
-	snd_pcm_hw_params_any(handle, hw);
+	deadline_scheduler scheduler;
+	if (deadline)
+		decoder.set_concealment(true);
+	unsigned frame = 0;
+	int gr = 0;
+	output.play([&](const float *&samples) -> unsigned {
+		std::chrono::steady_clock::time_point begin;
+		double slack = 0;
+		if (deadline && gr == 0) {
+			/* Decoding here runs on the thread that fills the ring, so only
+			 * the live player may ask the device for its delay. */
+			slack = ahead > 0 ? output.get_queued() : output.get_delay();
+			plan_frame(decoder, scheduler, frame, slack);
+			begin = std::chrono::steady_clock::now();
+		}
+		unsigned count;
+		if (ahead > 0) {
+			if (!decode_frame(decoder, buffer, offset))
+				return 0;
+			samples = decoder.get_samples();
+			count = decoder.get_sample_count();
+		} else {
+			if (!decode_granule(decoder, buffer, offset, gr))
+				return 0;
+			samples = decoder.get_granule_samples(gr);
+			count = decoder.get_granule_sample_count(gr);
+			gr ^= 1;
+		}
+		if (deadline && (ahead > 0 || gr == 1)) {
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+			scheduler.record(ahead > 0 ? elapsed.count() : 2 * elapsed.count(), slack);
+		}
+		if (ahead > 0 || gr == 0)
+			frame++;
+		return count;
+	});
 
-	if (snd_pcm_hw_params_set_access(handle, hw, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
-		exit(1);
-	if (snd_pcm_hw_params_set_format(handle, hw, SND_PCM_FORMAT_FLOAT_LE) < 0)
-		exit(1);
-	if (snd_pcm_hw_params_set_channels(handle, hw, channels) < 0)
-		exit(1);
-	if (snd_pcm_hw_params_set_rate_near(handle, hw, &sampling_rate, NULL) < 0)
-		exit(1);
-	if (snd_pcm_hw_params_set_period_size_near(handle, hw, &frames, NULL) < 0)
-		exit(1);
-	if (snd_pcm_hw_params(handle, hw) < 0)
-		exit(1);
-	if (snd_pcm_hw_params_get_period_size(hw, &frames, NULL) < 0)
-		exit(1);
-	if (snd_pcm_hw_params_get_period_time(hw, &sampling_rate, NULL) < 0)
-		exit(1);
+	if (output.get_underruns() > 0 || output.get_xruns() > 0)
+		fprintf(stderr, "%lu underruns, %lu xruns.\n", output.get_underruns(), output.get_xruns());
+	if (deadline)
+		report_degradation(scheduler);
+}
+#endif
 
-	/* Start decoding. */
-	while (decoder.is_valid() && buffer.size() > offset + decoder.get_header_size()) {
-		decoder.init_header_params(&buffer[offset]);
-		if (decoder.is_valid()) {
-			decoder.init_frame_params(&buffer[offset]);
-			offset += decoder.get_frame_size();
+/**
+ * Decode every frame from offset into a sink.
+ * @param decoder
+ * @param buffer A buffer containing the MP3 bit stream.
+ * @param offset An offset to a MP3 frame header.
+ * @param output
+ * @param frames Receives the number of frames decoded.
+ * @param samples Receives the number of samples per channel written.
+ * @return False if the sink failed.
+ */
+bool decode_all(mp3 &decoder, mapped_file &buffer, unsigned offset, sink &output,
+	unsigned &frames, unsigned long long &samples)
+{
+	bool written = true;
+	frames = 0;
+	samples = 0;
+	while (written && decode_frame(decoder, buffer, offset)) {
+		written = output.write(decoder.get_samples(), decoder.get_sample_count());
+		samples += decoder.get_sample_count();
+		frames++;
+	}
+	return output.finish() && written;
+}
+
+/**
+ * Decode into a sink as fast as it takes the samples, and report how fast that
+ * was on stderr, since stdout may be the sink.
+ * @param decoder
+ * @param buffer A buffer containing the MP3 bit stream.
+ * @param offset An offset to a MP3 frame header.
+ * @param output
+ * @return False if the sink failed.
+ */
+bool transcode(mp3 &decoder, mapped_file &buffer, unsigned offset, sink &output)
+{
+	timespec start, end;
+	unsigned frames;
+	unsigned long long samples;
+
+	unsigned granules = decoder.get_granules();
+	unsigned silent = decoder.get_silent_granules();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool written = decode_all(decoder, buffer, offset, output, frames, samples);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	granules = decoder.get_granules() - granules;
+	silent = decoder.get_silent_granules() - silent;
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double audio = (double)samples / decoder.get_output_rate();
+	fprintf(stderr, "%u frames in %.3f s, %.0f times real time, %.1f%% of granules silent.\n",
+		frames, seconds, seconds > 0 ? audio / seconds : 0,
+		granules > 0 ? 100.0 * silent / granules : 0);
+	if (!written)
+		fprintf(stderr, "Could not write the output.\n");
+	return written;
+}
+
+/**
+ * Decode into a sink as if the frames arrived in real time, or speed times
+ * as fast, and each had to be decoded before the frames that arrived in the
+ * meantime were played, ahead frames after it arrived. A deadline_scheduler
+ * degrades the frames that would be late. This tries out degradation without
+ * loading the host.
+ * @param decoder
+ * @param buffer A buffer containing the MP3 bit stream.
+ * @param offset An offset to a MP3 frame header.
+ * @param output
+ * @param ahead
+ * @param speed
+ * @return False if the sink failed.
+ */
+bool decode_paced(mp3 &decoder, mapped_file &buffer, unsigned offset, sink &output,
+	unsigned ahead, double speed)
+{
+	deadline_scheduler scheduler;
+	decoder.set_concealment(true);
+	double period = (decoder.get_mpeg_version() == 1 ? 1152.0 : 576.0) / decoder.get_sampling_rate() / speed;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool written = true;
+	unsigned frame = 0;
+
+	while (written && decoder.is_valid() && offset + decoder.get_header_size() <= buffer.size()) {
+		std::chrono::duration<double> arrival(frame * period);
+		std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(arrival));
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		std::chrono::duration<double> now = begin - start;
+		double slack = (frame + ahead) * period - now.count();
+
+		plan_frame(decoder, scheduler, frame, slack);
+		if (!decode_frame(decoder, buffer, offset))
+			break;
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+		scheduler.record(elapsed.count(), slack);
+		written = output.write(decoder.get_samples(), decoder.get_sample_count());
+		frame++;
+	}
+	written = output.finish() && written;
+
+	report_degradation(scheduler);
+	if (!written)
+		fprintf(stderr, "Could not write the output.\n");
+	return written;
+}
+
+/**
+ * Decode some frames into a sink, then save where the next frame starts and
+ * the state of the decoder, which --resume continues from as if decoding had
+ * never stopped.
+ * @param decoder
+ * @param buffer A buffer containing the MP3 bit stream.
+ * @param offset An offset to a MP3 frame header.
+ * @param frames
+ * @param output
+ * @param path Receives the offset as a little endian word and the state.
+ * @return False if the sink or the checkpoint couldn't be written.
+ */
+bool save_checkpoint(mp3 &decoder, mapped_file &buffer, unsigned offset, unsigned frames,
+	sink &output, const char *path)
+{
+	bool written = true;
+	unsigned decoded = 0;
+	while (written && decoded < frames && decode_frame(decoder, buffer, offset)) {
+		written = output.write(decoder.get_samples(), decoder.get_sample_count());
+		decoded++;
+	}
+	written = output.finish() && written;
+
+	std::vector<unsigned char> state(4 + decoder.get_state_size());
+	put_word(state.data(), offset);
+	decoder.save_state(&state[4]);
+	std::ofstream file(path, std::ios::out | std::ios::binary);
+	file.write((const char *)state.data(), state.size());
+	fprintf(stderr, "%u frames, then %zu bytes of state at offset %u.\n", decoded, state.size() - 4, offset);
+	return file && written;
+}
+
+mapped_file get_file(const char *dir)
+{
+	return mapped_file(dir);
+}
+
+/**
+ * Skip the ID3 tags at the start of a file. There may be more than one.
+ * @return Offset of the first byte after the tags.
+ */
+unsigned skip_id3_tags(mapped_file &buffer)
+{
+	unsigned offset = 0;
+	while (offset < buffer.size()) {
+		id3 tag(&buffer[offset], buffer.size() - offset);
+		if (!tag.is_valid())
+			break;
+		offset += tag.get_id3_size();
+	}
+	return offset;
+}
+
+/**
+ * Cut and join files without decoding them.
+ * @param argc Number of arguments after --splice.
+ * @param argv Output file followed by one or more "input first last" triples.
+ */
+int splice_files(int argc, char **argv)
+{
+	if (argc < 4 || (argc - 1) % 3 != 0) {
+		printf("Usage: mp3decoder --splice out.mp3 in.mp3 first last [in.mp3 first last ...]\n");
+		return -1;
+	}
+
+	splice output;
+	for (int i = 1; i < argc; i += 3) {
+		mapped_file buffer = get_file(argv[i]);
+		if (!output.add(buffer.data(), buffer.size(), atoi(argv[i + 1]), atoi(argv[i + 2]))) {
+			printf("%s is not MPEG-1 layer 3 or doesn't match the previous files.\n", argv[i]);
+			return -1;
 		}
+	}
+	output.finish();
 
-		int e = snd_pcm_writei(handle, decoder.get_samples(), 1152);
-		if (e == -EPIPE)
-			snd_pcm_recover(handle, e, 0);
+	std::ofstream file(argv[0], std::ios::out | std::ios::binary);
+	file.write((const char *)output.get_output().data(), output.get_output().size());
+	printf("%u frames, %u bridging, %u resized.\n", output.get_frame_count(),
+		output.get_bridging_frames(), output.get_resized_frames());
+	return file ? 0 : -1;
+}
+
+/**
+ * Decode a file without playing it and fail if decoding allocates memory after
+ * the first frame.
+ * @param path
+ */
+int check_allocations(const char *path)
+{
+	set_allocator(counting_allocate, counting_release, nullptr);
+
+	mapped_file buffer = get_file(path);
+	unsigned offset = skip_id3_tags(buffer);
+	mp3 decoder(&buffer[offset]);
+
+	unsigned frames = 0;
+	unsigned long frame_allocations = 0;
+	count_allocations = true;
+	while (decode_frame(decoder, buffer, offset)) {
+		if (frames++ == 0)
+			allocations = 0;
+		else if (allocations > frame_allocations)
+			printf("Frame %u allocated %lu times.\n", frames - 1, allocations - frame_allocations);
+		frame_allocations = allocations;
 	}
+	count_allocations = false;
 
-	snd_pcm_drain(handle);
-	snd_pcm_close(handle);
+	printf("%u frames, %lu allocations after the first frame.\n", frames, allocations);
+	return allocations == 0 ? 0 : -1;
 }
 
-std::vector<unsigned char> get_file(const char *dir)
+/**
+ * Decode a file from the start into memory.
+ * @param buffer
+ * @param pcm Receives the interleaved samples.
+ * @return Frames decoded.
+ */
+unsigned decode_to_memory(mapped_file &buffer, std::vector<float> &pcm)
 {
-	std::ifstream file(dir, std::ios::in | std::ios::binary | std::ios::ate);
-	std::vector<unsigned char> buffer(file.tellg());
-	file.seekg(0, std::ios::beg);
-	file.read((char *)buffer.data(), buffer.size());
-	file.close();
-	return std::move(buffer);
+	unsigned offset = skip_id3_tags(buffer);
+	if (offset + 4 > buffer.size())
+		return 0;
+	mp3 decoder(&buffer[offset]);
+	unsigned channels = decoder.get_channel_mode() == mp3::Mono ? 1 : 2;
+	unsigned frames = 0;
+	while (decode_frame(decoder, buffer, offset)) {
+		const float *samples = decoder.get_samples();
+		pcm.insert(pcm.end(), samples, samples + decoder.get_sample_count() * channels);
+		frames++;
+	}
+	return frames;
 }
 
-std::vector<id3> get_id3_tags(std::vector<unsigned char> &buffer, unsigned &offset)
+/**
+ * Decode a file on several threads at once, each with a decoder of its own,
+ * and compare what each decoded with a decode on this thread. Decoders share
+ * tables and nothing else, so the samples must be the same. "make check-tsan"
+ * runs this under ThreadSanitizer, which reports any data race between them.
+ * @param threads
+ * @param path
+ */
+int check_threads(unsigned threads, const char *path)
 {
-	std::vector<id3> tags;
-	int i = 0;
-	bool valid = true;
+	mapped_file buffer = get_file(path);
+	std::vector<std::vector<float>> results(threads);
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable ready;
+	bool started = false;
 
-	while (valid) {
-		id3 tag(&buffer[offset]);
-		if (valid = tag.is_valid()) {
-			tags.push_back(tag);
-			offset += tags[i++].get_id3_offset() + 10;
+	/* The threads start together so that their first frames overlap. */
+	for (unsigned t = 0; t < threads; t++)
+		workers.emplace_back([&, t]() {
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				ready.wait(guard, [&]() { return started; });
+			}
+			decode_to_memory(buffer, results[t]);
+		});
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		started = true;
+	}
+	ready.notify_all();
+	for (std::thread &worker : workers)
+		worker.join();
+
+	std::vector<float> expected;
+	unsigned frames = decode_to_memory(buffer, expected);
+	if (frames == 0) {
+		printf("No MP3 frames found.\n");
+		return -1;
+	}
+	unsigned differing = 0;
+	for (unsigned t = 0; t < threads; t++)
+		if (results[t].size() != expected.size() ||
+			memcmp(results[t].data(), expected.data(), expected.size() * sizeof(float)) != 0) {
+			printf("Thread %u decoded different samples.\n", t);
+			differing++;
 		}
+	printf("%u frames on %u threads, %u differing from one thread.\n", frames, threads, differing);
+	return differing == 0 ? 0 : -1;
+}
+
+#ifdef HAVE_ALSA
+/**
+ * Time how long samples take from the arrival of their frame to the DAC. The
+ * frames of a file are fed in as if they arrived in real time, and the moment
+ * the first sample of each frame is played is taken from the delay of a live
+ * device. This is done once writing whole frames and once writing granules.
+ * @param path
+ */
+int measure_latency(const char *path)
+{
+	const unsigned frames = 200;
+	static float silence[4096 * 2];
+	mapped_file buffer = get_file(path);
+	unsigned start = skip_id3_tags(buffer);
+
+	for (unsigned step = 1152; step >= 576; step /= 2) {
+		unsigned offset = start;
+		mp3 decoder(&buffer[offset]);
+		if (!decoder.is_valid()) {
+			printf("No MP3 frames found.\n");
+			return -1;
+		}
+		double rate = decoder.get_sampling_rate();
+		unsigned channels = decoder.get_channel_mode() == mp3::Mono ? 1 : 2;
+		player output(rate, channels, 0, player::Live);
+		if (!output.is_valid())
+			return -1;
+
+		/* Two periods of silence keep the device going while a frame is decoded. */
+		unsigned lead = 2 * output.get_period();
+		output.write(silence, lead < 4096 ? lead : 4096);
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		double least = 1e9, most = 0, total = 0;
+		unsigned frame = 0;
+
+		for (; frame < frames; frame++) {
+			std::chrono::steady_clock::time_point arrival = begin +
+				std::chrono::microseconds((long long)(frame * 1152 / rate * 1e6));
+			std::this_thread::sleep_until(arrival);
+
+			double latency = 0;
+			for (int gr = 0; gr < 2; gr += step / 576) {
+				if (!decode_granule(decoder, buffer, offset, gr))
+					break;
+				if (step == 1152) {
+					decode_granule(decoder, buffer, offset, 1);
+					output.write(decoder.get_samples(), 1152);
+				} else
+					output.write(decoder.get_granule_samples(gr), 576);
+				if (gr == 0) {
+					std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - arrival;
+					latency = elapsed.count() + output.get_delay() - step / rate;
+				}
+			}
+			if (latency == 0)
+				break;
+			least = latency < least ? latency : least;
+			most = latency > most ? latency : most;
+			total += latency;
+		}
+
+		printf("%s: %u frames, latency %.2f min, %.2f average, %.2f max ms, %lu xruns.\n",
+			step == 1152 ? "Frames" : "Granules", frame, least * 1e3,
+			frame > 0 ? total / frame * 1e3 : 0, most * 1e3, output.get_xruns());
 	}
+	return 0;
+}
+#endif
+
+/* Paths that --probe still has to visit, shared by its threads. */
+struct crawl {
+	struct item {
+		std::string path;
+		/* DT_DIR, DT_REG, or DT_UNKNOWN if stat() has to tell. */
+		unsigned char type;
+		/* Named on the command line, so probed whatever its extension. */
+		bool named;
+	};
 
-	return tags;
+	std::mutex lock;
+	std::condition_variable ready;
+	std::vector<item> pending;
+	unsigned busy = 0;
+	unsigned long files = 0;
+	unsigned long long bytes_read = 0;
+};
+
+static bool has_mp3_extension(const std::string &path)
+{
+	return path.size() > 4 && strcasecmp(path.c_str() + path.size() - 4, ".mp3") == 0;
+}
+
+/**
+ * Print a line with the properties of a file:
+ * path, seconds, bit rate, sampling rate, channels, CBR/VBR, title, artist,
+ * album, year, track and genre. Estimated durations end with a '~'.
+ * @param path
+ * @return Bytes read.
+ */
+unsigned print_probe(const char *path)
+{
+	probe file(path);
+	char line[1536];
+
+	if (!file.is_valid())
+		snprintf(line, sizeof(line), "%s\tinvalid\n", path);
+	else
+		snprintf(line, sizeof(line), "%s\t%.3f%s\t%u\t%u\t%u\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n", path,
+			file.get_duration(), file.is_estimated() ? "~" : "", file.get_bit_rate(),
+			file.get_sampling_rate(), file.get_channel_mode() == mp3::Mono ? 1 : 2,
+			file.is_vbr() ? "VBR" : "CBR", file.get_field(probe::Title),
+			file.get_field(probe::Artist), file.get_field(probe::Album),
+			file.get_field(probe::Year), file.get_field(probe::Track), file.get_field(probe::Genre));
+	/* A single call, so lines of different threads don't mix. */
+	fputs(line, stdout);
+	return file.get_bytes_read();
+}
+
+/**
+ * Take paths from the crawl until every thread runs out of them. Directories
+ * add their entries to the crawl.
+ * @param shared
+ */
+void probe_worker(crawl &shared)
+{
+	std::unique_lock<std::mutex> guard(shared.lock);
+	while (true) {
+		while (shared.pending.empty() && shared.busy > 0)
+			shared.ready.wait(guard);
+		if (shared.pending.empty())
+			break;
+
+		crawl::item item = shared.pending.back();
+		shared.pending.pop_back();
+		shared.busy++;
+		guard.unlock();
+
+		std::vector<crawl::item> entries;
+		unsigned bytes_read = 0;
+		bool probed = false;
+		if (item.type == DT_UNKNOWN) {
+			struct stat status;
+			if (stat(item.path.c_str(), &status) == 0)
+				item.type = S_ISDIR(status.st_mode) ? DT_DIR : S_ISREG(status.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if (item.type == DT_DIR) {
+			DIR *dir = opendir(item.path.c_str());
+			while (dirent *entry = dir != nullptr ? readdir(dir) : nullptr) {
+				if (entry->d_name[0] == '.')
+					continue;
+				std::string path = item.path + "/" + entry->d_name;
+				if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN ||
+					(entry->d_type == DT_REG && has_mp3_extension(path)))
+					entries.push_back({path, entry->d_type, false});
+			}
+			if (dir != nullptr)
+				closedir(dir);
+		} else if (item.type == DT_REG && (item.named || has_mp3_extension(item.path))) {
+			bytes_read = print_probe(item.path.c_str());
+			probed = true;
+		}
+
+		guard.lock();
+		shared.busy--;
+		shared.files += probed;
+		shared.bytes_read += bytes_read;
+		shared.pending.insert(shared.pending.end(), entries.begin(), entries.end());
+		if (!entries.empty() || (shared.pending.empty() && shared.busy == 0))
+			shared.ready.notify_all();
+	}
+}
+
+/**
+ * Print the properties and tags of files without decoding them. Directories are
+ * searched for MP3 files.
+ * @param argc Number of arguments after --probe.
+ * @param argv Optionally "--jobs N", followed by files and directories.
+ */
+int probe_files(int argc, char **argv)
+{
+	unsigned jobs = std::thread::hardware_concurrency();
+	if (argc >= 2 && strcmp(argv[0], "--jobs") == 0) {
+		jobs = atoi(argv[1]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 1 || jobs < 1) {
+		printf("Usage: mp3decoder --probe [--jobs N] file|directory ...\n");
+		return -1;
+	}
+
+	crawl shared;
+	for (int i = argc - 1; i >= 0; i--)
+		shared.pending.push_back({argv[i], DT_UNKNOWN, true});
+
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < jobs; i++)
+		threads.emplace_back(probe_worker, std::ref(shared));
+	probe_worker(shared);
+	for (std::thread &thread : threads)
+		thread.join();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%lu files in %.3f s, %.1f us and %llu bytes read per file.\n",
+		shared.files, seconds, shared.files > 0 ? seconds * 1e6 / shared.files : 0,
+		shared.files > 0 ? shared.bytes_read / shared.files : 0);
+	return 0;
+}
+
+/**
+ * @param name low, medium or high.
+ * @param quality
+ * @return False if the name isn't one of them.
+ */
+bool get_quality(const char *name, resampler::Quality &quality)
+{
+	if (strcmp(name, "low") == 0)
+		quality = resampler::Low;
+	else if (strcmp(name, "medium") == 0)
+		quality = resampler::Medium;
+	else if (strcmp(name, "high") == 0)
+		quality = resampler::High;
+	else
+		return false;
+	return true;
+}
+
+/* Files to transcode with --out-dir, and what has been done so far. */
+struct batch {
+	struct item {
+		std::string path;
+		unsigned long long size;
+		/* Unique within the batch. */
+		std::string output;
+	};
+
+	std::vector<item> files;
+	std::string directory;
+	file_sink::Format format;
+	unsigned rate;
+	resampler::Quality quality;
+
+	std::mutex lock;
+	unsigned long done = 0;
+	unsigned long failed = 0;
+	double audio = 0;
+	unsigned long long bytes_read = 0;
+	unsigned long long bytes_written = 0;
+};
+
+/**
+ * Name the output of each file of a batch after the file, with a .wav or .raw
+ * extension. Files in different directories may have the same name, and
+ * would be written to the same output by two threads at once, so names that
+ * are taken get a -2, -3 and so on in the order the files were given.
+ * @param shared
+ */
+void name_outputs(batch &shared)
+{
+	const char *extension = shared.format == file_sink::Wav ? ".wav" : ".raw";
+	std::vector<std::string> names;
+	for (batch::item &file : shared.files) {
+		size_t slash = file.path.rfind('/');
+		std::string name = file.path.substr(slash == std::string::npos ? 0 : slash + 1);
+		if (has_mp3_extension(name))
+			name.resize(name.size() - 4);
+		names.push_back(name);
+	}
+
+	/* A file keeps its own name if it is the first to have it, even if an
+	 * earlier file would take that name as its suffixed one. */
+	std::unordered_set<std::string> all(names.begin(), names.end());
+	std::unordered_set<std::string> taken;
+	for (size_t i = 0; i < names.size(); i++) {
+		batch::item &file = shared.files[i];
+		const std::string &name = names[i];
+		std::string unique = name;
+		unsigned n = 1;
+		while (taken.count(unique) > 0 || (unique != name && all.count(unique) > 0))
+			unique = name + "-" + std::to_string(++n);
+		taken.insert(unique);
+		file.output = shared.directory + "/" + unique + extension;
+		if (unique != name)
+			fprintf(stderr, "%s is written to %s.\n", file.path.c_str(), file.output.c_str());
+	}
+}
+
+/**
+ * Transcode one file of a batch into its output in the output directory.
+ * @param shared
+ * @param index
+ * @param buffer The contents of the file, empty if it couldn't be read.
+ */
+void transcode_file(batch &shared, unsigned index, mapped_file &buffer)
+{
+	static thread_local mp3::workspace work;
+	const std::string &path = shared.files[index].path;
+	const std::string &out = shared.files[index].output;
+
+	bool written = false;
+	unsigned frames = 0;
+	unsigned long long samples = 0;
+	unsigned channels = 0;
+	double audio = 0;
+	try {
+		unsigned offset = skip_id3_tags(buffer);
+		if (offset < buffer.size()) {
+			mp3 decoder(&buffer[offset], &work);
+			if (decoder.is_valid() && decoder.set_output_rate(shared.rate, shared.quality)) {
+				channels = decoder.get_channel_mode() == mp3::Mono ? 1 : 2;
+				file_sink output(out.c_str(), shared.format, decoder.get_output_rate(), channels);
+				written = output.is_valid() &&
+					decode_all(decoder, buffer, offset, output, frames, samples) && frames > 0;
+				audio = (double)samples / decoder.get_output_rate();
+			}
+		}
+	} catch (std::bad_alloc) {
+		written = false;
+	}
+
+	if (!written)
+		fprintf(stderr, "Could not transcode %s.\n", path.c_str());
+	std::lock_guard<std::mutex> guard(shared.lock);
+	shared.done++;
+	shared.failed += !written;
+	shared.audio += audio;
+	shared.bytes_read += buffer.size();
+	shared.bytes_written += samples * channels * sizeof(float);
+}
+
+/**
+ * Map a file of a batch and transcode it.
+ * @param shared
+ * @param index
+ * @param next The file this thread will probably transcode next, to read ahead.
+ */
+void batch_worker(batch &shared, unsigned index, int next)
+{
+	try {
+		mapped_file buffer = get_file(shared.files[index].path.c_str());
+		buffer.read_ahead();
+		if (next >= 0)
+			mapped_file::read_ahead(shared.files[next].path.c_str());
+		transcode_file(shared, index, buffer);
+	} catch (std::bad_alloc) {
+		mapped_file empty;
+		transcode_file(shared, index, empty);
+	}
+}
+
+/**
+ * Transcode files into a directory on several threads. The largest files are
+ * started first, and threads that run out of files take them from others.
+ * @param argc Number of arguments after --out-dir.
+ * @param argv The directory, options, and files.
+ */
+int batch_files(int argc, char **argv)
+{
+	batch shared;
+	unsigned jobs = std::thread::hardware_concurrency();
+	shared.format = file_sink::Wav;
+	shared.rate = 0;
+	shared.quality = resampler::Medium;
+	unsigned depth = 0;
+	bool uring = true;
+
+	int i = 1;
+	for (; i < argc; i++) {
+		if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+			jobs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+			depth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--pread") == 0)
+			uring = false;
+		else if (strcmp(argv[i], "--raw") == 0)
+			shared.format = file_sink::Raw;
+		else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+			shared.rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+			if (!get_quality(argv[++i], shared.quality))
+				jobs = 0;
+		} else
+			break;
+	}
+	if (argc < 1 || i == argc || jobs < 1) {
+		printf("Usage: mp3decoder --out-dir directory [--jobs N] [--depth N [--pread]] [--raw] "
+			"[--rate R [--quality low|medium|high]] file ...\n");
+		return -1;
+	}
+	shared.directory = argv[0];
+
+	for (; i < argc; i++) {
+		struct stat status;
+		unsigned long long size = stat(argv[i], &status) == 0 ? status.st_size : 0;
+		shared.files.push_back({argv[i], size, std::string()});
+	}
+	name_outputs(shared);
+	std::stable_sort(shared.files.begin(), shared.files.end(),
+		[](const batch::item &a, const batch::item &b) { return a.size > b.size; });
+
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pool threads(jobs);
+	if (depth > 0) {
+		/* Each task takes whichever file has been read first. */
+		std::vector<std::string> paths;
+		for (const batch::item &file : shared.files)
+			paths.push_back(file.path);
+		reader input(paths, depth, 2 * jobs, uring);
+		threads.run(shared.files.size(), [&](unsigned, int) {
+			int index;
+			mapped_file buffer = input.take(index);
+			if (index >= 0)
+				transcode_file(shared, index, buffer);
+		});
+		if (!input.is_uring())
+			fprintf(stderr, "Read with pread.\n");
+	} else {
+		threads.run(shared.files.size(), [&](unsigned task, int next) {
+			batch_worker(shared, task, next);
+		});
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (seconds <= 0)
+		seconds = 1e-9;
+	fprintf(stderr, "%lu files in %.3f s, %.0f times real time, %.1f MB/s read, %.1f MB/s written.\n",
+		shared.done - shared.failed, seconds, shared.audio / seconds,
+		shared.bytes_read / seconds / 1e6, shared.bytes_written / seconds / 1e6);
+	return shared.failed == 0 ? 0 : -1;
+}
+
+/* Set while --serve runs, so that a signal can stop it. */
+static server *serving = nullptr;
+
+static void stop_serving(int)
+{
+	if (serving != nullptr)
+		serving->stop();
+}
+
+/** Allow as many open files as the hard limit does, for many connections. */
+static void raise_file_limit()
+{
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/**
+ * Decode streams for clients until interrupted.
+ * @param argc Number of arguments after --serve.
+ * @param argv The socket path, optionally followed by "--jobs N" and "--max N".
+ */
+int serve(int argc, char **argv)
+{
+	unsigned jobs = std::thread::hardware_concurrency();
+	unsigned max_connections = 10000;
+	int i = 1;
+	for (; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--jobs") == 0)
+			jobs = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--max") == 0)
+			max_connections = atoi(argv[i + 1]);
+		else
+			break;
+	}
+	if (argc < 1 || i != argc || jobs < 1) {
+		printf("Usage: mp3decoder --serve socket [--jobs N] [--max N]\n");
+		return -1;
+	}
+
+	raise_file_limit();
+	server decoder(argv[0], max_connections);
+	if (!decoder.is_valid()) {
+		printf("Could not listen on %s.\n", argv[0]);
+		return -1;
+	}
+	serving = &decoder;
+	signal(SIGINT, stop_serving);
+	signal(SIGTERM, stop_serving);
+	decoder.run(jobs);
+	serving = nullptr;
+	fprintf(stderr, "%lu streams decoded.\n", decoder.get_streams());
+	return 0;
+}
+
+/* A connection of the load generator. */
+struct stream_client {
+	int fd;
+	size_t sent;
+	unsigned long long received;
+	unsigned char format[8];
+};
+
+/**
+ * Send the same file to a decoding server over many connections at once, and
+ * report how fast the PCM came back.
+ * @param argc Number of arguments after --connect.
+ * @param argv The socket path, optionally "--connections N" and "--out FILE",
+ * and the file. The output of the first connection is written to FILE.
+ */
+int connect_server(int argc, char **argv)
+{
+	unsigned count = 1;
+	const char *out = nullptr;
+	int i = 1;
+	for (; i + 2 < argc; i += 2) {
+		if (strcmp(argv[i], "--connections") == 0)
+			count = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--out") == 0)
+			out = argv[i + 1];
+		else
+			break;
+	}
+	if (argc < 2 || i != argc - 1 || count < 1) {
+		printf("Usage: mp3decoder --connect socket [--connections N] [--out file.raw] file.mp3\n");
+		return -1;
+	}
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, argv[0], sizeof(address.sun_path) - 1);
+	mapped_file buffer = get_file(argv[i]);
+	FILE *output = out != nullptr ? fopen(out, "wb") : nullptr;
+	raise_file_limit();
+
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	std::vector<stream_client> clients(count);
+	unsigned active = 0;
+	for (unsigned c = 0; c < count; c++) {
+		stream_client &client = clients[c];
+		client.sent = 0;
+		client.received = 0;
+		client.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (client.fd < 0 || connect(client.fd, (sockaddr *)&address, sizeof(address)) != 0) {
+			fprintf(stderr, "Could not connect to %s.\n", argv[0]);
+			return -1;
+		}
+		/* Connected first, since a full backlog would fail a non-blocking connect. */
+		int enable = 1;
+		ioctl(client.fd, FIONBIO, &enable);
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT;
+		event.data.u32 = c;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, client.fd, &event);
+		active++;
+	}
+
+	static unsigned char scratch[1 << 16];
+	epoll_event events[256];
+	while (active > 0) {
+		int n = epoll_wait(epoll, events, 256, -1);
+		for (int e = 0; e < n; e++) {
+			unsigned c = events[e].data.u32;
+			stream_client &client = clients[c];
+			if ((events[e].events & EPOLLOUT) && client.sent < buffer.size()) {
+				size_t size = std::min(buffer.size() - client.sent, sizeof(scratch));
+				ssize_t written = send(client.fd, &buffer[client.sent], size, MSG_NOSIGNAL);
+				if (written > 0)
+					client.sent += written;
+				if (client.sent == buffer.size()) {
+					shutdown(client.fd, SHUT_WR);
+					epoll_event event;
+					event.events = EPOLLIN;
+					event.data.u32 = c;
+					epoll_ctl(epoll, EPOLL_CTL_MOD, client.fd, &event);
+				}
+			}
+			if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				ssize_t received = recv(client.fd, scratch, sizeof(scratch), 0);
+				if (received <= 0 && !(received < 0 && errno == EAGAIN)) {
+					close(client.fd);
+					active--;
+					continue;
+				}
+				if (received < 0)
+					continue;
+				for (ssize_t b = 0; b < received; b++, client.received++) {
+					if (client.received < 8)
+						client.format[client.received] = scratch[b];
+					else if (c == 0 && output != nullptr) {
+						fwrite(&scratch[b], 1, received - b, output);
+						client.received += received - b;
+						break;
+					}
+				}
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(epoll);
+	if (output != nullptr)
+		fclose(output);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double audio = 0;
+	unsigned long long received = 0;
+	unsigned complete = 0;
+	for (stream_client &client : clients) {
+		unsigned char *format = client.format;
+		unsigned rate = format[0] | format[1] << 8 | format[2] << 16 | format[3] << 24;
+		unsigned channels = format[4] | format[5] << 8 | format[6] << 16 | format[7] << 24;
+		received += client.received;
+		if (client.received <= 8 || rate == 0 || channels == 0)
+			continue;
+		audio += (client.received - 8) / (4.0 * channels * rate);
+		complete++;
+	}
+	fprintf(stderr, "%u of %u streams in %.3f s, %.0f times real time, %.1f MB/s sent, %.1f MB/s received.\n",
+		complete, count, seconds, seconds > 0 ? audio / seconds : 0,
+		seconds > 0 ? (double)buffer.size() * count / seconds / 1e6 : 0,
+		seconds > 0 ? received / seconds / 1e6 : 0);
+	return complete == count ? 0 : -1;
+}
+
+/**
+ * Read a shared memory ring to the end, in place.
+ * @return False if the sink failed.
+ */
+bool drain(shm_reader &input, sink &output)
+{
+	unsigned count;
+	bool written = true;
+	while (const float *samples = input.read(count)) {
+		written = output.write(samples, count) && written;
+		input.release(count);
+	}
+	return output.finish() && written;
+}
+
+/**
+ * Read a shared memory ring and report how much was read.
+ * @param name
+ * @param out Raw PCM is written here, or nowhere if nullptr.
+ */
+int read_shared(const char *name, const char *out)
+{
+	shm_reader input(name);
+	if (!input.is_valid()) {
+		printf("Could not attach to %s.\n", name);
+		return -1;
+	}
+
+	bool written;
+	if (out != nullptr) {
+		file_sink output(out, file_sink::Raw, input.get_sampling_rate(), input.get_channels());
+		written = output.is_valid() && drain(input, output);
+	} else {
+		null_sink output;
+		written = drain(input, output);
+	}
+	fprintf(stderr, "%llu samples at %u Hz, %u channels.\n", input.get_position(),
+		input.get_sampling_rate(), input.get_channels());
+	return written ? 0 : -1;
+}
+
+/**
+ * Decode parts of a file through a cache and report what each part took.
+ * @param input
+ * @param cache
+ * @param ranges start:length pairs in seconds. Frames that a part overlaps are
+ * decoded whole.
+ * @param count
+ * @param output
+ * @return False if a range isn't valid or the sink failed.
+ */
+bool read_ranges(range_decoder &input, pcm_cache &cache, char **ranges, int count, sink &output)
+{
+	bool written = true;
+	for (int i = 0; i < count && written; i++) {
+		double start, length;
+		if (sscanf(ranges[i], "%lf:%lf", &start, &length) != 2 || start < 0 || length <= 0) {
+			printf("Expected start:length in seconds, not %s.\n", ranges[i]);
+			return false;
+		}
+		unsigned first = input.get_frame(start);
+		unsigned last = input.get_frame(start + length);
+		if (last >= input.get_frame_count())
+			last = input.get_frame_count() - 1;
+		unsigned frames = first <= last ? last - first + 1 : 0;
+		unsigned long long decoded = input.get_decoded();
+		unsigned long long hits = cache.get_hits();
+
+		timespec begin, end;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		written = input.read(first, frames, output);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+		fprintf(stderr, "%s: %u frames from %u, %llu cached, %llu decoded in %.3f ms.\n", ranges[i],
+			frames, first, cache.get_hits() - hits, input.get_decoded() - decoded, seconds * 1e3);
+	}
+	return output.finish() && written;
+}
+
+/**
+ * Decode parts of a file, as a preview or waveform would request them, through
+ * a cache of decoded frames.
+ * @param argc Number of arguments after --ranges.
+ * @param argv [--cache MB] [--out file] file start:length [start:length ...]
+ */
+int decode_ranges(int argc, char **argv)
+{
+	size_t megabytes = 64;
+	const char *out = nullptr;
+	int i = 0;
+	for (; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--cache") == 0 && i + 2 < argc)
+			megabytes = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--out") == 0 && i + 2 < argc)
+			out = argv[++i];
+		else
+			break;
+	}
+	if (i + 1 >= argc) {
+		printf("Usage: mp3decoder --ranges [--cache MB] [--out file] file start:length [start:length ...]\n");
+		return -1;
+	}
+
+	pcm_cache cache(megabytes << 20);
+	range_decoder input(argv[i], megabytes > 0 ? &cache : nullptr);
+	if (!input.is_valid()) {
+		printf("%s has no frames.\n", argv[i]);
+		return -1;
+	}
+
+	bool written;
+	if (out != nullptr) {
+		file_sink output(out, file_sink::Raw, input.get_sampling_rate(), input.get_channels());
+		if (!output.is_valid()) {
+			printf("Could not create %s.\n", out);
+			return -1;
+		}
+		written = read_ranges(input, cache, &argv[i + 1], argc - i - 1, output);
+	} else {
+		null_sink output;
+		written = read_ranges(input, cache, &argv[i + 1], argc - i - 1, output);
+	}
+	fprintf(stderr, "Cache: %llu hits, %llu misses, %llu evictions, %.1f of %.1f MB.\n",
+		cache.get_hits(), cache.get_misses(), cache.get_evictions(),
+		cache.get_size() / 1048576.0, cache.get_budget() / 1048576.0);
+	return written ? 0 : -1;
 }
 
 int main(int argc, char **argv)
 {
-	if (argc > 2) {
+	try {
+		if (argc > 1 && strcmp(argv[1], "--splice") == 0)
+			return splice_files(argc - 2, argv + 2);
+		if (argc == 3 && strcmp(argv[1], "--check-alloc") == 0)
+			return check_allocations(argv[2]);
+		if (argc == 4 && strcmp(argv[1], "--check-threads") == 0 && atoi(argv[2]) > 0)
+			return check_threads(atoi(argv[2]), argv[3]);
+#ifdef HAVE_ALSA
+		if (argc == 3 && strcmp(argv[1], "--latency") == 0)
+			return measure_latency(argv[2]);
+#endif
+		if (argc > 1 && strcmp(argv[1], "--probe") == 0)
+			return probe_files(argc - 2, argv + 2);
+		if (argc > 1 && strcmp(argv[1], "--out-dir") == 0)
+			return batch_files(argc - 2, argv + 2);
+		if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+			return serve(argc - 2, argv + 2);
+		if (argc > 1 && strcmp(argv[1], "--connect") == 0)
+			return connect_server(argc - 2, argv + 2);
+		if (argc > 1 && strcmp(argv[1], "--ranges") == 0)
+			return decode_ranges(argc - 2, argv + 2);
+		if ((argc == 3 || argc == 5) && strcmp(argv[1], "--shm-read") == 0)
+			return read_shared(argv[2], argc == 5 && strcmp(argv[3], "--out") == 0 ? argv[4] : nullptr);
+	} catch (std::bad_alloc) {
+		printf("File does not exist.\n");
+		return -1;
+	}
+
+	/* Frames decoded ahead of the device, about a second. */
+	unsigned ahead = 40;
+	bool live = false;
+	bool discard = false;
+	const char *out = nullptr;
+	const char *shared = nullptr;
+	unsigned readers = 0;
+	unsigned rate = 0;
+	resampler::Quality quality = resampler::Medium;
+	const char *checkpoint = nullptr;
+	unsigned checkpoint_frames = 0;
+	const char *resume = nullptr;
+	bool deadline = false;
+	double speed = 1;
+	int i = 1;
+	for (; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--ahead") == 0 && i + 2 < argc)
+			ahead = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--live") == 0)
+			live = true;
+		else if (strcmp(argv[i], "--out") == 0 && i + 2 < argc)
+			out = argv[++i];
+		else if (strcmp(argv[i], "--null") == 0)
+			discard = true;
+		else if (strcmp(argv[i], "--shm") == 0 && i + 2 < argc)
+			shared = argv[++i];
+		else if (strcmp(argv[i], "--readers") == 0 && i + 2 < argc)
+			readers = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--rate") == 0 && i + 2 < argc)
+			rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--checkpoint") == 0 && i + 3 < argc) {
+			checkpoint = argv[++i];
+			checkpoint_frames = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--resume") == 0 && i + 2 < argc)
+			resume = argv[++i];
+		else if (strcmp(argv[i], "--deadline") == 0)
+			deadline = true;
+		else if (strcmp(argv[i], "--speed") == 0 && i + 2 < argc)
+			speed = atof(argv[++i]);
+		else if (strcmp(argv[i], "--quality") == 0 && i + 2 < argc) {
+			if (!get_quality(argv[++i], quality))
+				break;
+		} else
+			break;
+	}
+
+	if (i < argc - 1 || ahead < 1 || !(speed > 0)) {
 		printf("Unexpected number of arguments.\n");
 		return -1;
 	} else if (argc == 1) {
@@ -106,11 +1323,62 @@ int main(int argc, char **argv)
 	}
 
 	try {
-		std::vector<unsigned char> buffer = get_file(argv[1]);
-		unsigned offset = 0;
-		std::vector<id3> tags = get_id3_tags(buffer, offset);
+		mapped_file buffer = get_file(argv[i]);
+		unsigned offset = skip_id3_tags(buffer);
+		mapped_file state = resume != nullptr ? get_file(resume) : mapped_file();
+		if (resume != nullptr) {
+			offset = state.size() >= 4 ? get_word(state.data()) : buffer.size();
+			if (offset + 4 > buffer.size()) {
+				printf("%s doesn't belong to %s.\n", resume, argv[i]);
+				return -1;
+			}
+		}
 		mp3 decoder(&buffer[offset]);
-		stream(decoder, buffer, offset);
+		unsigned channels = decoder.get_channel_mode() == mp3::Mono ? 1 : 2;
+		if (!decoder.set_output_rate(rate, quality)) {
+			printf("Can't convert %u Hz to %u Hz.\n", decoder.get_sampling_rate(), rate);
+			return -1;
+		}
+		/* The state brings the rate that it was saved with. */
+		if (resume != nullptr && !decoder.load_state(&state[4], state.size() - 4)) {
+			printf("%s doesn't belong to %s.\n", resume, argv[i]);
+			return -1;
+		}
+		auto decode = [&](sink &output) -> bool {
+			if (checkpoint != nullptr)
+				return save_checkpoint(decoder, buffer, offset, checkpoint_frames, output, checkpoint);
+			if (deadline)
+				return decode_paced(decoder, buffer, offset, output, ahead, speed);
+			return transcode(decoder, buffer, offset, output);
+		};
+
+		if (discard) {
+			null_sink output;
+			return decode(output) ? 0 : -1;
+		} else if (out != nullptr) {
+			size_t length = strlen(out);
+			bool wav = length > 4 && strcasecmp(&out[length - 4], ".wav") == 0;
+			file_sink output(out, wav ? file_sink::Wav : file_sink::Raw, decoder.get_output_rate(), channels);
+			if (!output.is_valid()) {
+				printf("Could not create %s.\n", out);
+				return -1;
+			}
+			return decode(output) ? 0 : -1;
+		} else if (shared != nullptr) {
+			shm_sink output(shared, decoder.get_output_rate(), channels, 1 << 16, readers);
+			if (!output.is_valid()) {
+				printf("Could not create %s.\n", shared);
+				return -1;
+			}
+			return decode(output) ? 0 : -1;
+		}
+#ifdef HAVE_ALSA
+		stream(decoder, buffer, offset, live ? 0 : ahead, deadline);
+#else
+		(void)live;
+		printf("Built without ALSA, so only --out, --null and --shm are available.\n");
+		return -1;
+#endif
 	} catch (std::bad_alloc) {
 		printf("File does not exist.\n");
 		return -1;
@@ -0,0 +1,87 @@
+/*
+ * A read-only file that is mapped into memory. Unlike reading the file into a
+ * buffer, this doesn't allocate, and pages are only read when they are used.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <new>
+#include "mapped_file.h"
+
+mapped_file::mapped_file()
+{
+	buffer = nullptr;
+	length = 0;
+}
+
+mapped_file::mapped_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		throw std::bad_alloc();
+
+	struct stat info;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+		map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::bad_alloc();
+
+	buffer = static_cast<unsigned char *>(map);
+	length = info.st_size;
+}
+
+mapped_file::mapped_file(unsigned char *buffer, size_t length)
+{
+	this->buffer = buffer;
+	this->length = length;
+}
+
+mapped_file::mapped_file(mapped_file &&orig)
+{
+	buffer = orig.buffer;
+	length = orig.length;
+	orig.buffer = nullptr;
+	orig.length = 0;
+}
+
+mapped_file::~mapped_file()
+{
+	if (buffer != nullptr)
+		munmap(buffer, length);
+}
+
+void mapped_file::read_ahead()
+{
+	if (buffer == nullptr)
+		return;
+	madvise(buffer, length, MADV_SEQUENTIAL);
+	madvise(buffer, length, MADV_WILLNEED);
+}
+
+void mapped_file::read_ahead(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+unsigned char *mapped_file::data()
+{
+	return buffer;
+}
+
+size_t mapped_file::size()
+{
+	return length;
+}
+
+unsigned char &mapped_file::operator[](size_t index)
+{
+	return buffer[index];
+}
@@ -0,0 +1,50 @@
+/*
+ * A read-only file that is mapped into memory. Unlike reading the file into a
+ * buffer, this doesn't allocate, and pages are only read when they are used.
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+
+class mapped_file {
+private:
+	unsigned char *buffer;
+	size_t length;
+
+	friend class reader;
+	/** Takes over an anonymous mapping that a file was read into. */
+	mapped_file(unsigned char *buffer, size_t length);
+
+public:
+	/** An empty file, as if it couldn't be read. */
+	mapped_file();
+	/**
+	 * @param path
+	 * @throws std::bad_alloc If the file can't be opened, is empty or can't be
+	 * mapped.
+	 */
+	mapped_file(const char *path);
+	mapped_file(mapped_file &&orig);
+	~mapped_file();
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	/**
+	 * Ask the kernel to read the whole file in the background, and to read
+	 * ahead further than usual, since it will be read from start to end.
+	 */
+	void read_ahead();
+	/**
+	 * Start reading a file that will be mapped soon.
+	 * @param path
+	 */
+	static void read_ahead(const char *path);
+
+	unsigned char *data();
+	size_t size();
+	unsigned char &operator[](size_t index);
+};
+
+#endif	/* MAPPED_FILE_H */
@@ -4,23 +4,111 @@
  * Unpacks and decodes frames/headers.
  */
 
+#include <algorithm>
+#include <new>
 #include <string.h>
 #include "mp3.h"
+#include "tables.h"
 #include "util.h"
 
 #define PI    3.141592653589793
 #define SQRT2 1.414213562373095
 
-mp3::mp3(unsigned char *buffer)
+/* Scale factor band tables as compile-time constants for each sampling rate. A
+ * rate of 0 means the tables chosen at run time by set_tables() are used. */
+template<unsigned rate> struct band_layout {
+	static const unsigned *long_index() { return 0; }
+	static const unsigned *short_index() { return 0; }
+	static const unsigned *short_width() { return 0; }
+};
+
+template<> struct band_layout<32000> {
+	static const unsigned *long_index() { return band_index_table.long_32; }
+	static const unsigned *short_index() { return band_index_table.short_32; }
+	static const unsigned *short_width() { return band_width_table.short_32; }
+};
+
+template<> struct band_layout<44100> {
+	static const unsigned *long_index() { return band_index_table.long_44; }
+	static const unsigned *short_index() { return band_index_table.short_44; }
+	static const unsigned *short_width() { return band_width_table.short_44; }
+};
+
+template<> struct band_layout<48000> {
+	static const unsigned *long_index() { return band_index_table.long_48; }
+	static const unsigned *short_index() { return band_index_table.short_48; }
+	static const unsigned *short_width() { return band_width_table.short_48; }
+};
+
+/* Alias reduction coefficients. */
+static const float cs[8] {
+		.8574929257, .8817419973, .9496286491, .9833145925,
+		.9955178161, .9991605582, .9998991952, .9999931551
+};
+static const float ca[8] {
+		-.5144957554, -.4717319686, -.3133774542, -.1819131996,
+		-.0945741925, -.0409655829, -.0141985686, -.0036999747
+};
+
+mp3::mp3(unsigned char *buffer) : mp3(buffer, nullptr)
 {
+}
+
+mp3::mp3(unsigned char *buffer, workspace *work)
+{
+	owns_work = work == nullptr;
+	if (owns_work)
+		work = static_cast<workspace *>(allocate(sizeof(workspace)));
+	this->work = work;
+
+	gain_ramp = 0;
+	gain_target = 0;
+	gain_current = 0;
+	for (int sfb = 0; sfb < 22; sfb++)
+		eq_target[sfb] = eq_current[sfb] = 0;
+	degradation = Intact;
+	concealing = false;
+	active_subbands = 32;
+	concealment = nullptr;
+	concealment_saved = false;
+	concealment_forward = true;
+	conceal_gain = 1;
+	resuming = false;
+
+	memset(prev_samples, 0, sizeof(prev_samples));
+	memset(fifo, 0, sizeof(fifo));
+	overlap_zero[0] = overlap_zero[1] = true;
+	history_zero[0] = history_zero[1] = true;
+	overlap_subbands[0] = overlap_subbands[1] = 0;
+	granules = 0;
+	silent_granules = 0;
+	fused_kernel = true;
+	converter = nullptr;
+	output_rate = 0;
+	output_samples[0] = output_samples[1] = 576;
+	frame_size = 0;
+	reservoir_size = 0;
+	memset(headers, 0, sizeof(headers));
+	header = headers;
+	cached_headers = 0;
+	next_header = 0;
+
+	valid = false;
 	if (buffer[0] == 0xFF && buffer[1] >= 0xE0) {
 		valid = true;
-		frame_size = 0;
-		main_data_begin = 0;
 		init_header_params(buffer);
 	}
 }
 
+mp3::~mp3()
+{
+	if (concealment != nullptr)
+		release(concealment);
+	set_output_rate(0);
+	if (owns_work)
+		release(work);
+}
+
 /**
  * Unpack the MP3 header.
  * @param buffer A pointer that points to the first byte of the frame header.
@@ -30,49 +118,303 @@ void mp3::init_header_params(unsigned char *buffer)
 	if (buffer[0] == 0xFF && buffer[1] >= 0xE0) {
 		this->buffer = buffer;
 
-		set_mpeg_version();
-		set_layer(buffer[1]);
-		set_crc();
-		set_info();
-		set_emphasis(buffer);
-		set_sampling_rate();
-		set_tables();
-		set_channel_mode(buffer);
+		unsigned word = (buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3]) & header_mask;
+		if (word != header->word)
+			set_header(word);
+		if (!header->valid)
+			valid = false;
+
 		set_mode_extension(buffer);
 		set_padding();
-		set_bit_rate(buffer);
 		set_frame_size();
 	} else
 		valid = false;
 }
 
+/**
+ * Point to the descriptor of a header, unpacking the header if it hasn't been
+ * seen recently. VBR streams only alternate between a few bit rates.
+ * @param word The masked header word.
+ */
+void mp3::set_header(unsigned word)
+{
+	for (int i = 0; i < cached_headers; i++)
+		if (headers[i].word == word) {
+			header = &headers[i];
+			return;
+		}
+
+	if (cached_headers < num_headers)
+		header = &headers[cached_headers++];
+	else {
+		header = &headers[next_header];
+		next_header = (next_header + 1) % num_headers;
+	}
+
+	memset(header, 0, sizeof(frame_header));
+	header->word = word;
+	header->valid = true;
+	set_mpeg_version();
+	set_layer(buffer[1]);
+	set_crc();
+	set_info();
+	set_emphasis(buffer);
+	set_sampling_rate();
+	set_tables();
+	set_channel_mode(buffer);
+	set_bit_rate(buffer);
+
+	header->side_info_offset = header->crc == 0 ? 6 : 4;
+	header->side_info_size = header->channel_mode == Mono ? 17 : 32;
+
+	unsigned int samples_per_frame = 0;
+	switch (header->layer) {
+		case 3:
+			if (header->mpeg_version == 1)
+				samples_per_frame = 1152;
+			else
+				samples_per_frame = 576;
+			break;
+		case 2:
+			samples_per_frame = 1152;
+			break;
+		case 1:
+			samples_per_frame = 384;
+			break;
+	}
+	if (header->sampling_rate != 0)
+		header->frame_size = samples_per_frame / 8 * header->bit_rate / header->sampling_rate;
+	else
+		header->valid = false;
+}
+
 /**
  * Unpack and decode the MP3 frame.
  * @param buffer A pointer to the first byte of the frame header.
  */
 void mp3::init_frame_params(unsigned char *buffer)
 {
-	set_side_info(&buffer[crc == 0 ? 6 : 4]);
-	set_main_data(buffer);
-	for (int gr = 0; gr < 2; gr++) {
-		for (int ch = 0; ch < channels; ch++)
-			requantize(gr, ch);
+	init_granule_params(buffer, 0);
+	init_granule_params(buffer, 1);
+}
 
-		if (channel_mode == JointStereo && mode_extension[0])
-			ms_stereo(gr);
+/**
+ * Unpack the frame before its first granule, then decode one granule.
+ * @param buffer A pointer to the first byte of the frame header.
+ * @param gr
+ */
+void mp3::init_granule_params(unsigned char *buffer, int gr)
+{
+	if (gr == 0) {
+		static const int subbands[4] = {32, 16, 8, 0};
+		concealing = degradation == Concealed;
+		active_subbands = subbands[degradation];
+		set_side_info(&buffer[header->side_info_offset]);
+		set_main_data(buffer);
+	}
+	if (concealing)
+		conceal_granule(gr);
+	else if (header->channels == 1)
+		decode_granule<1>(gr);
+	else
+		decode_granule<2>(gr);
+	interleave(gr);
+}
 
-		for (int ch = 0; ch < channels; ch++) {
-			if (block_type[gr][ch] == 2 || mixed_block_flag[gr][ch])
-				reorder(gr, ch);
+/**
+ * Decode a granule with kernels specialized for the number of channels, the
+ * block kind and the sampling rate. Kernels are chosen once per granule and
+ * channel, so their loops don't branch on the side information.
+ * @param gr
+ */
+template<int num_channels>
+void mp3::decode_granule(int gr)
+{
+	typedef void (mp3::*stage)(int gr, int ch);
+	static const stage requantize_stages[3][4] {
+		{&mp3::requantize_bands<LongBlocks, 0>, &mp3::requantize_bands<LongBlocks, 44100>,
+		 &mp3::requantize_bands<LongBlocks, 48000>, &mp3::requantize_bands<LongBlocks, 32000>},
+		{&mp3::requantize_bands<ShortBlocks, 0>, &mp3::requantize_bands<ShortBlocks, 44100>,
+		 &mp3::requantize_bands<ShortBlocks, 48000>, &mp3::requantize_bands<ShortBlocks, 32000>},
+		{&mp3::requantize, &mp3::requantize, &mp3::requantize, &mp3::requantize}
+	};
+	static const stage subband_stages[3][4] {
+		{&mp3::subband_kernel<LongBlocks, 0>, &mp3::subband_kernel<LongBlocks, 44100>,
+		 &mp3::subband_kernel<LongBlocks, 48000>, &mp3::subband_kernel<LongBlocks, 32000>},
+		{&mp3::subband_kernel<ShortBlocks, 0>, &mp3::subband_kernel<ShortBlocks, 44100>,
+		 &mp3::subband_kernel<ShortBlocks, 48000>, &mp3::subband_kernel<ShortBlocks, 32000>},
+		{&mp3::subband_kernel<MixedBlocks, 0>, &mp3::subband_kernel<MixedBlocks, 44100>,
+		 &mp3::subband_kernel<MixedBlocks, 48000>, &mp3::subband_kernel<MixedBlocks, 32000>}
+	};
+
+	const int rate = header->sampling_rate == 44100 ? 1 : (header->sampling_rate == 48000 ? 2 : (header->sampling_rate == 32000 ? 3 : 0));
+	int kind[num_channels];
+	for (int ch = 0; ch < num_channels; ch++) {
+		if (work->block_type[gr][ch] == 2)
+			kind[ch] = ShortBlocks;
+		else
+			kind[ch] = work->mixed_block_flag[gr][ch] ? MixedBlocks : LongBlocks;
+	}
+
+	/* Leave out the samples of the subbands above the active ones. */
+	for (int ch = 0; ch < num_channels; ch++) {
+		int end = active_subbands * 18;
+		if (work->nonzero[gr][ch] > end) {
+			memset(&work->samples[gr][ch][end], 0, (work->nonzero[gr][ch] - end) * sizeof(float));
+			work->nonzero[gr][ch] = end;
+		}
+	}
+
+	step_gain();
+	for (int ch = 0; ch < num_channels; ch++)
+		if (work->nonzero[gr][ch] > 0) {
+			if (fused_kernel)
+				(this->*requantize_stages[kind[ch]][rate])(gr, ch);
 			else
-				alias_reduction(gr, ch);
+				requantize(gr, ch);
+		}
+
+	if (num_channels == 2 && header->channel_mode == JointStereo && mode_extension[0]) {
+		/* Mid/side processing spreads samples over both channels. */
+		work->nonzero[gr][0] = work->nonzero[gr][1] = std::max(work->nonzero[gr][0], work->nonzero[gr][1]);
+		if (work->nonzero[gr][0] > 0)
+			ms_stereo(gr);
+	}
+
+	for (int ch = 0; ch < num_channels; ch++) {
+		granules++;
+		/* Subbands left out still play out the overlap of earlier granules. */
+		int subbands = std::max(active_subbands, overlap_subbands[ch]);
+		if (work->nonzero[gr][ch] == 0) {
+			if (overlap_zero[ch] && history_zero[ch]) {
+				/* Both the overlap and the synthesis history have decayed. */
+				silent_granules++;
+				continue;
+			}
+			/* A granule has 18 time slots, more than the 16 kept in the fifo. */
+			history_zero[ch] = overlap_zero[ch];
+			subbands = overlap_subbands[ch];
+			flush_overlap(ch);
+		} else {
+			if (fused_kernel) {
+				(this->*subband_stages[kind[ch]][rate])(gr, ch);
+				overlap_subbands[ch] = active_subbands;
+			} else {
+				if (work->block_type[gr][ch] == 2 || work->mixed_block_flag[gr][ch])
+					reorder(gr, ch);
+				else
+					alias_reduction(gr, ch);
+
+				/* Alias reduction leaks into the first subband left out,
+				 * and imdct() transforms them all. */
+				imdct(gr, ch);
+				subbands = overlap_subbands[ch] = 32;
+			}
+			overlap_zero[ch] = false;
+			history_zero[ch] = false;
+		}
+		synth_filterbank(gr, ch, subbands);
+	}
+
+	if (concealment != nullptr) {
+		if (resuming)
+			resume_granule(gr, num_channels);
+		save_granule(gr, num_channels);
+	}
+}
+
+/**
+ * Stand in for a granule that isn't decoded. Without a granule to repeat, the
+ * granule is taken to be silent, which plays out the overlap of the last one
+ * that was decoded. Otherwise the last granule is repeated, 6 dB quieter each
+ * time so that a run of concealed granules fades out instead of looping. The
+ * overlap and synthesis history are cleared then, so that decoding resumes
+ * from silence rather than from granules that were skipped.
+ * @param gr
+ */
+void mp3::conceal_granule(int gr)
+{
+	resuming = true;
+	if (!concealment_saved) {
+		for (int ch = 0; ch < header->channels; ch++) {
+			memset(work->samples[gr][ch], 0, sizeof(work->samples[gr][ch]));
+			if (overlap_zero[ch] && history_zero[ch])
+				continue;
+			history_zero[ch] = overlap_zero[ch];
+			int subbands = overlap_subbands[ch];
+			flush_overlap(ch);
+			synth_filterbank(gr, ch, subbands);
+		}
+		save_granule(gr, header->channels);
+		return;
+	}
+
+	for (int ch = 0; ch < header->channels; ch++) {
+		repeat_granule(ch, work->samples[gr][ch]);
+		if (!overlap_zero[ch]) {
+			memset(prev_samples[ch], 0, sizeof(prev_samples[ch]));
+			overlap_zero[ch] = true;
+			overlap_subbands[ch] = 0;
+		}
+		if (!history_zero[ch]) {
+			memset(fifo[ch], 0, sizeof(fifo[ch]));
+			history_zero[ch] = true;
+		}
+	}
+	conceal_gain *= 0.5f;
+	concealment_forward = !concealment_forward;
+}
 
-			imdct(gr, ch);
-			frequency_inversion(gr, ch);
-			synth_filterbank(gr, ch);
+/**
+ * The saved granule in the other direction from the last time it was output,
+ * so that it starts on the sample it ended on, with its gain ramped down 6 dB
+ * from where the last granule ended. Neither jumps at the edges of granules.
+ * @param ch
+ * @param samples Receives the granule.
+ */
+void mp3::repeat_granule(int ch, float *samples)
+{
+	const float *saved = concealment[ch];
+	float step = -0.5f * conceal_gain / 576;
+	float gain = conceal_gain;
+	for (int i = 0; i < 576; i++) {
+		gain += step;
+		samples[i] = saved[concealment_forward ? 575 - i : i] * gain;
+	}
+}
+
+/**
+ * Cross-fade from the concealed granules into the first granule that is
+ * decoded after them, which starts from a cleared overlap.
+ * @param gr
+ * @param channels
+ */
+void mp3::resume_granule(int gr, int channels)
+{
+	float repeated[576];
+	for (int ch = 0; ch < channels; ch++) {
+		repeat_granule(ch, repeated);
+		float *samples = work->samples[gr][ch];
+		for (int i = 0; i < 576; i++) {
+			float weight = (i + 1) / 576.0f;
+			samples[i] = samples[i] * weight + repeated[i] * (1 - weight);
 		}
 	}
-	interleave();
+	resuming = false;
+}
+
+/**
+ * Keep the granule that was just output for concealment to repeat.
+ * @param gr
+ * @param channels
+ */
+void mp3::save_granule(int gr, int channels)
+{
+	for (int ch = 0; ch < channels; ch++)
+		memcpy(concealment[ch], work->samples[gr][ch], sizeof(concealment[ch]));
+	concealment_saved = true;
+	concealment_forward = true;
+	conceal_gain = 1;
 }
 
 /** Check validity of the header and frame. */
@@ -85,18 +427,18 @@ bool mp3::is_valid()
 void mp3::set_mpeg_version()
 {
 	if ((buffer[1] & 0x10) == 0x10 && (buffer[1] & 0x08) == 0x08)
-		mpeg_version = 1;
+		header->mpeg_version = 1;
 	else if ((buffer[1] & 0x10) == 0x10 && (buffer[1] & 0x08) != 0x08)
-		mpeg_version = 2;
+		header->mpeg_version = 2;
 	else if ((buffer[1] & 0x10) != 0x10 && (buffer[1] & 0x08) == 0x08)
-		mpeg_version = 0;
+		header->mpeg_version = 0;
 	else if ((buffer[1] & 0x10) != 0x10 && (buffer[1] & 0x08) != 0x08)
-		mpeg_version = 2.5;
+		header->mpeg_version = 2.5;
 }
 
 float mp3::get_mpeg_version()
 {
-	return mpeg_version;
+	return header->mpeg_version;
 }
 
 /** Determine layer. */
@@ -104,12 +446,12 @@ void mp3::set_layer(unsigned char byte)
 {
 	byte = byte << 5;
 	byte = byte >> 6;
-	layer = 4 - byte;
+	header->layer = 4 - byte;
 }
 
 unsigned mp3::get_layer()
 {
-	return layer;
+	return header->layer;
 }
 
 /**
@@ -118,12 +460,12 @@ unsigned mp3::get_layer()
  */
 void mp3::set_crc()
 {
-	crc = buffer[1] & 0x01;
+	header->crc = buffer[1] & 0x01;
 }
 
 bool mp3::get_crc()
 {
-	return crc;
+	return header->crc;
 }
 
 /**
@@ -131,32 +473,32 @@ bool mp3::get_crc()
  */
 void mp3::set_bit_rate(unsigned char *buffer)
 {
-	if (mpeg_version == 1) {
-		if (layer == 1) {
-			bit_rate = buffer[2] * 32;
-		} else if (layer == 2) {
+	if (header->mpeg_version == 1) {
+		if (header->layer == 1) {
+			header->bit_rate = buffer[2] * 32;
+		} else if (header->layer == 2) {
 			const int rates[14] {32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384};
-			bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
-		} else if (layer == 3) {
+			header->bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
+		} else if (header->layer == 3) {
 			const int rates[14] {32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
-			bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
+			header->bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
 		} else
-			valid = false;
+			header->valid = false;
 	} else {
-		if (layer == 1) {
+		if (header->layer == 1) {
 			const int rates[14] {32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256};
-			bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
-		} else if (layer < 4) {
+			header->bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
+		} else if (header->layer < 4) {
 			const int rates[14] {8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160};
-			bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
+			header->bit_rate = rates[(buffer[2] >> 4) - 1] * 1000;
 		} else
-			valid = false;
+			header->valid = false;
 	}
 }
 
 unsigned mp3::get_bit_rate()
 {
-	return bit_rate;
+	return header->bit_rate;
 }
 
 /** Sampling rate. */
@@ -165,15 +507,15 @@ void mp3::set_sampling_rate()
 	int rates[3][3] {44100, 48000, 32000, 22050, 24000, 16000, 11025, 12000, 8000};
 
 	for (int version = 1; version <= 3; version++)
-		if (mpeg_version == version) {
+		if (header->mpeg_version == version) {
 			if ((buffer[2] & 0x08) != 0x08 && (buffer[2] & 0x04) != 0x04) {
-				sampling_rate = rates[version - 1][0];
+				header->sampling_rate = rates[version - 1][0];
 				break;
 			} else if ((buffer[2] & 0x08) != 0x08 && (buffer[2] & 0x04) == 0x04) {
-				sampling_rate = rates[version - 1][1];
+				header->sampling_rate = rates[version - 1][1];
 				break;
 			} else if ((buffer[2] & 0x08) == 0x08 && (buffer[2] & 0x04) != 0x04) {
-				sampling_rate = rates[version - 1][2];
+				header->sampling_rate = rates[version - 1][2];
 				break;
 			}
 		}
@@ -181,7 +523,7 @@ void mp3::set_sampling_rate()
 
 unsigned mp3::get_sampling_rate()
 {
-	return sampling_rate;
+	return header->sampling_rate;
 }
 
 /**
@@ -190,24 +532,24 @@ unsigned mp3::get_sampling_rate()
  */
 void mp3::set_tables()
 {
-	switch (sampling_rate) {
+	switch (header->sampling_rate) {
 		case 32000:
-			band_index.short_win = band_index_table.short_32;
-			band_width.short_win = band_width_table.short_32;
-			band_index.long_win = band_index_table.long_32;
-			band_width.long_win = band_width_table.long_32;
+			header->band_index.short_win = band_index_table.short_32;
+			header->band_width.short_win = band_width_table.short_32;
+			header->band_index.long_win = band_index_table.long_32;
+			header->band_width.long_win = band_width_table.long_32;
 			break;
 		case 44100:
-			band_index.short_win = band_index_table.short_44;
-			band_width.short_win = band_width_table.short_44;
-			band_index.long_win = band_index_table.long_44;
-			band_width.long_win = band_width_table.long_44;
+			header->band_index.short_win = band_index_table.short_44;
+			header->band_width.short_win = band_width_table.short_44;
+			header->band_index.long_win = band_index_table.long_44;
+			header->band_width.long_win = band_width_table.long_44;
 			break;
 		case 48000:
-			band_index.short_win = band_index_table.short_48;
-			band_width.short_win = band_width_table.short_48;
-			band_index.long_win = band_index_table.long_48;
-			band_width.long_win = band_width_table.long_48;
+			header->band_index.short_win = band_index_table.short_48;
+			header->band_width.short_win = band_width_table.short_48;
+			header->band_index.long_win = band_index_table.long_48;
+			header->band_width.long_win = band_width_table.long_48;
 			break;
 	}
 }
@@ -232,19 +574,19 @@ bool mp3::get_padding()
 void mp3::set_channel_mode(unsigned char *buffer)
 {
 	unsigned value = buffer[3] >> 6;
-	channel_mode = static_cast<ChannelMode>(value);
-	channels = channel_mode == Mono ? 1 : 2;
+	header->channel_mode = static_cast<ChannelMode>(value);
+	header->channels = header->channel_mode == Mono ? 1 : 2;
 }
 
 mp3::ChannelMode mp3::get_channel_mode()
 {
-	return channel_mode;
+	return header->channel_mode;
 }
 
 /** Applies only to joint stereo. */
 void mp3::set_mode_extension(unsigned char *buffer)
 {
-	if (layer == 3) {
+	if (header->layer == 3) {
 		mode_extension[0] = buffer[3] & 0x20;
 		mode_extension[1] = buffer[3] & 0x10;
 	}
@@ -259,54 +601,31 @@ unsigned *mp3::get_mode_extension()
 void mp3::set_emphasis(unsigned char *buffer)
 {
 	unsigned value = (buffer[3] << 6) >> 6;
-	emphasis = static_cast<Emphasis>(value);
+	header->emphasis = static_cast<Emphasis>(value);
 }
 
 mp3::Emphasis mp3::get_emphasis()
 {
-	return emphasis;
+	return header->emphasis;
 }
 
 /** Additional information (not important). */
 void mp3::set_info()
 {
-	info[0] = buffer[2] & 0x01;
-	info[1] = buffer[3] & 0x08;
-	info[2] = buffer[3] & 0x04;
+	header->info[0] = buffer[2] & 0x01;
+	header->info[1] = buffer[3] & 0x08;
+	header->info[2] = buffer[3] & 0x04;
 }
 
 bool *mp3::get_info()
 {
-	return info;
+	return header->info;
 }
 
 /** Determine the frame size. */
 void mp3::set_frame_size()
 {
-	unsigned int samples_per_frame;
-	switch (layer) {
-		case 3:
-			if (mpeg_version == 1)
-				samples_per_frame = 1152;
-			else
-				samples_per_frame = 576;
-			break;
-		case 2:
-			samples_per_frame = 1152;
-			break;
-		case 1:
-			samples_per_frame = 384;
-			break;
-	}
-
-	/* Minimum frame size = 1152 / 8 * 32000 / 48000 = 96
-	 * Minimum main_data size = 96 - 36 - 2 = 58
-	 * Maximum main_data_begin = 2^9 = 512
-	 * Therefore remember ceil(512 / 58) = 9 previous frames. */
-	for (int i = num_prev_frames-1; i > 0; --i)
-		prev_frame_size[i] = prev_frame_size[i-1];
-	prev_frame_size[0] = frame_size;
-	frame_size = (samples_per_frame / 8 * bit_rate / sampling_rate);
+	frame_size = header->frame_size;
 	if (padding == 1)
 		frame_size += 1;
 }
@@ -321,6 +640,236 @@ unsigned mp3::get_header_size()
 	return 4;
 }
 
+/** Number of granules decoded, counting each channel. */
+unsigned mp3::get_granules()
+{
+	return granules;
+}
+
+/** Number of granules that were silent and skipped all processing. */
+unsigned mp3::get_silent_granules()
+{
+	return silent_granules;
+}
+
+/**
+ * Choose between the fused subband kernel (default) and the separate alias
+ * reduction, reordering and IMDCT stages, which are kept as a reference.
+ */
+void mp3::set_fused_kernel(bool enable)
+{
+	fused_kernel = enable;
+}
+
+void mp3::set_workspace(workspace *work)
+{
+	if (work == this->work || (work == nullptr && owns_work))
+		return;
+	if (owns_work)
+		release(this->work);
+	owns_work = work == nullptr;
+	if (owns_work)
+		work = static_cast<workspace *>(allocate(sizeof(workspace)));
+	this->work = work;
+}
+
+/**
+ * The resampler keeps a history of both channels, in case the stream switches
+ * from mono to stereo.
+ */
+bool mp3::set_output_rate(unsigned rate, resampler::Quality quality)
+{
+	if (converter != nullptr) {
+		converter->~resampler();
+		release(converter);
+		converter = nullptr;
+	}
+	output_rate = 0;
+	output_samples[0] = output_samples[1] = 576;
+	if (rate == 0 || rate == header->sampling_rate)
+		return true;
+
+	void *memory = allocate(sizeof(resampler));
+	converter = new (memory) resampler(header->sampling_rate, rate, 2, quality);
+	if (!converter->is_valid()) {
+		set_output_rate(0);
+		return false;
+	}
+	output_rate = rate;
+	return true;
+}
+
+unsigned mp3::get_output_rate()
+{
+	return output_rate != 0 ? output_rate : header->sampling_rate;
+}
+
+/**
+ * Which parts of the state aren't at their initial values. The overlap and
+ * history of a channel are known to be zero while it is silent.
+ */
+unsigned mp3::get_state_flags()
+{
+	unsigned flags = 0;
+	for (int ch = 0; ch < 2; ch++) {
+		if (!overlap_zero[ch])
+			flags |= OverlapSaved << ch;
+		if (!history_zero[ch])
+			flags |= HistorySaved << ch;
+	}
+	bool flat = gain_ramp == 0 && gain_target == 0 && gain_current == 0;
+	for (int sfb = 0; sfb < 22; sfb++)
+		flat = flat && eq_target[sfb] == 0 && eq_current[sfb] == 0;
+	if (!flat)
+		flags |= GainSaved;
+	if (converter != nullptr)
+		flags |= ConverterSaved;
+	return flags;
+}
+
+/**
+ * | magic | version | header | flags | reservoir size | reservoir |
+ * | overlap of each channel | history of each channel | gain | resampler |
+ * The parts after the reservoir are left out when the flags say so. Words
+ * and floats are little endian.
+ */
+unsigned mp3::get_state_size()
+{
+	unsigned flags = get_state_flags();
+	unsigned size = 5 * 4 + reservoir_size;
+	for (int ch = 0; ch < 2; ch++) {
+		if (flags & (OverlapSaved << ch))
+			size += sizeof(prev_samples[ch]);
+		if (flags & (HistorySaved << ch))
+			size += sizeof(fifo[ch]);
+	}
+	if (flags & GainSaved)
+		size += 3 * 4 + sizeof(eq_target) + sizeof(eq_current);
+	if (flags & ConverterSaved)
+		size += 2 * 4 + converter->get_state_size();
+	return size;
+}
+
+unsigned mp3::save_state(unsigned char *state)
+{
+	unsigned char *start = state;
+	unsigned flags = get_state_flags();
+	state = put_word(state, state_magic);
+	state = put_word(state, state_version);
+	state = put_word(state, header->word);
+	state = put_word(state, flags);
+	state = put_word(state, reservoir_size);
+	memcpy(state, reservoir, reservoir_size);
+	state += reservoir_size;
+
+	for (int ch = 0; ch < 2; ch++)
+		if (flags & (OverlapSaved << ch))
+			state = put_floats(state, &prev_samples[ch][0][0], 32 * 18);
+	for (int ch = 0; ch < 2; ch++)
+		if (flags & (HistorySaved << ch))
+			state = put_floats(state, fifo[ch], 16 * 32);
+	if (flags & GainSaved) {
+		state = put_word(state, gain_ramp);
+		state = put_floats(state, &gain_target, 1);
+		state = put_floats(state, &gain_current, 1);
+		state = put_floats(state, eq_target, 22);
+		state = put_floats(state, eq_current, 22);
+	}
+	if (flags & ConverterSaved) {
+		state = put_word(state, output_rate);
+		state = put_word(state, converter->get_quality());
+		state = converter->save_state(state);
+	}
+	return state - start;
+}
+
+/**
+ * Every size is checked before anything is changed, and a resampler is made
+ * and loaded before it replaces the current one.
+ */
+bool mp3::load_state(const unsigned char *state, unsigned size)
+{
+	if (size < 5 * 4 || get_word(state) != state_magic || get_word(state + 4) != state_version)
+		return false;
+	unsigned word = get_word(state + 8);
+	unsigned flags = get_word(state + 12);
+	unsigned saved_reservoir = get_word(state + 16);
+	bool mono = (word >> 6 & 3) == Mono;
+	if ((word & format_mask) != (header->word & format_mask) || mono != (header->channel_mode == Mono) ||
+		flags >= ConverterSaved * 2 || saved_reservoir > max_reservoir)
+		return false;
+
+	unsigned expected = 5 * 4 + saved_reservoir;
+	for (int ch = 0; ch < 2; ch++) {
+		if (flags & (OverlapSaved << ch))
+			expected += sizeof(prev_samples[ch]);
+		if (flags & (HistorySaved << ch))
+			expected += sizeof(fifo[ch]);
+	}
+	if (flags & GainSaved)
+		expected += 3 * 4 + sizeof(eq_target) + sizeof(eq_current);
+	if ((flags & ConverterSaved) ? size < expected + 2 * 4 : size != expected)
+		return false;
+
+	resampler *loaded = nullptr;
+	unsigned rate = 0;
+	if (flags & ConverterSaved) {
+		rate = get_word(state + expected);
+		unsigned quality = get_word(state + expected + 4);
+		if (quality > resampler::High || rate == header->sampling_rate)
+			return false;
+		void *memory = allocate(sizeof(resampler));
+		loaded = new (memory) resampler(header->sampling_rate, rate, 2, (resampler::Quality)quality);
+		unsigned rest = size - expected - 2 * 4;
+		if (!loaded->is_valid() || rest != loaded->get_state_size() ||
+			!loaded->load_state(state + expected + 2 * 4, rest)) {
+			loaded->~resampler();
+			release(loaded);
+			return false;
+		}
+	}
+
+	state += 5 * 4;
+	reservoir_size = saved_reservoir;
+	memcpy(reservoir, state, reservoir_size);
+	state += reservoir_size;
+	for (int ch = 0; ch < 2; ch++) {
+		overlap_zero[ch] = !(flags & (OverlapSaved << ch));
+		overlap_subbands[ch] = overlap_zero[ch] ? 0 : 32;
+		if (overlap_zero[ch])
+			memset(prev_samples[ch], 0, sizeof(prev_samples[ch]));
+		else
+			state = get_floats(state, &prev_samples[ch][0][0], 32 * 18);
+	}
+	for (int ch = 0; ch < 2; ch++) {
+		history_zero[ch] = !(flags & (HistorySaved << ch));
+		if (history_zero[ch])
+			memset(fifo[ch], 0, sizeof(fifo[ch]));
+		else
+			state = get_floats(state, fifo[ch], 16 * 32);
+	}
+	if (flags & GainSaved) {
+		gain_ramp = get_word(state);
+		state = get_floats(state + 4, &gain_target, 1);
+		state = get_floats(state, &gain_current, 1);
+		state = get_floats(state, eq_target, 22);
+		state = get_floats(state, eq_current, 22);
+	} else {
+		gain_ramp = 0;
+		gain_target = 0;
+		gain_current = 0;
+		for (int sfb = 0; sfb < 22; sfb++)
+			eq_target[sfb] = eq_current[sfb] = 0;
+	}
+
+	set_output_rate(0);
+	if (loaded != nullptr) {
+		converter = loaded;
+		output_rate = rate;
+	}
+	return true;
+}
+
 /**
  * The side information contains information on how to decode the main_data.
  * @param buffer A pointer to the first byte of the side info.
@@ -330,87 +879,87 @@ void mp3::set_side_info(unsigned char *buffer)
 	int count = 0;
 
 	/* Number of bytes the main data ends before the next frame header. */
-	main_data_begin = (int)get_bits_inc(buffer, &count, 9);
+	work->main_data_begin = (int)get_bits_inc(buffer, &count, 9);
 
 	/* Skip private bits. Not necessary. */
-	count += channel_mode == Mono ? 5 : 3;
+	count += header->channel_mode == Mono ? 5 : 3;
 
-	for (int ch = 0; ch < channels; ch++)
+	for (int ch = 0; ch < header->channels; ch++)
 		for (int scfsi_band = 0; scfsi_band < 4; scfsi_band++)
 			/* - Scale factor selection information.
 			 * - If scfsi[scfsi_band] == 1, then scale factors for the first
 			 *   granule are reused in the second granule.
 			 * - If scfsi[scfsi_band] == 0, then each granule has its own scaling factors.
 			 * - scfsi_band indicates what group of scaling factors are reused. */
-			scfsi[ch][scfsi_band] = get_bits_inc(buffer, &count, 1) != 0;
+			work->scfsi[ch][scfsi_band] = get_bits_inc(buffer, &count, 1) != 0;
 
 	for (int gr = 0; gr < 2; gr++)
-		for (int ch = 0; ch < channels; ch++) {
+		for (int ch = 0; ch < header->channels; ch++) {
 			/* Length of the scaling factors and main data in bits. */
-			part2_3_length[gr][ch] = (int)get_bits_inc(buffer, &count, 12);
+			work->part2_3_length[gr][ch] = (int)get_bits_inc(buffer, &count, 12);
 			/* Number of values in each big_region. */
-			big_value[gr][ch] = (int)get_bits_inc(buffer, &count, 9);
+			work->big_value[gr][ch] = (int)get_bits_inc(buffer, &count, 9);
 			/* Quantizer step size. */
-			global_gain[gr][ch] = (int)get_bits_inc(buffer, &count, 8);
+			work->global_gain[gr][ch] = (int)get_bits_inc(buffer, &count, 8);
 			/* Used to determine the values of slen1 and slen2. */
-			scalefac_compress[gr][ch] = (int)get_bits_inc(buffer, &count, 4);
+			work->scalefac_compress[gr][ch] = (int)get_bits_inc(buffer, &count, 4);
 			/* Number of bits given to a range of scale factors.
 			 * - Normal blocks: slen1 0 - 10, slen2 11 - 20
 			 * - Short blocks && mixed_block_flag == 1: slen1 0 - 5, slen2 6-11
 			 * - Short blocks && mixed_block_flag == 0: */
-			slen1[gr][ch] = slen[scalefac_compress[gr][ch]][0];
-			slen2[gr][ch] = slen[scalefac_compress[gr][ch]][1];
+			work->slen1[gr][ch] = slen[work->scalefac_compress[gr][ch]][0];
+			work->slen2[gr][ch] = slen[work->scalefac_compress[gr][ch]][1];
 			/* If set, a not normal window is used. */
-			window_switching[gr][ch] = get_bits_inc(buffer, &count, 1) == 1;
+			work->window_switching[gr][ch] = get_bits_inc(buffer, &count, 1) == 1;
 
-			if (window_switching[gr][ch]) {
+			if (work->window_switching[gr][ch]) {
 				/* The window type for the granule.
 				 * 0: reserved
 				 * 1: start block
 				 * 2: 3 short windows
 				 * 3: end block */
-				block_type[gr][ch] = (int)get_bits_inc(buffer, &count, 2);
+				work->block_type[gr][ch] = (int)get_bits_inc(buffer, &count, 2);
 				/* Number of scale factor bands before window switching. */
-				mixed_block_flag[gr][ch] = get_bits_inc(buffer, &count, 1) == 1;
-				if (mixed_block_flag[gr][ch]) {
-					switch_point_l[gr][ch] = 8;
-					switch_point_s[gr][ch] = 3;
+				work->mixed_block_flag[gr][ch] = get_bits_inc(buffer, &count, 1) == 1;
+				if (work->mixed_block_flag[gr][ch]) {
+					work->switch_point_l[gr][ch] = 8;
+					work->switch_point_s[gr][ch] = 3;
 				} else {
-					switch_point_l[gr][ch] = 0;
-					switch_point_s[gr][ch] = 0;
+					work->switch_point_l[gr][ch] = 0;
+					work->switch_point_s[gr][ch] = 0;
 				}
 
 				/* These are set by default if window_switching. */
-				region0_count[gr][ch] = block_type[gr][ch] == 2 ? 8 : 7;
+				work->region0_count[gr][ch] = work->block_type[gr][ch] == 2 ? 8 : 7;
 				/* No third region. */
-				region1_count[gr][ch] = 20 - region0_count[gr][ch];
+				work->region1_count[gr][ch] = 20 - work->region0_count[gr][ch];
 
 				for (int region = 0; region < 2; region++)
 					/* Huffman table number for a big region. */
-					table_select[gr][ch][region] = (int)get_bits_inc(buffer, &count, 5);
+					work->table_select[gr][ch][region] = (int)get_bits_inc(buffer, &count, 5);
 				for (int window = 0; window < 3; window++)
-					subblock_gain[gr][ch][window] = (int)get_bits_inc(buffer, &count, 3);
+					work->subblock_gain[gr][ch][window] = (int)get_bits_inc(buffer, &count, 3);
 			} else {
 				/* Set by default if !window_switching. */
-				block_type[gr][ch] = 0;
-				mixed_block_flag[gr][ch] = false;
+				work->block_type[gr][ch] = 0;
+				work->mixed_block_flag[gr][ch] = false;
 
 				for (int region = 0; region < 3; region++)
-					table_select[gr][ch][region] = (int)get_bits_inc(buffer, &count, 5);
+					work->table_select[gr][ch][region] = (int)get_bits_inc(buffer, &count, 5);
 
 				/* Number of scale factor bands in the first big value region. */
-				region0_count[gr][ch] = (int)get_bits_inc(buffer, &count, 4);
+				work->region0_count[gr][ch] = (int)get_bits_inc(buffer, &count, 4);
 				/* Number of scale factor bands in the third big value region. */
-				region1_count[gr][ch] = (int)get_bits_inc(buffer, &count, 3);
+				work->region1_count[gr][ch] = (int)get_bits_inc(buffer, &count, 3);
 				/* # scale factor bands is 12*3 = 36 */
 			}
 
 			/* If set, add values from a table to the scaling factors. */
-			preflag[gr][ch] = (int)get_bits_inc(buffer, &count, 1);
+			work->preflag[gr][ch] = (int)get_bits_inc(buffer, &count, 1);
 			/* Determines the step size. */
-			scalefac_scale[gr][ch] = (int)get_bits_inc(buffer, &count, 1);
+			work->scalefac_scale[gr][ch] = (int)get_bits_inc(buffer, &count, 1);
 			/* Table that determines which count1 table is used. */
-			count1table_select[gr][ch] = (int)get_bits_inc(buffer, &count, 1);
+			work->count1table_select[gr][ch] = (int)get_bits_inc(buffer, &count, 1);
 		}
 }
 
@@ -422,52 +971,61 @@ void mp3::set_side_info(unsigned char *buffer)
 void mp3::set_main_data(unsigned char *buffer)
 {
 	/* header + side_information */
-	int constant = channel_mode == Mono ? 21 : 36;
-	if (crc == 0)
-		constant += 2;
+	int constant = header->side_info_offset + header->side_info_size;
 
 	/* Let's put the main data in a separate buffer so that side info and header
 	 * don't interfere. The main_data_begin may be larger than the previous frame
-	 * and doesn't include the size of side info and headers. */
-	if (main_data_begin == 0) {
-		main_data.resize(frame_size - constant);
-		memcpy(&main_data[0], buffer + constant, frame_size - constant);
-	} else {
-		int bound = 0;
-		for (int frame = 0; frame < num_prev_frames; frame++) {
-			bound += prev_frame_size[frame] - constant;
-			if (main_data_begin < bound) {
-				int ptr_offset = main_data_begin + frame * constant;
-				int buffer_offset = 0;
-
-				int part[num_prev_frames];
-				part[frame] = main_data_begin;
-				for (int i = 0; i <= frame-1; i++) {
-					part[i] = prev_frame_size[i] - constant;
-					part[frame] -= part[i];
-				}
+	 * and doesn't include the size of side info and headers. The reservoir keeps
+	 * the main data of previous frames, so frames don't have to be contiguous. */
+	int length = frame_size - constant;
+	if (length < 0 || length > max_main_data) {
+		valid = false;
+		length = 0;
+	}
 
-				main_data.resize(frame_size - constant + main_data_begin);
-				memcpy(main_data.data(), buffer - ptr_offset, part[frame]);
-				ptr_offset -= (part[frame] + constant);
-				buffer_offset += part[frame];
-				for (int i = frame-1; i >= 0; i--) {
-					memcpy(&main_data[buffer_offset], buffer - ptr_offset, part[i]);
-					ptr_offset -= (part[i] + constant);
-					buffer_offset += part[i];
-				}
-				memcpy(&main_data[main_data_begin], buffer + constant, frame_size - constant);
-				break;
-			}
-		}
+	unsigned char *main_data = work->main_data;
+	int begin = work->main_data_begin;
+	int bits = 0;
+	for (int gr = 0; gr < 2; gr++)
+		for (int ch = 0; ch < header->channels; ch++)
+			bits += work->part2_3_length[gr][ch];
+	/* The frame may begin in main data that was never seen, for instance after
+	 * seeking, or the side info may be damaged. */
+	bool missing = !valid || begin > reservoir_size || bits > 8 * (begin + length);
+	if (!missing) {
+		memcpy(main_data, &reservoir[reservoir_size - begin], begin);
+		memcpy(&main_data[begin], buffer + constant, length);
+	}
+
+	if (length >= max_reservoir) {
+		memcpy(reservoir, buffer + constant + length - max_reservoir, max_reservoir);
+		reservoir_size = max_reservoir;
+	} else {
+		int keep = std::min(reservoir_size, max_reservoir - length);
+		memmove(reservoir, &reservoir[reservoir_size - keep], keep);
+		memcpy(&reservoir[keep], buffer + constant, length);
+		reservoir_size = keep + length;
 	}
 
+	/* Damaged side info may refer to scale factors that weren't transmitted.
+	 * They are zero, rather than left over from another stream. */
+	memset(work->scalefac_l, 0, sizeof(work->scalefac_l));
+	memset(work->scalefac_s, 0, sizeof(work->scalefac_s));
+
+	if (concealing)
+		return;
+
 	int bit = 0;
 	for (int gr = 0; gr < 2; gr++)
-		for (int ch = 0; ch < channels; ch++) {
-			int max_bit = bit + part2_3_length[gr][ch];
-			unpack_scalefac(main_data.data(), gr, ch, bit);
-			unpack_samples(main_data.data(), gr, ch, bit, max_bit);
+		for (int ch = 0; ch < header->channels; ch++) {
+			if (missing) {
+				work->nonzero[gr][ch] = 0;
+				memset(work->samples[gr][ch], 0, sizeof(work->samples[gr][ch]));
+				continue;
+			}
+			int max_bit = bit + work->part2_3_length[gr][ch];
+			unpack_scalefac(main_data, gr, ch, bit);
+			unpack_samples(main_data, gr, ch, bit, max_bit);
 			bit = max_bit;
 		}
 }
@@ -485,59 +1043,59 @@ void mp3::unpack_scalefac(unsigned char *main_data, int gr, int ch, int &bit)
 	int sfb = 0;
 	int window = 0;
 	int scalefactor_length[2] {
-		slen[scalefac_compress[gr][ch]][0],
-		slen[scalefac_compress[gr][ch]][1]
+		slen[work->scalefac_compress[gr][ch]][0],
+		slen[work->scalefac_compress[gr][ch]][1]
 	};
 
 	/* No scale factor transmission for short blocks. */
-	if (block_type[gr][ch] == 2 && window_switching[gr][ch]) {
-		if (mixed_block_flag[gr][ch] == 1) { /* Mixed blocks. */
+	if (work->block_type[gr][ch] == 2 && work->window_switching[gr][ch]) {
+		if (work->mixed_block_flag[gr][ch] == 1) { /* Mixed blocks. */
 			for (sfb = 0; sfb < 8; sfb++)
-				scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
+				work->scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
 
 			for (sfb = 3; sfb < 6; sfb++)
 				for (window = 0; window < 3; window++)
-					scalefac_s[gr][ch][window][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
+					work->scalefac_s[gr][ch][window][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
 		} else /* Short blocks. */
 			for (sfb = 0; sfb < 6; sfb++)
 				for (window = 0; window < 3; window++)
-					scalefac_s[gr][ch][window][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
+					work->scalefac_s[gr][ch][window][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
 
 		for (sfb = 6; sfb < 12; sfb++)
 			for (window = 0; window < 3; window++)
-				scalefac_s[gr][ch][window][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[1]);
+				work->scalefac_s[gr][ch][window][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[1]);
 
 		for (window = 0; window < 3; window++)
-			scalefac_s[gr][ch][window][12] = 0;
+			work->scalefac_s[gr][ch][window][12] = 0;
 	}
 
 	/* Scale factors for long blocks. */
 	else {
 		if (gr == 0) {
 			for (sfb = 0; sfb < 11; sfb++)
-				scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
+				work->scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
 			for (; sfb < 21; sfb++)
-				scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[1]);
+				work->scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[1]);
 		} else {
 			/* Scale factors might be reused in the second granule. */
 			const int sb[5] = {6, 11, 16, 21};
 			for (int i = 0; i < 2; i++)
 				for (; sfb < sb[i]; sfb++) {
-					if (scfsi[ch][i])
-						scalefac_l[gr][ch][sfb] = scalefac_l[0][ch][sfb];
+					if (work->scfsi[ch][i])
+						work->scalefac_l[gr][ch][sfb] = work->scalefac_l[0][ch][sfb];
 					else
-						scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
+						work->scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[0]);
 
 				}
 			for (int i = 2; i < 4; i++)
 				for (; sfb < sb[i]; sfb++) {
-					if (scfsi[ch][i])
-						scalefac_l[gr][ch][sfb] = scalefac_l[0][ch][sfb];
+					if (work->scfsi[ch][i])
+						work->scalefac_l[gr][ch][sfb] = work->scalefac_l[0][ch][sfb];
 					else
-						scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[1]);
+						work->scalefac_l[gr][ch][sfb] = (int)get_bits_inc(main_data, &bit, scalefactor_length[1]);
 				}
 		}
-		scalefac_l[gr][ch][21] = 0;
+		work->scalefac_l[gr][ch][21] = 0;
 	}
 }
 
@@ -558,35 +1116,36 @@ void mp3::unpack_samples(unsigned char *main_data, int gr, int ch, int bit, int
 	const unsigned *table;
 
 	for (int i = 0; i < 576; i++)
-		samples[gr][ch][i] = 0;
+		work->samples[gr][ch][i] = 0;
+	work->nonzero[gr][ch] = 0;
 
 	/* Get the big value region boundaries. */
 	int region0;
 	int region1;
-	if (window_switching[gr][ch] && block_type[gr][ch] == 2) {
+	if (work->window_switching[gr][ch] && work->block_type[gr][ch] == 2) {
 		region0 = 36;
 		region1 = 576;
 	} else {
-		region0 = band_index.long_win[region0_count[gr][ch] + 1];
-		region1 = band_index.long_win[region0_count[gr][ch] + 1 + region1_count[gr][ch] + 1];
+		region0 = header->band_index.long_win[work->region0_count[gr][ch] + 1];
+		region1 = header->band_index.long_win[work->region0_count[gr][ch] + 1 + work->region1_count[gr][ch] + 1];
 	}
 
 	/* Get the samples in the big value region. Each entry in the Huffman tables
 	 * yields two samples. */
-	for (; sample < big_value[gr][ch] * 2; sample += 2) {
+	for (; sample < work->big_value[gr][ch] * 2; sample += 2) {
 		if (sample < region0) {
-			table_num = table_select[gr][ch][0];
+			table_num = work->table_select[gr][ch][0];
 			table = big_value_table[table_num];
 		} else if (sample < region1) {
-			table_num = table_select[gr][ch][1];
+			table_num = work->table_select[gr][ch][1];
 			table = big_value_table[table_num];
 		} else {
-			table_num = table_select[gr][ch][2];
+			table_num = work->table_select[gr][ch][2];
 			table = big_value_table[table_num];
 		}
 
 		if (table_num == 0) {
-			samples[gr][ch][sample] = 0;
+			work->samples[gr][ch][sample] = 0;
 			continue;
 		}
 
@@ -615,7 +1174,9 @@ void mp3::unpack_samples(unsigned char *main_data, int gr, int ch, int bit, int
 						if (values[i] > 0)
 							sign = get_bits_inc(main_data, &bit, 1) ? -1 : 1;
 
-						samples[gr][ch][sample + i] = (float)(sign * (values[i] + linbit));
+						work->samples[gr][ch][sample + i] = (float)(sign * (values[i] + linbit));
+						if (values[i] + linbit != 0)
+							work->nonzero[gr][ch] = sample + i + 1;
 					}
 
 					repeat = false;
@@ -629,7 +1190,7 @@ void mp3::unpack_samples(unsigned char *main_data, int gr, int ch, int bit, int
 		int values[4];
 
 		/* Flip bits. */
-		if (count1table_select[gr][ch] == 1) {
+		if (work->count1table_select[gr][ch] == 1) {
 			unsigned bit_sample = get_bits_inc(main_data, &bit, 4);
 			values[0] = (bit_sample & 0x08) > 0 ? 0 : 1;
 			values[1] = (bit_sample & 0x04) > 0 ? 0 : 1;
@@ -655,13 +1216,99 @@ void mp3::unpack_samples(unsigned char *main_data, int gr, int ch, int bit, int
 			if (values[i] > 0 && get_bits_inc(main_data, &bit, 1) == 1)
 				values[i] = -values[i];
 
-		for (int i = 0; i < 4; i++)
-			samples[gr][ch][sample + i] = values[i];
+		for (int i = 0; i < 4; i++) {
+			work->samples[gr][ch][sample + i] = values[i];
+			if (values[i] != 0)
+				work->nonzero[gr][ch] = sample + i + 1;
+		}
 	}
 
 	/* Fill remaining samples with zero. */
 	for (; sample < 576; sample++)
-		samples[gr][ch][sample] = 0;
+		work->samples[gr][ch][sample] = 0;
+}
+
+/**
+ * Set a gain that is applied to all samples during requantization.
+ * @param db Gain in decibels.
+ */
+void mp3::set_gain(float db)
+{
+	/* 2^(x/4) == 10^(db/20) */
+	gain_target = db * 4.0 / (20.0 * std::log10(2.0));
+	gain_ramp = gain_ramp_granules;
+}
+
+float mp3::get_gain()
+{
+	return gain_target * 20.0 * std::log10(2.0) / 4.0;
+}
+
+/**
+ * Set an equalizer curve with one gain per long block scale factor band. Short
+ * blocks use the gain of the long band that covers the center of each short band.
+ * @param db Gains in decibels. Missing bands are left flat.
+ * @param bands The number of gains (at most 22).
+ */
+void mp3::set_equalizer(const float *db, int bands)
+{
+	for (int sfb = 0; sfb < 22; sfb++)
+		eq_target[sfb] = sfb < bands ? db[sfb] * 4.0 / (20.0 * std::log10(2.0)) : 0;
+	gain_ramp = gain_ramp_granules;
+}
+
+void mp3::set_degradation(Degradation level)
+{
+	if (level == Concealed && concealment == nullptr)
+		level = QuarterBand;
+	degradation = level;
+}
+
+mp3::Degradation mp3::get_degradation()
+{
+	return degradation;
+}
+
+void mp3::set_concealment(bool enable)
+{
+	if (enable == (concealment != nullptr))
+		return;
+	if (enable) {
+		concealment = static_cast<float (*)[576]>(allocate(2 * sizeof(*concealment)));
+		concealment_saved = false;
+		resuming = false;
+	} else {
+		release(concealment);
+		concealment = nullptr;
+		if (degradation == Concealed)
+			degradation = QuarterBand;
+	}
+}
+
+/**
+ * Move the applied gains a step towards their targets. Changes are spread over
+ * several granules to avoid zipper noise.
+ */
+void mp3::step_gain()
+{
+	if (gain_ramp > 0) {
+		gain_current += (gain_target - gain_current) / gain_ramp;
+		for (int sfb = 0; sfb < 22; sfb++)
+			eq_current[sfb] += (eq_target[sfb] - eq_current[sfb]) / gain_ramp;
+		gain_ramp--;
+	}
+
+	for (int sfb = 0; sfb < 22; sfb++)
+		gain_long[sfb] = gain_current + eq_current[sfb];
+
+	/* A short window has a third of the frequency resolution of a long window. */
+	int sfb = 0;
+	for (int i = 0; i < 13; i++) {
+		unsigned center = 3 * (header->band_index.short_win[i] + header->band_index.short_win[i + 1]) / 2;
+		while (sfb < 21 && center >= header->band_index.long_win[sfb + 1])
+			sfb++;
+		gain_short[i] = gain_long[sfb];
+	}
 }
 
 /**
@@ -674,11 +1321,12 @@ void mp3::requantize(int gr, int ch)
 	float exp1, exp2;
 	int window = 0;
 	int sfb = 0;
-	const float scalefac_mult = scalefac_scale[gr][ch] == 0 ? 0.5 : 1;
+	const float scalefac_mult = work->scalefac_scale[gr][ch] == 0 ? 0.5 : 1;
 
-	for (int sample = 0, i = 0; sample < 576; sample++, i++) {
-		if (block_type[gr][ch] == 2 || (mixed_block_flag[gr][ch] && sfb >= 8)) {
-			if (i == band_width.short_win[sfb]) {
+	/* Samples after the last non-zero sample remain zero. */
+	for (int sample = 0, i = 0; sample < work->nonzero[gr][ch]; sample++, i++) {
+		if (work->block_type[gr][ch] == 2 || (work->mixed_block_flag[gr][ch] && sfb >= 8)) {
+			if (i == header->band_width.short_win[sfb]) {
 				i = 0;
 				if (window == 2) {
 					window = 0;
@@ -687,23 +1335,79 @@ void mp3::requantize(int gr, int ch)
 					window++;
 			}
 
-			exp1 = global_gain[gr][ch] - 210.0 - 8.0 * subblock_gain[gr][ch][window];
-			exp2 = scalefac_mult * scalefac_s[gr][ch][window][sfb];
+			exp1 = work->global_gain[gr][ch] - 210.0 - 8.0 * work->subblock_gain[gr][ch][window] + gain_short[sfb];
+			exp2 = scalefac_mult * work->scalefac_s[gr][ch][window][sfb];
 		} else {
-			if (sample == band_index.long_win[sfb + 1])
+			if (sample == header->band_index.long_win[sfb + 1])
 				/* Don't increment sfb at the zeroth sample. */
 				sfb++;
 
-			exp1 = global_gain[gr][ch] - 210.0;
-			exp2 = scalefac_mult * (scalefac_l[gr][ch][sfb] + preflag[gr][ch] * pretab[sfb]);
+			exp1 = work->global_gain[gr][ch] - 210.0 + gain_long[sfb];
+			exp2 = scalefac_mult * (work->scalefac_l[gr][ch][sfb] + work->preflag[gr][ch] * pretab[sfb]);
 		}
 
-		float sign = samples[gr][ch][sample] < 0 ? -1.0f : 1.0f;
-		float a = std::pow(std::abs(samples[gr][ch][sample]), 4.0 / 3.0);
+		float sign = work->samples[gr][ch][sample] < 0 ? -1.0f : 1.0f;
+		float a = std::pow(std::abs(work->samples[gr][ch][sample]), 4.0 / 3.0);
 		float b = std::pow(2.0, exp1 / 4.0);
 		float c = std::pow(2.0, -exp2);
 
-		samples[gr][ch][sample] = sign * a * b * c;
+		work->samples[gr][ch][sample] = sign * a * b * c;
+	}
+}
+
+/**
+ * Scale the samples of a band: sign(s) * |s|^(4/3) * 2^(exp1 / 4) * 2^(-exp2)
+ */
+static inline void scale_band(float *samples, int width, float exp1, float exp2)
+{
+	float b = std::pow(2.0, exp1 / 4.0);
+	float c = std::pow(2.0, -exp2);
+
+	for (int i = 0; i < width; i++) {
+		float sign = samples[i] < 0 ? -1.0f : 1.0f;
+		float a = pow43[(int)std::abs(samples[i])];
+		samples[i] = sign * a * b * c;
+	}
+}
+
+/**
+ * Same as requantize(), but the gain is computed once per band and long and short
+ * blocks have separate loops. Not used for mixed blocks.
+ * @param gr
+ * @param ch
+ */
+template<int kind, unsigned rate>
+void mp3::requantize_bands(int gr, int ch)
+{
+	const unsigned *long_index = rate ? band_layout<rate>::long_index() : header->band_index.long_win;
+	const unsigned *short_width = rate ? band_layout<rate>::short_width() : header->band_width.short_win;
+	const float scalefac_mult = work->scalefac_scale[gr][ch] == 0 ? 0.5 : 1;
+	const int end = work->nonzero[gr][ch];
+	float *x = work->samples[gr][ch];
+
+	if (kind == LongBlocks) {
+		for (int sfb = 0; sfb < 22 && (int)long_index[sfb] < end; sfb++) {
+			float exp1 = work->global_gain[gr][ch] - 210.0 + gain_long[sfb];
+			float exp2 = scalefac_mult * (work->scalefac_l[gr][ch][sfb] + work->preflag[gr][ch] * pretab[sfb]);
+			scale_band(&x[long_index[sfb]], long_index[sfb + 1] - long_index[sfb], exp1, exp2);
+		}
+	} else {
+		int sample = 0;
+		for (int sfb = 0; sfb < 12 && sample < end; sfb++)
+			for (int window = 0; window < 3; window++) {
+				float exp1 = work->global_gain[gr][ch] - 210.0 - 8.0 * work->subblock_gain[gr][ch][window] + gain_short[sfb];
+				float exp2 = scalefac_mult * work->scalefac_s[gr][ch][window][sfb];
+				scale_band(&x[sample], short_width[sfb], exp1, exp2);
+				sample += short_width[sfb];
+			}
+
+		/* The width of the last band isn't in the table, so requantize() scales
+		 * the rest of the granule as the first window of the last band. */
+		if (sample < end) {
+			float exp1 = work->global_gain[gr][ch] - 210.0 - 8.0 * work->subblock_gain[gr][ch][0] + gain_short[12];
+			float exp2 = scalefac_mult * work->scalefac_s[gr][ch][0][12];
+			scale_band(&x[sample], 576 - sample, exp1, exp2);
+		}
 	}
 }
 
@@ -720,12 +1424,12 @@ void mp3::reorder(int gr, int ch)
 	float samples[576] = {0};
 
 	for (int sb = 0; sb < 12; sb++) {
-		const int sb_width = band_width.short_win[sb];
+		const int sb_width = header->band_width.short_win[sb];
 
 		for (int ss = 0; ss < sb_width; ss++) {
-			samples[start + block + 0] = this->samples[gr][ch][total + ss + sb_width * 0];
-			samples[start + block + 6] = this->samples[gr][ch][total + ss + sb_width * 1];
-			samples[start + block + 12] = this->samples[gr][ch][total + ss + sb_width * 2];
+			samples[start + block + 0] = work->samples[gr][ch][total + ss + sb_width * 0];
+			samples[start + block + 6] = work->samples[gr][ch][total + ss + sb_width * 1];
+			samples[start + block + 12] = work->samples[gr][ch][total + ss + sb_width * 2];
 
 			if (block != 0 && block % 5 == 0) { /* 6 * 3 = 18 */
 				start += 18;
@@ -738,7 +1442,7 @@ void mp3::reorder(int gr, int ch)
 	}
 
 	for (int i = 0; i < 576; i++)
-		this->samples[gr][ch][i] = samples[i];
+		work->samples[gr][ch][i] = samples[i];
 }
 
 /**
@@ -749,10 +1453,10 @@ void mp3::reorder(int gr, int ch)
 void mp3::ms_stereo(int gr)
 {
 	for (int sample = 0; sample < 576; sample++) {
-		float middle = samples[gr][0][sample];
-		float side = samples[gr][1][sample];
-		samples[gr][0][sample] = (middle + side) / SQRT2;
-		samples[gr][1][sample] = (middle - side) / SQRT2;
+		float middle = work->samples[gr][0][sample];
+		float side = work->samples[gr][1][sample];
+		work->samples[gr][0][sample] = (middle + side) / SQRT2;
+		work->samples[gr][1][sample] = (middle - side) / SQRT2;
 	}
 }
 
@@ -762,25 +1466,16 @@ void mp3::ms_stereo(int gr)
  */
 void mp3::alias_reduction(int gr, int ch)
 {
-	static const float cs[8] {
-			.8574929257, .8817419973, .9496286491, .9833145925,
-			.9955178161, .9991605582, .9998991952, .9999931551
-	};
-	static const float ca[8] {
-			-.5144957554, -.4717319686, -.3133774542, -.1819131996,
-			-.0945741925, -.0409655829, -.0141985686, -.0036999747
-	};
-
-	int sb_max = mixed_block_flag[gr][ch] ? 2 : 32;
+	int sb_max = work->mixed_block_flag[gr][ch] ? 2 : 32;
 
 	for (int sb = 1; sb < sb_max; sb++)
 		for (int sample = 0; sample < 8; sample++) {
 			int offset1 = 18 * sb - sample - 1;
 			int offset2 = 18 * sb + sample;
-			float s1 = samples[gr][ch][offset1];
-			float s2 = samples[gr][ch][offset2];
-			samples[gr][ch][offset1] = s1 * cs[sample] - s2 * ca[sample];
-			samples[gr][ch][offset2] = s2 * cs[sample] + s1 * ca[sample];
+			float s1 = work->samples[gr][ch][offset1];
+			float s2 = work->samples[gr][ch][offset2];
+			work->samples[gr][ch][offset1] = s1 * cs[sample] - s2 * ca[sample];
+			work->samples[gr][ch][offset2] = s2 * cs[sample] + s1 * ca[sample];
 		}
 }
 
@@ -793,54 +1488,26 @@ void mp3::alias_reduction(int gr, int ch)
  */
 void mp3::imdct(int gr, int ch)
 {
-	static bool init = true;
-	static float sine_block[4][36];
 	float sample_block[36];
 
-	if (init) {
-		int i;
-		for (i = 0; i < 36; i++)
-			sine_block[0][i] = std::sin(PI / 36.0 * (i + 0.5));
-		for (i = 0; i < 18; i++)
-			sine_block[1][i] = std::sin(PI / 36.0 * (i + 0.5));
-		for (; i < 24; i++)
-			sine_block[1][i] = 1.0;
-		for (; i < 30; i++)
-			sine_block[1][i] = std::sin(PI / 12.0 * (i - 18.0 + 0.5));
-		for (; i < 36; i++)
-			sine_block[1][i] = 0.0;
-		for (i = 0; i < 12; i++)
-			sine_block[2][i] = std::sin(PI / 12.0 * (i + 0.5));
-		for (i = 0; i < 6; i++)
-			sine_block[3][i] = 0.0;
-		for (; i < 12; i++)
-			sine_block[3][i] = std::sin(PI / 12.0 * (i - 6.0 + 0.5));
-		for (; i < 18; i++)
-			sine_block[3][i] = 1.0;
-		for (; i < 36; i++)
-			sine_block[3][i] = std::sin(PI / 36.0 * (i + 0.5));
-		init = false;
-	}
-
-	const int n = block_type[gr][ch] == 2 ? 12 : 36;
+	const int n = work->block_type[gr][ch] == 2 ? 12 : 36;
 	const int half_n = n / 2;
-	int sample = 0;
 
 	for (int block = 0; block < 32; block++) {
-		for (int win = 0; win < (block_type[gr][ch] == 2 ? 3 : 1); win++) {
+		for (int win = 0; win < (work->block_type[gr][ch] == 2 ? 3 : 1); win++) {
 			for (int i = 0; i < n; i++) {
 				float xi = 0.0;
 				for (int k = 0; k < half_n; k++) {
-					float s = samples[gr][ch][18 * block + half_n * win + k];
+					float s = work->samples[gr][ch][18 * block + half_n * win + k];
 					xi += s * std::cos(PI / (2 * n) * (2 * i + 1 + half_n) * (2 * k + 1));
 				}
 
 				/* Windowing samples. */
-				sample_block[win * n + i] = xi * sine_block[block_type[gr][ch]][i];
+				sample_block[win * n + i] = xi * imdct_window[work->block_type[gr][ch]][i];
 			}
 		}
 
-		if (block_type[gr][ch] == 2) {
+		if (work->block_type[gr][ch] == 2) {
 			float temp_block[36];
 			memcpy(temp_block, sample_block, 36 * 4);
 
@@ -859,89 +1526,218 @@ void mp3::imdct(int gr, int ch)
 				sample_block[i] = 0;
 		}
 
-		/* Overlap. */
+		/* Overlap. The output is transposed for the synthesis filter bank, and
+		 * odd time slots of odd subbands are inverted. */
 		for (int i = 0; i < 18; i++) {
-			samples[gr][ch][sample + i] = sample_block[i] + prev_samples[ch][block][i];
+			float sample = sample_block[i] + prev_samples[ch][block][i];
+			work->slots[i * 32 + block] = block & i & 1 ? -sample : sample;
 			prev_samples[ch][block][i] = sample_block[18 + i];
 		}
-		sample += 18;
 	}
 }
 
 /**
+ * Alias reduction, IMDCT, windowing, overlapping and frequency inversion in a
+ * single pass over the subbands. Each subband is gathered into 18 values (short
+ * blocks are reordered on the fly), the alias butterflies with the next subband
+ * are applied, and the previous subband is transformed while still in cache.
+ * Produces the same output as the separate stages.
  * @param gr
  * @param ch
  */
-void mp3::frequency_inversion(int gr, int ch)
+template<int kind, unsigned rate>
+void mp3::subband_kernel(int gr, int ch)
+{
+	const bool short_blocks = kind != LongBlocks;
+	const unsigned *short_index = rate ? band_layout<rate>::short_index() : header->band_index.short_win;
+	const unsigned *short_width = rate ? band_layout<rate>::short_width() : header->band_width.short_win;
+	const float *in = work->samples[gr][ch];
+	float x[2][18];
+	int sfb = 0;
+
+	for (int block = 0; block <= 32; block++) {
+		float *prev = x[(block + 1) & 1];
+		float *cur = x[block & 1];
+
+		if (block < 32) {
+			if (short_blocks) {
+				/* Line f of window w comes from 3 * index[sfb] + w * width[sfb] + f - index[sfb].
+				 * Lines of the last short band aren't reordered (see reorder()). */
+				for (int line = 6 * block; line < 6 * block + 6; line++) {
+					while (sfb < 12 && line >= (int)short_index[sfb + 1])
+						sfb++;
+					for (int win = 0; win < 3; win++) {
+						float sample = 0;
+						if (sfb < 12) {
+							int start = short_index[sfb];
+							sample = in[3 * start + win * short_width[sfb] + line - start];
+						}
+						cur[line - 6 * block + 6 * win] = sample;
+					}
+				}
+			} else {
+				for (int i = 0; i < 18; i++)
+					cur[i] = in[18 * block + i];
+
+				for (int i = 0; block > 0 && i < 8; i++) {
+					float s1 = prev[17 - i];
+					float s2 = cur[i];
+					prev[17 - i] = s1 * cs[i] - s2 * ca[i];
+					cur[i] = s2 * cs[i] + s1 * ca[i];
+				}
+			}
+		}
+
+		if (block == 0)
+			continue;
+
+		const int sb = block - 1;
+		if (sb >= active_subbands) {
+			/* Left out while degraded, so only the overlap remains. */
+			for (int i = 0; i < 18; i++) {
+				float sample = prev_samples[ch][sb][i];
+				work->slots[i * 32 + sb] = sb & i & 1 ? -sample : sample;
+				prev_samples[ch][sb][i] = 0;
+			}
+			continue;
+		}
+		float out[36];
+		if (kind == ShortBlocks) {
+			float win_out[3][12];
+			for (int win = 0; win < 3; win++)
+				for (int i = 0; i < 12; i++) {
+					float xi = 0.0;
+					for (int k = 0; k < 6; k++)
+						xi += prev[6 * win + k] * imdct_cos_short[i][k];
+					win_out[win][i] = xi * imdct_window[2][i];
+				}
+
+			int i = 0;
+			for (; i < 6; i++)
+				out[i] = 0;
+			for (; i < 12; i++)
+				out[i] = win_out[0][i - 6];
+			for (; i < 18; i++)
+				out[i] = win_out[0][i - 6] + win_out[1][i - 12];
+			for (; i < 24; i++)
+				out[i] = win_out[1][i - 12] + win_out[2][i - 18];
+			for (; i < 30; i++)
+				out[i] = win_out[2][i - 18];
+			for (; i < 36; i++)
+				out[i] = 0;
+		} else {
+			const float *window = imdct_window[work->block_type[gr][ch]];
+			for (int i = 0; i < 36; i++) {
+				float xi = 0.0;
+				for (int k = 0; k < 18; k++)
+					xi += prev[k] * imdct_cos_long[i][k];
+				out[i] = xi * window[i];
+			}
+		}
+
+		for (int i = 0; i < 18; i++) {
+			float sample = out[i] + prev_samples[ch][sb][i];
+			work->slots[i * 32 + sb] = sb & i & 1 ? -sample : sample;
+			prev_samples[ch][sb][i] = out[18 + i];
+		}
+	}
+}
+
+/**
+ * The IMDCT of a silent granule is zero, so only the overlap of the previous
+ * granule remains.
+ * @param ch
+ */
+void mp3::flush_overlap(int ch)
 {
-	for (int sb = 1; sb < 18; sb += 2)
-		for (int i = 1; i < 32; i += 2)
-			samples[gr][ch][i * 18 + sb] *= -1;
+	for (int block = 0; block < 32; block++)
+		for (int i = 0; i < 18; i++) {
+			float sample = prev_samples[ch][block][i];
+			work->slots[i * 32 + block] = block & i & 1 ? -sample : sample;
+			prev_samples[ch][block][i] = 0;
+		}
+	overlap_zero[ch] = true;
+	overlap_subbands[ch] = 0;
 }
 
 /**
+ * Each time slot of 32 subband samples is turned into 32 PCM samples, which are
+ * written to the granule in order.
  * @param gr
  * @param ch
+ * @param subbands The subbands above this many are zero and skipped.
  */
-void mp3::synth_filterbank(int gr, int ch)
+void mp3::synth_filterbank(int gr, int ch, int subbands)
 {
-	static float n[64][32];
-	static bool init = true;
-
-	if (init) {
-		init = false;
-		for (int i = 0; i < 64; i++)
-			for (int j = 0; j < 32; j++)
-				n[i][j] = std::cos((16.0 + i) * (2.0 * j + 1.0) * (PI / 64.0));
-	}
-
-	float s[32], u[512], w[512];
-	float pcm[576];
+	for (int slot = 0; slot < 18; slot++) {
+		const float *s = &work->slots[slot * 32];
+		float *pcm = &work->samples[gr][ch][slot * 32];
 
-	for (int sb = 0; sb < 18; sb++) {
-		for (int i = 0; i < 32; i++)
-			s[i] = samples[gr][ch][i * 18 + sb];
+		memmove(&fifo[ch][32], &fifo[ch][0], 480 * sizeof(float));
 
-		for (int i = 1023; i > 63; i--)
-			fifo[ch][i] = fifo[ch][i - 64];
-
-		for (int i = 0; i < 64; i++) {
+		/* Of the 64 values v[0..63] only v[0..15] and v[48..63] are kept:
+		 * v[16] = 0, v[32 - i] = -v[i] and v[96 - i] = v[i]. */
+		for (int i = 0; i < 32; i++) {
+			const float *c = synth_cos[i < 16 ? i : i + 32];
 			fifo[ch][i] = 0.0;
-			for (int j = 0; j < 32; j++)
-				fifo[ch][i] += s[j] * n[i][j];
+			for (int j = 0; j < subbands; j++)
+				fifo[ch][i] += s[j] * c[j];
 		}
 
-		for (int i = 0; i < 8; i++)
-			for (int j = 0; j < 32; j++) {
-				u[i * 64 + j] = fifo[ch][i * 128 + j];
-				u[i * 64 + j + 32] = fifo[ch][i * 128 + j + 96];
-			}
-
-		for (int i = 0; i < 512; i++)
-			w[i] = u[i] * synth_window[i];
-
+		/* Windowed are v[0..31] of even and v[32..63] of odd time slots. */
 		for (int i = 0; i < 32; i++) {
+			int even = i <= 16 ? i : 32 - i;
+			int odd = i == 0 || i >= 16 ? i : 32 - i;
+			float even_sign = i < 16 ? 1 : (i == 16 ? 0 : -1);
+			float odd_sign = i == 0 ? -1 : 1;
 			float sum = 0;
-			for (int j = 0; j < 16; j++)
-				sum += w[j * 32 + i];
-			pcm[32 * sb + i] = sum;
+			for (int j = 0; j < 16; j += 2) {
+				float w = even_sign * fifo[ch][j * 32 + even] * synth_window[j * 32 + i];
+				sum += w;
+				w = odd_sign * fifo[ch][(j + 1) * 32 + odd] * synth_window[(j + 1) * 32 + i];
+				sum += w;
+			}
+			pcm[i] = sum;
 		}
 	}
-
-	memcpy(samples[gr][ch], pcm, 576 * 4);
 }
 
-void mp3::interleave()
+/**
+ * Interleave the channels of a granule. If the rate is converted, the resampler
+ * writes its output interleaved, so the samples are only read once.
+ * @param gr
+ */
+void mp3::interleave(int gr)
 {
-	int i = 0;
-	for (int gr = 0; gr < 2; gr++)
-		for (int sample = 0; sample < 576; sample++)
-			for (int ch = 0; ch < channels; ch++)
-				pcm[i++] = samples[gr][ch][sample];
+	float *pcm = get_granule_samples(gr);
+	if (converter != nullptr) {
+		for (int ch = 0; ch < header->channels; ch++)
+			output_samples[gr] = converter->process(ch, work->samples[gr][ch], 576, &pcm[ch], header->channels);
+		return;
+	}
 
+	int i = 0;
+	for (int sample = 0; sample < 576; sample++)
+		for (int ch = 0; ch < header->channels; ch++)
+			pcm[i++] = work->samples[gr][ch][sample];
 }
 
 float *mp3::get_samples()
 {
-	return pcm;
+	return work->pcm;
+}
+
+unsigned mp3::get_sample_count()
+{
+	return output_samples[0] + output_samples[1];
+}
+
+float *mp3::get_granule_samples(int gr)
+{
+	return &work->pcm[gr == 0 ? 0 : output_samples[0] * header->channels];
+}
+
+unsigned mp3::get_granule_sample_count(int gr)
+{
+	return output_samples[gr];
 }
@@ -8,8 +8,7 @@
 #define MP3_H
 
 #include <cmath>
-#include <vector>
-#include "tables.h"
+#include "resampler.h"
 
 class mp3 {
 public:
@@ -26,9 +25,82 @@ public:
 		CCITJ17 = 3
 	};
 
+	static const int max_reservoir = 511;
+	static const int max_main_data = 1441;
+
+	/**
+	 * Scratch memory for decoding a frame. Nothing in it is needed by the next
+	 * frame, so streams that are decoded on the same thread can share one. The
+	 * samples returned by get_samples() live here and are only valid until the
+	 * workspace decodes another frame.
+	 */
+	struct workspace {
+		int main_data_begin;
+		bool scfsi[2][4];
+
+		/* Allocate space for two granules and two channels. */
+		int part2_3_length[2][2];
+		int part2_length[2][2];
+		int big_value[2][2];
+		int global_gain[2][2];
+		int scalefac_compress[2][2];
+		int slen1[2][2];
+		int slen2[2][2];
+		bool window_switching[2][2];
+		int block_type[2][2];
+		bool mixed_block_flag[2][2];
+		int switch_point_l[2][2];
+		int switch_point_s[2][2];
+		int table_select[2][2][3];
+		int subblock_gain[2][2][3];
+		int region0_count[2][2];
+		int region1_count[2][2];
+		int preflag[2][2];
+		int scalefac_scale[2][2];
+		int count1table_select[2][2];
+
+		int scalefac_l[2][2][22];
+		int scalefac_s[2][2][3][13];
+
+		/* One past the last non-zero sample of each granule. Silent granules
+		 * only flush the IMDCT overlap and the synthesis history. */
+		int nonzero[2][2];
+
+		/* The reservoir followed by the main data of the frame. Get_bits may
+		 * read a few bytes past the end. */
+		unsigned char main_data[max_reservoir + max_main_data + 4];
+		float samples[2][2][576];
+		/* Output of the IMDCT, ordered by time slot: slots[slot * 32 + subband]. */
+		float slots[576];
+		/* Two granules of two channels, which a resampler may make longer. */
+		float pcm[2 * 2 * (576 * resampler::max_ratio + 1)];
+	};
+
+	/**
+	 * Decode with a workspace of its own.
+	 * @param buffer A pointer to the first byte of the first frame header.
+	 */
 	mp3(unsigned char *buffer);
+	/**
+	 * Decode with a workspace that is shared with other decoders on this thread.
+	 * @param buffer A pointer to the first byte of the first frame header.
+	 * @param work Must outlive the decoder.
+	 */
+	mp3(unsigned char *buffer, workspace *work);
+	~mp3();
+	mp3(const mp3 &) = delete;
+	mp3 &operator=(const mp3 &) = delete;
  	void init_header_params(unsigned char *buffer);
 	void init_frame_params(unsigned char *buffer);
+	/**
+	 * Decode one granule of the frame, so that its samples can be played before
+	 * the other granule is decoded. Granule 0 also unpacks the side information
+	 * and main data, so granules must be decoded in order, and a shared workspace
+	 * must not be used by another decoder in between.
+	 * @param buffer A pointer to the first byte of the frame header.
+	 * @param gr 0 or 1.
+	 */
+	void init_granule_params(unsigned char *buffer, int gr);
 
 private:
 	unsigned char *buffer;
@@ -38,26 +110,45 @@ public:
 	bool is_valid();
 
 private: /* Header */
-	float mpeg_version;
-	unsigned layer;
-	bool crc;
-	unsigned bit_rate;
-	unsigned sampling_rate;
+	/* Everything that follows from the header word, except the padding and
+	 * mode extension bits which are read from every frame. Descriptors are kept
+	 * per stream, so a repeated header costs a compare and a pointer swap. */
+	static const unsigned header_mask = 0xFFFFFDCF;
+	static const int num_headers = 16;
+	struct frame_header {
+		unsigned word;
+		bool valid;
+		float mpeg_version;
+		unsigned layer;
+		bool crc;
+		unsigned bit_rate;
+		unsigned sampling_rate;
+		ChannelMode channel_mode;
+		int channels;
+		Emphasis emphasis;
+		bool info[3];
+		struct {
+			const unsigned *long_win;
+			const unsigned *short_win;
+		} band_index;
+		struct {
+			const unsigned *long_win;
+			const unsigned *short_win;
+		} band_width;
+		/* Frame size without padding. */
+		int frame_size;
+		/* Offset and size of the side information. */
+		int side_info_offset;
+		int side_info_size;
+	};
+	frame_header headers[num_headers];
+	frame_header *header;
+	int cached_headers;
+	int next_header;
 	bool padding;
-	ChannelMode channel_mode;
-	int channels;
 	unsigned mode_extension[2];
-	Emphasis emphasis;
-	bool info[3];
-	struct {
-		const unsigned *long_win;
-		const unsigned *short_win;
-	} band_index;
-	struct {
-		const unsigned *long_win;
-		const unsigned *short_win;
-	} band_width;
 
+	void set_header(unsigned word);
 	void set_mpeg_version();
 	void set_layer(unsigned char byte);
 	void set_crc();
@@ -82,63 +173,205 @@ public:
 	Emphasis get_emphasis();
 	bool *get_info();
 
+private: /* Gain */
+	/* Gains are kept in the units of the requantization exponent (quarter
+	 * powers of two) so that they can be added to global_gain directly. */
+	static const int gain_ramp_granules = 8;
+	int gain_ramp;
+	float gain_target;
+	float gain_current;
+	float eq_target[22];
+	float eq_current[22];
+	float gain_long[22];
+	float gain_short[13];
+
+	void step_gain();
+
+public:
+	void set_gain(float db);
+	void set_equalizer(const float *db, int bands);
+	float get_gain();
+
+	enum Degradation {
+		/* Every subband is decoded. */
+		Intact = 0,
+		/* The upper half of the subbands is left out. */
+		HalfBand = 1,
+		/* Only the lowest quarter of the subbands is decoded. */
+		QuarterBand = 2,
+		/* Frames aren't decoded. The last granule that was decoded is repeated
+		 * and faded out, and only the bit reservoir is kept up to date. */
+		Concealed = 3
+	};
+
+private: /* Degradation */
+	Degradation degradation;
+	/* Both are fixed while a frame is decoded. */
+	bool concealing;
+	int active_subbands;
+	/* The last granule of each channel, which concealment repeats. It is only
+	 * allocated and kept while concealment is enabled. */
+	float (*concealment)[576];
+	bool concealment_saved;
+	/* Whether the granule was last output forwards or backwards. */
+	bool concealment_forward;
+	float conceal_gain;
+	/* The last granule was concealed, so the next decoded one fades in. */
+	bool resuming;
+
+	void conceal_granule(int gr);
+	void repeat_granule(int ch, float *samples);
+	void resume_granule(int gr, int channels);
+	void save_granule(int gr, int channels);
+
+public:
+	/**
+	 * Trade quality for time from the next frame on, when decoding the frame
+	 * whole would make it late. Leaving out subbands saves part of the
+	 * requantization, IMDCT and synthesis; concealment saves nearly all of
+	 * the decoding. Decoding at a lower degradation again continues from the
+	 * state that the degraded frames left.
+	 * @param level Concealed is taken as QuarterBand unless concealment is
+	 * enabled.
+	 */
+	void set_degradation(Degradation level);
+	Degradation get_degradation();
+	/**
+	 * Keep the last granule that was decoded, so that frames can be
+	 * concealed. Enable it before decoding, since it allocates.
+	 * @param enable
+	 * @throws std::bad_alloc
+	 */
+	void set_concealment(bool enable);
+
+private:
+	workspace *work;
+	bool owns_work;
+
 private: /* Frame */
-	static const int num_prev_frames = 9;
-	int prev_frame_size[9];
 	int frame_size;
 
-	int main_data_begin;
-	bool scfsi[2][4];
-
-	/* Allocate space for two granules and two channels. */
-	int part2_3_length[2][2];
-	int part2_length[2][2];
-	int big_value[2][2];
-	int global_gain[2][2];
-	int scalefac_compress[2][2];
-	int slen1[2][2];
-	int slen2[2][2];
-	bool window_switching[2][2];
-	int block_type[2][2];
-	bool mixed_block_flag[2][2];
-	int switch_point_l[2][2];
-	int switch_point_s[2][2];
-	int table_select[2][2][3];
-	int subblock_gain[2][2][3];
-	int region0_count[2][2];
-	int region1_count[2][2];
-	int preflag[2][2];
-	int scalefac_scale[2][2];
-	int count1table_select[2][2];
-
-	int scalefac_l[2][2][22];
-	int scalefac_s[2][2][3][13];
+	/* The last bytes of main data, which later frames may begin in. */
+	unsigned char reservoir[max_reservoir];
+	int reservoir_size;
 
 	float prev_samples[2][32][18];
-	float fifo[2][1024];
+	/* Only 32 of the 64 values the matrixing yields for a time slot are kept.
+	 * The others follow by symmetry; see synth_filterbank. */
+	float fifo[2][16 * 32];
 
-	std::vector<unsigned char> main_data;
-	float samples[2][2][576];
-	float pcm[576 * 4];
+	bool overlap_zero[2];
+	bool history_zero[2];
+	/* Subbands of the overlap that may be non-zero, which are synthesized
+	 * with the next granule even if it has fewer active subbands. */
+	int overlap_subbands[2];
+	unsigned granules;
+	unsigned silent_granules;
+	bool fused_kernel;
+	/* Converts the synthesized granules to the output rate, if set. */
+	resampler *converter;
+	unsigned output_rate;
+	unsigned output_samples[2];
 
 	void set_frame_size();
 	void set_side_info(unsigned char *buffer);
 	void set_main_data(unsigned char *buffer);
 	void unpack_scalefac(unsigned char *bit_stream, int gr, int ch, int &bit);
 	void unpack_samples(unsigned char *bit_stream, int gr, int ch, int bit, int max_bit);
+	enum BlockKind {
+		LongBlocks = 0,
+		ShortBlocks = 1,
+		MixedBlocks = 2
+	};
+
+	template<int num_channels> void decode_granule(int gr);
+	template<int kind, unsigned rate> void requantize_bands(int gr, int ch);
+	template<int kind, unsigned rate> void subband_kernel(int gr, int ch);
 	void requantize(int gr, int ch);
 	void ms_stereo(int gr);
 	void reorder(int gr, int ch);
 	void alias_reduction(int gr, int ch);
 	void imdct(int gr, int ch);
-	void frequency_inversion(int gr, int ch);
-	void synth_filterbank(int gr, int ch);
-	void interleave();
+	void flush_overlap(int ch);
+	void synth_filterbank(int gr, int ch, int subbands);
+	void interleave(int gr);
 
 public:
 	float *get_samples();
+	/** Samples per channel in get_samples(), 1152 unless the rate is converted. */
+	unsigned get_sample_count();
+	/** The interleaved samples of a granule, 576 per channel unless the rate is converted. */
+	float *get_granule_samples(int gr);
+	unsigned get_granule_sample_count(int gr);
 	unsigned get_frame_size();
 	unsigned get_header_size();
+	unsigned get_granules();
+	unsigned get_silent_granules();
+	void set_fused_kernel(bool enable);
+
+	/**
+	 * Decode the next frames with another workspace, for instance the one of
+	 * the thread that will decode them. Samples of the last frame are lost.
+	 * @param work Must outlive the decoder, or nullptr for one of its own.
+	 * @throws std::bad_alloc
+	 */
+	void set_workspace(workspace *work);
+
+	/**
+	 * Convert the samples to another rate as each granule is interleaved. The
+	 * resampler is made for the current sampling rate of the stream.
+	 * @param rate At most resampler::max_ratio times the sampling rate, or 0 to
+	 * stop converting.
+	 * @param quality
+	 * @return False if the rate can't be converted to.
+	 * @throws std::bad_alloc
+	 */
+	bool set_output_rate(unsigned rate, resampler::Quality quality = resampler::Medium);
+	/** The sampling rate of get_samples(). */
+	unsigned get_output_rate();
+
+private: /* State */
+	static const unsigned state_magic = 0x5333504D; /* "MP3S" */
+	static const unsigned state_version = 1;
+	/* The version, layer and sampling rate of the header word. */
+	static const unsigned format_mask = 0x001E0C00;
+	enum StateFlags {
+		OverlapSaved = 1,
+		HistorySaved = 4,
+		GainSaved = 16,
+		ConverterSaved = 32
+	};
+
+	unsigned get_state_flags();
+
+public:
+	/**
+	 * Bytes that save_state() writes. Silent channels and settings that are
+	 * at their defaults take no room, so this is at most about 10 KB.
+	 */
+	unsigned get_state_size();
+	/**
+	 * Write what decoding the next frame depends on: the bit reservoir, the
+	 * IMDCT overlap, the synthesis history, the gain and equalizer ramps and
+	 * the resampler. A decoder that loads it decodes the frames that follow
+	 * exactly as this one would, with no earlier frames to decode first. The
+	 * degradation and the granule that concealment repeats aren't saved, so
+	 * this only holds for frames that are decoded whole.
+	 * @param state Room for get_state_size() bytes.
+	 * @return Bytes written.
+	 */
+	unsigned save_state(unsigned char *state);
+	/**
+	 * Continue from a saved state, for instance after a restart or in another
+	 * process. The decoder must have been made for a stream with the same
+	 * version, layer, sampling rate and number of channels.
+	 * @param state
+	 * @param size
+	 * @return False if the state is of another version or format, or is cut
+	 * short. The decoder is unchanged then.
+	 * @throws std::bad_alloc If the state has a resampler.
+	 */
+	bool load_state(const unsigned char *state, unsigned size);
 };
 
 #endif	/* MP3_H */
@@ -0,0 +1,148 @@
+/*
+ * The C interface of libmp3decoder, for embedding the decoder in programs that
+ * aren't written in C++. A decoder is an opaque handle that is fed the bytes of
+ * a stream in pieces of any size and decodes a frame at a time:
+ *
+ *     mp3d_decoder *decoder = mp3d_create();
+ *     float pcm[MP3D_MAX_SAMPLES];
+ *     size_t count;
+ *     int status;
+ *     while ((status = mp3d_decode(decoder, pcm, MP3D_MAX_SAMPLES, &count)) != MP3D_END) {
+ *         if (status == MP3D_NEED_INPUT)
+ *             ... mp3d_feed() more input, or mp3d_end_of_input() ...
+ *         else if (status == MP3D_FRAME)
+ *             ... count interleaved samples per channel are in pcm ...
+ *         else
+ *             break;
+ *     }
+ *     mp3d_destroy(decoder);
+ *
+ * No function throws; errors are returned as negative status codes. Symbols
+ * are versioned, and the names in this header keep their meaning within a
+ * major version of the library.
+ */
+
+#ifndef MP3DECODER_H
+#define MP3DECODER_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The version of the interface, which mp3d_version() returns. */
+#define MP3D_VERSION 1
+
+/** Floats that mp3d_decode() needs room for: a frame of two channels at twice its rate. */
+#define MP3D_MAX_SAMPLES (1152 * 2 * 2 + 4)
+
+enum mp3d_status {
+	MP3D_OK = 0,
+	/* The buffer holds the samples of a new frame. */
+	MP3D_FRAME = 1,
+	/* Feed input, or mark its end, and decode again. */
+	MP3D_NEED_INPUT = 2,
+	/* There is no more input, or it no longer holds frames. */
+	MP3D_END = 3,
+	MP3D_ERROR_ARGUMENT = -1,
+	MP3D_ERROR_MEMORY = -2,
+	/* The call isn't possible before the first frame has been decoded. */
+	MP3D_ERROR_STATE = -3,
+	MP3D_ERROR_FILE = -4,
+	MP3D_ERROR_RATE = -5
+};
+
+enum mp3d_quality {
+	MP3D_QUALITY_LOW = 0,
+	MP3D_QUALITY_MEDIUM = 1,
+	MP3D_QUALITY_HIGH = 2
+};
+
+/** What mp3d_probe() finds out about a file. */
+struct mp3d_info {
+	unsigned sampling_rate;
+	unsigned channels;
+	/* Average bit rate in bits per second. */
+	unsigned bit_rate;
+	int vbr;
+	unsigned long frames;
+	/* Seconds, without the encoder delay and padding if they are known. */
+	double duration;
+	/* The duration is estimated from the first frames. */
+	int estimated;
+};
+
+typedef struct mp3d_decoder mp3d_decoder;
+
+/** MP3D_VERSION of the library that is loaded. */
+int mp3d_version(void);
+
+/** @return A decoder, or NULL if it couldn't be allocated. */
+mp3d_decoder *mp3d_create(void);
+/** @param decoder May be NULL. */
+void mp3d_destroy(mp3d_decoder *decoder);
+
+/**
+ * Copy as much input as fits. Input that doesn't fit is fed again after
+ * mp3d_decode() has taken a frame.
+ * @param decoder
+ * @param data
+ * @param size
+ * @return Bytes taken.
+ */
+size_t mp3d_feed(mp3d_decoder *decoder, const void *data, size_t size);
+/** No input follows what was fed. */
+int mp3d_end_of_input(mp3d_decoder *decoder);
+
+/**
+ * Decode the next frame.
+ * @param decoder
+ * @param pcm Receives the interleaved samples.
+ * @param capacity Floats in pcm, at least MP3D_MAX_SAMPLES.
+ * @param count Receives the samples per channel, 0 unless the status is MP3D_FRAME.
+ * @return A status.
+ */
+int mp3d_decode(mp3d_decoder *decoder, float *pcm, size_t capacity, size_t *count);
+
+/**
+ * The format of the samples, which is known once a frame has been decoded.
+ * @param decoder
+ * @param sampling_rate May be NULL.
+ * @param channels May be NULL.
+ */
+int mp3d_get_format(mp3d_decoder *decoder, unsigned *sampling_rate, unsigned *channels);
+
+/**
+ * Convert the samples to another rate, from the next frame on.
+ * @param decoder
+ * @param rate At most twice the sampling rate of the stream, or 0 to stop converting.
+ * @param quality
+ */
+int mp3d_set_output_rate(mp3d_decoder *decoder, unsigned rate, enum mp3d_quality quality);
+
+/**
+ * Start over at a time in the stream. Input that was fed is dropped, and the
+ * caller feeds the stream from the returned position on. The position comes
+ * from the Xing table of contents if the stream has one and from the bit rate
+ * otherwise, so it is exact only for constant bit rates.
+ * @param decoder
+ * @param seconds
+ * @param offset Receives the position in the stream to feed from.
+ * @return MP3D_ERROR_STATE if the first frame hasn't been decoded, unless
+ * seconds is 0.
+ */
+int mp3d_seek(mp3d_decoder *decoder, double seconds, unsigned long long *offset);
+
+/**
+ * Read the properties of a file without decoding it.
+ * @param path
+ * @param info
+ */
+int mp3d_probe(const char *path, struct mp3d_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* MP3DECODER_H */
@@ -0,0 +1,307 @@
+/*
+ * Plays PCM through ALSA. A producer thread decodes ahead into a ring, while
+ * the calling thread hands the ring over to ALSA a period at a time. A slow
+ * frame then only drains the ring, not the device buffer, and the decoder runs
+ * in bursts whenever half of the ring is free.
+ *
+ * In live mode there is no ring: samples go to the device as soon as they are
+ * decoded, through mmap and with small periods.
+ *
+ * Only built if HAVE_ALSA is defined.
+ */
+
+#ifdef HAVE_ALSA
+
+#include <alsa/asoundlib.h> /* dnf install alsa-lib-devel */ /* apt install libasound2-dev */
+#include <chrono>
+#include <string.h>
+#include <thread>
+#include "player.h"
+#include "util.h"
+
+#define ALSA_PCM_NEW_HW_PARAMS_API
+
+/* Samples per channel in a period of the device, and periods in its buffer.
+ * Live periods are a quarter of a granule; the buffer holds two frames so that
+ * whole frames can be written as well. */
+static const unsigned period_size[2] = {1152, 144};
+static const unsigned periods[2] = {4, 16};
+
+player::player(unsigned sampling_rate, unsigned channels, unsigned depth, Mode mode) :
+	queue(mode == Live ? 1 : depth * channels)
+{
+	handle = nullptr;
+	valid = false;
+	this->mode = mode;
+	this->sampling_rate = sampling_rate;
+	this->channels = channels;
+	period = period_size[mode];
+	period_samples = nullptr;
+	finished.store(false);
+	stopped.store(false);
+	underruns.store(0);
+	xruns.store(0);
+
+	if (snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+		handle = nullptr;
+		return;
+	}
+	set_device();
+	if (valid)
+		period_samples = static_cast<float *>(allocate(period * channels * sizeof(float)));
+}
+
+player::~player()
+{
+	if (period_samples != nullptr)
+		release(period_samples);
+	if (handle != nullptr)
+		snd_pcm_close(handle);
+}
+
+/**
+ * Ask for a buffer of a few periods so that a write fits a period. Live
+ * devices start as soon as a period is written.
+ */
+void player::set_device()
+{
+	snd_pcm_hw_params_t *hw = NULL;
+	snd_pcm_sw_params_t *sw = NULL;
+	snd_pcm_uframes_t frames = period;
+	snd_pcm_uframes_t buffer_frames = period * periods[mode];
+	unsigned rate = sampling_rate;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(handle, hw);
+
+	snd_pcm_access_t access = mode == Live ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED;
+	if (snd_pcm_hw_params_set_access(handle, hw, access) < 0)
+		return;
+	if (snd_pcm_hw_params_set_format(handle, hw, SND_PCM_FORMAT_FLOAT_LE) < 0)
+		return;
+	if (snd_pcm_hw_params_set_channels(handle, hw, channels) < 0)
+		return;
+	if (snd_pcm_hw_params_set_rate_near(handle, hw, &rate, NULL) < 0)
+		return;
+	if (snd_pcm_hw_params_set_period_size_near(handle, hw, &frames, NULL) < 0)
+		return;
+	if (snd_pcm_hw_params_set_buffer_size_near(handle, hw, &buffer_frames) < 0)
+		return;
+	if (snd_pcm_hw_params(handle, hw) < 0)
+		return;
+	if (snd_pcm_hw_params_get_period_size(hw, &frames, NULL) < 0)
+		return;
+	period = frames;
+
+	if (mode == Live) {
+		snd_pcm_sw_params_alloca(&sw);
+		if (snd_pcm_sw_params_current(handle, sw) < 0)
+			return;
+		if (snd_pcm_sw_params_set_start_threshold(handle, sw, period) < 0)
+			return;
+		if (snd_pcm_sw_params_set_avail_min(handle, sw, period) < 0)
+			return;
+		if (snd_pcm_sw_params(handle, sw) < 0)
+			return;
+	}
+	valid = true;
+}
+
+bool player::is_valid()
+{
+	return valid;
+}
+
+/**
+ * Wait for the producer to fill half of the ring, then keep handing a period
+ * to the device until the producer is done and the ring is empty.
+ */
+void player::play(source decode)
+{
+	if (!valid)
+		return;
+
+	if (mode == Live) {
+		const float *samples;
+		unsigned count;
+		while ((count = decode(samples)) > 0)
+			if (!write(samples, count))
+				break;
+		finish();
+		return;
+	}
+
+	std::chrono::microseconds nap(1000000ull * period / sampling_rate / 4);
+	std::thread producer(&player::produce, this, decode);
+	unsigned count = period * channels;
+	bool primed = false;
+	bool starving = false;
+
+	while (!stopped.load()) {
+		unsigned readable = queue.get_readable();
+		bool done = finished.load(std::memory_order_acquire);
+		if (done)
+			readable = queue.get_readable();
+		else if (!primed && readable < queue.get_capacity() / 2) {
+			std::this_thread::sleep_for(nap);
+			continue;
+		}
+		primed = true;
+
+		if (readable < count && !done) {
+			/* Count each time the ring runs dry, not each wait. */
+			if (!starving)
+				underruns++;
+			starving = true;
+			std::this_thread::sleep_for(nap);
+			continue;
+		}
+		starving = false;
+		if (readable == 0)
+			break;
+
+		unsigned n = queue.read(period_samples, readable < count ? readable : count);
+		if (!write(period_samples, n / channels))
+			stopped.store(true);
+	}
+
+	stopped.store(true);
+	producer.join();
+	finish();
+}
+
+/**
+ * Decode into the ring. When the ring is full, sleep until half of it is free
+ * so that the decoder runs in bursts. A frame that is larger than the ring,
+ * such as a resampled one with a small --ahead, is written in pieces.
+ * @param decode
+ */
+void player::produce(source decode)
+{
+	std::chrono::microseconds nap(1000000ull * period / sampling_rate / 2);
+	const float *samples;
+	unsigned count;
+
+	while (!stopped.load() && (count = decode(samples) * channels) > 0) {
+		unsigned low = queue.get_capacity() / 2;
+		while (!stopped.load() && count > 0) {
+			if (queue.get_writable() < count) {
+				unsigned wanted = count > low ? count : low;
+				if (wanted > queue.get_capacity())
+					wanted = queue.get_capacity();
+				while (!stopped.load() && queue.get_writable() < wanted)
+					std::this_thread::sleep_for(nap);
+			}
+			/* The ring only ever holds whole sample frames, so pieces keep
+			 * the channels in order. */
+			unsigned n = queue.write(samples, count);
+			samples += n;
+			count -= n;
+		}
+	}
+	finished.store(true, std::memory_order_release);
+}
+
+bool player::write(const float *samples, unsigned count)
+{
+	if (mode == Live)
+		return write_mmap(samples, count);
+
+	while (count > 0) {
+		snd_pcm_sframes_t n = snd_pcm_writei(handle, samples, count);
+		if (n == -EAGAIN)
+			continue;
+		if (n < 0) {
+			if (n == -EPIPE)
+				xruns++;
+			if (snd_pcm_recover(handle, n, 1) < 0)
+				return false;
+			continue;
+		}
+		samples += n * channels;
+		count -= n;
+	}
+	return true;
+}
+
+/**
+ * Copy into the buffer of the device itself, without the copy that
+ * snd_pcm_writei makes.
+ */
+bool player::write_mmap(const float *samples, unsigned count)
+{
+	while (count > 0) {
+		snd_pcm_sframes_t available = snd_pcm_avail_update(handle);
+		if (available < 0) {
+			if (available == -EPIPE)
+				xruns++;
+			if (snd_pcm_recover(handle, available, 1) < 0)
+				return false;
+			continue;
+		}
+		if ((snd_pcm_uframes_t)available < count && (snd_pcm_uframes_t)available < period) {
+			if (snd_pcm_wait(handle, 1000) < 0 && snd_pcm_recover(handle, -EPIPE, 1) < 0)
+				return false;
+			continue;
+		}
+
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset;
+		snd_pcm_uframes_t frames = count;
+		int e = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+		if (e < 0) {
+			if (snd_pcm_recover(handle, e, 1) < 0)
+				return false;
+			continue;
+		}
+
+		unsigned char *out = static_cast<unsigned char *>(areas[0].addr);
+		memcpy(&out[(areas[0].first + offset * areas[0].step) / 8], samples, frames * channels * sizeof(float));
+		snd_pcm_sframes_t n = snd_pcm_mmap_commit(handle, offset, frames);
+		if (n < 0 || (snd_pcm_uframes_t)n != frames) {
+			if (n == -EPIPE)
+				xruns++;
+			if (snd_pcm_recover(handle, n < 0 ? n : -EPIPE, 1) < 0)
+				return false;
+			continue;
+		}
+		samples += n * channels;
+		count -= n;
+	}
+	return true;
+}
+
+bool player::finish()
+{
+	return snd_pcm_drain(handle) >= 0;
+}
+
+double player::get_delay()
+{
+	snd_pcm_sframes_t frames;
+	if (snd_pcm_delay(handle, &frames) < 0)
+		return 0;
+	return (double)frames / sampling_rate;
+}
+
+double player::get_queued()
+{
+	return (double)queue.get_readable() / channels / sampling_rate;
+}
+
+unsigned player::get_period()
+{
+	return period;
+}
+
+unsigned long player::get_underruns()
+{
+	return underruns.load();
+}
+
+unsigned long player::get_xruns()
+{
+	return xruns.load();
+}
+
+#endif	/* HAVE_ALSA */
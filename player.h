@@ -0,0 +1,104 @@
+/*
+ * Plays PCM through ALSA. A producer thread decodes ahead into a ring, while
+ * the calling thread hands the ring over to ALSA a period at a time. A slow
+ * frame then only drains the ring, not the device buffer, and the decoder runs
+ * in bursts whenever half of the ring is free.
+ *
+ * In live mode there is no ring: samples go to the device as soon as they are
+ * decoded, through mmap and with small periods.
+ *
+ * Only built if HAVE_ALSA is defined.
+ */
+
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include <atomic>
+#include <functional>
+#include "ring.h"
+#include "sink.h"
+
+typedef struct _snd_pcm snd_pcm_t;
+
+class player : public sink {
+public:
+	enum Mode {
+		Buffered = 0,
+		Live = 1
+	};
+
+	/**
+	 * Decodes the next frame, or the next granule.
+	 * @param samples Set to interleaved PCM that stays valid until the next call.
+	 * @return Samples per channel, or 0 at the end of the stream.
+	 */
+	typedef std::function<unsigned(const float *&samples)> source;
+
+	/**
+	 * @param sampling_rate
+	 * @param channels
+	 * @param depth Samples per channel to decode ahead of the device. Not used
+	 * in live mode.
+	 * @param mode
+	 */
+	player(unsigned sampling_rate, unsigned channels, unsigned depth, Mode mode = Buffered);
+	~player();
+	player(const player &) = delete;
+	player &operator=(const player &) = delete;
+
+	/** False if the device couldn't be opened or configured. */
+	bool is_valid();
+
+	/**
+	 * Play until decode reaches the end of the stream. decode is called on
+	 * another thread, unless the player is live.
+	 * @param decode
+	 */
+	void play(source decode);
+
+	/**
+	 * Write to the device directly, waiting until it has room. Recovers from
+	 * xruns. Can be used instead of play().
+	 * @param samples Interleaved.
+	 * @param count Samples per channel.
+	 * @return False if the device can't recover.
+	 */
+	bool write(const float *samples, unsigned count);
+	/** Wait until the device has played what was written. */
+	bool finish();
+
+	/** Seconds until a sample that is written now is played. */
+	double get_delay();
+	/**
+	 * Seconds of samples in the ring, which are played before a sample that
+	 * is decoded now. A lower bound on the thread that decodes.
+	 */
+	double get_queued();
+	/** Samples per channel in a period of the device. */
+	unsigned get_period();
+
+	/** Times that the ring ran empty while the device still needed samples. */
+	unsigned long get_underruns();
+	/** Times that the device itself ran out of samples. */
+	unsigned long get_xruns();
+
+private:
+	snd_pcm_t *handle;
+	bool valid;
+	Mode mode;
+	unsigned sampling_rate;
+	unsigned channels;
+	unsigned period;
+	float *period_samples;
+	ring queue;
+	std::atomic<bool> finished;
+	std::atomic<bool> stopped;
+	std::atomic<unsigned long> underruns;
+	std::atomic<unsigned long> xruns;
+
+	void set_device();
+	void produce(source decode);
+	bool write_mmap(const float *samples, unsigned count);
+};
+
+#endif	/* PLAYER_H */
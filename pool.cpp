@@ -0,0 +1,83 @@
+/*
+ * Runs a list of tasks on a fixed number of threads. Each thread has a deque
+ * of its own that it takes tasks from the back of. A thread that runs out
+ * steals from the front of another, so long tasks don't leave threads idle
+ * once the short ones are done.
+ */
+
+#include <thread>
+#include "pool.h"
+
+pool::pool(unsigned threads) : queues(threads > 0 ? threads : 1)
+{
+	this->threads = threads > 0 ? threads : 1;
+	steals = 0;
+}
+
+/**
+ * Task i goes to thread i % threads, and each thread starts with its lowest
+ * task. The first tasks are therefore started first on every thread, and the
+ * last ones are left over to be stolen.
+ */
+void pool::run(unsigned count, job run)
+{
+	for (unsigned i = count; i > 0; i--)
+		queues[(i - 1) % threads].tasks.push_back(i - 1);
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; i++)
+		workers.emplace_back(&pool::work, this, i, std::cref(run));
+	work(0, run);
+	for (std::thread &worker : workers)
+		worker.join();
+}
+
+unsigned long pool::get_steals()
+{
+	return steals;
+}
+
+/**
+ * No task adds tasks, so once every deque is empty there is nothing left to
+ * wait for.
+ */
+void pool::work(unsigned thread, const job &run)
+{
+	unsigned task;
+	int next;
+	while (take(thread, task, next) || steal(thread, task))
+		run(task, next);
+}
+
+bool pool::take(unsigned thread, unsigned &task, int &next)
+{
+	queue &own = queues[thread];
+	std::lock_guard<std::mutex> guard(own.lock);
+	next = -1;
+	if (own.tasks.empty())
+		return false;
+	task = own.tasks.back();
+	own.tasks.pop_back();
+	if (!own.tasks.empty())
+		next = own.tasks.back();
+	return true;
+}
+
+/**
+ * Take the front task of the next thread that has one. The front is the task
+ * its owner would have run last.
+ */
+bool pool::steal(unsigned thread, unsigned &task)
+{
+	for (unsigned i = 1; i < threads; i++) {
+		queue &other = queues[(thread + i) % threads];
+		std::lock_guard<std::mutex> guard(other.lock);
+		if (!other.tasks.empty()) {
+			task = other.tasks.front();
+			other.tasks.pop_front();
+			steals++;
+			return true;
+		}
+	}
+	return false;
+}
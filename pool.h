@@ -0,0 +1,57 @@
+/*
+ * Runs a list of tasks on a fixed number of threads. Each thread has a deque
+ * of its own that it takes tasks from the back of. A thread that runs out
+ * steals from the front of another, so long tasks don't leave threads idle
+ * once the short ones are done.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+class pool {
+public:
+	/**
+	 * @param task Index of the task to run.
+	 * @param next The task that this thread will most likely run next, or -1.
+	 * Lets the task read ahead for it.
+	 */
+	typedef std::function<void(unsigned task, int next)> job;
+
+	/** @param threads At least 1, including the calling thread. */
+	pool(unsigned threads);
+	pool(const pool &) = delete;
+	pool &operator=(const pool &) = delete;
+
+	/**
+	 * Run tasks [0, count) and return when all of them are done. Tasks are
+	 * dealt out in order, so the longest ones should come first.
+	 * @param count
+	 * @param run Called on any of the threads.
+	 */
+	void run(unsigned count, job run);
+
+	/** Tasks that were taken from the deque of another thread. */
+	unsigned long get_steals();
+
+private:
+	struct queue {
+		std::mutex lock;
+		std::deque<unsigned> tasks;
+	};
+
+	unsigned threads;
+	std::vector<queue> queues;
+	std::atomic<unsigned long> steals;
+
+	void work(unsigned thread, const job &run);
+	bool take(unsigned thread, unsigned &task, int &next);
+	bool steal(unsigned thread, unsigned &task);
+};
+
+#endif	/* POOL_H */
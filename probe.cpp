@@ -0,0 +1,515 @@
+/*
+ * Reads the properties and tags of a file without decoding it. Only a few small
+ * ranges are read: the ID3v2 tag, the first frame with its Xing/Info tag, and
+ * the ID3v1 and APE tags at the end.
+ * | ID3v2 | Xing/Info | Frame | ... | Frame | APE | ID3v1 |
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "probe.h"
+#include "xing.h"
+
+/* Frames that are scanned when a file has no Xing/Info tag. */
+static const unsigned scan_frames = 64;
+
+/* Genres of ID3v1, without the Winamp extensions. */
+static const char *genres[80] = {
+	"Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge",
+	"Hip-Hop", "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B",
+	"Rap", "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska",
+	"Death Metal", "Pranks", "Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop",
+	"Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical", "Instrumental",
+	"Acid", "House", "Game", "Sound Clip", "Gospel", "Noise", "AlternRock",
+	"Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop",
+	"Instrumental Rock", "Ethnic", "Gothic", "Darkwave", "Techno-Industrial",
+	"Electronic", "Pop-Folk", "Eurodance", "Dream", "Southern Rock", "Comedy",
+	"Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+	"Native American", "Cabaret", "New Wave", "Psychadelic", "Rave",
+	"Showtunes", "Trailer", "Lo-Fi", "Tribal", "Acid Punk", "Acid Jazz",
+	"Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock"
+};
+
+static unsigned little_endian(const unsigned char *buffer)
+{
+	return (unsigned)buffer[3] << 24 | buffer[2] << 16 | buffer[1] << 8 | buffer[0];
+}
+
+/**
+ * A frame header that the decoder can unpack: not free format and not a
+ * reserved bit rate, sampling rate or layer.
+ */
+static bool is_header(const unsigned char *buffer)
+{
+	return buffer[0] == 0xFF && (buffer[1] & 0xE0) == 0xE0 && (buffer[1] & 0x06) != 0 &&
+		(buffer[1] & 0x18) != 0x08 && (buffer[2] & 0xF0) != 0 &&
+		(buffer[2] & 0xF0) != 0xF0 && (buffer[2] & 0x0C) != 0x0C;
+}
+
+static unsigned get_samples_per_frame(float mpeg_version, unsigned layer)
+{
+	if (layer == 1)
+		return 384;
+	if (layer == 3 && mpeg_version != 1)
+		return 576;
+	return 1152;
+}
+
+/**
+ * Which field an ID3v2 frame belongs to.
+ * @return -1 if the frame isn't needed.
+ */
+static int get_field_of(const id3::frame &f)
+{
+	static const char *ids[][2] = {
+		{"TIT2", "TT2"}, {"TPE1", "TP1"}, {"TALB", "TAL"}, {"TYER", "TYE"},
+		{"TRCK", "TRK"}, {"TCON", "TCO"}, {"COMM", "COM"}
+	};
+	for (int i = 0; i < 7; i++)
+		if (memcmp(f.id, ids[i][f.id_length == 3], f.id_length) == 0)
+			return i;
+	if (f.id_length == 4 && memcmp(f.id, "TDRC", 4) == 0)
+		return probe::Year;
+	return -1;
+}
+
+/**
+ * Gather what can be known without decoding. Open and read errors leave the
+ * probe invalid.
+ * @param path
+ */
+probe::probe(const char *path)
+{
+	unsigned char buffer[chunk_size];
+	struct stat status;
+
+	bytes_read = 0;
+	valid = false;
+	mpeg_version = 0;
+	layer = 0;
+	sampling_rate = 0;
+	channel_mode = mp3::Stereo;
+	bit_rate = 0;
+	vbr = false;
+	frames = 0;
+	duration = 0;
+	estimated = false;
+	for (int i = 0; i < num_fields; i++)
+		fields[i][0] = '\0';
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+		close(fd);
+		return;
+	}
+	file_size = status.st_size;
+
+	/* There may be more than one ID3v2 tag. */
+	unsigned long long offset = 0;
+	unsigned size = read(buffer, chunk_size, offset);
+	while (size >= 10) {
+		id3 tag(buffer, size);
+		if (!tag.is_valid())
+			break;
+		set_id3_fields(tag, buffer, size, offset);
+		offset += tag.get_id3_size();
+		size = read(buffer, chunk_size, offset);
+	}
+
+	/* The stream is read last, so that buffer still holds its start. */
+	unsigned long long audio_end = set_trailing_fields();
+	if (offset < audio_end)
+		set_stream(buffer, size, offset, audio_end);
+	close(fd);
+}
+
+/**
+ * Read a range of the file.
+ * @return Bytes read, fewer at the end of the file.
+ */
+unsigned probe::read(unsigned char *buffer, unsigned size, unsigned long long offset)
+{
+	if (offset >= file_size)
+		return 0;
+	if (offset + size > file_size)
+		size = file_size - offset;
+
+	unsigned total = 0;
+	while (total < size) {
+		ssize_t n = pread(fd, &buffer[total], size - total, offset + total);
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	bytes_read += total;
+	return total;
+}
+
+/**
+ * Take the text of an ID3v2 tag. Frames are read a chunk at a time, so large
+ * pictures are skipped without being read.
+ * @param tag
+ * @param buffer Holds the start of the tag.
+ * @param size Bytes in buffer.
+ * @param offset Position of the tag in the file.
+ */
+void probe::set_id3_fields(id3 &tag, unsigned char *buffer, unsigned size, unsigned long long offset)
+{
+	char text[field_size];
+	unsigned tag_end = tag.get_id3_offset() + 10;
+	unsigned base = 0;
+	unsigned position = 0;
+	id3::frame f;
+
+	while (true) {
+		unsigned start = position;
+		if (tag.get_frame(position, f)) {
+			int field = get_field_of(f);
+			if (field < 0 || fields[field][0] != '\0')
+				continue;
+			if (f.truncated && start != base) {
+				/* Read the frame again from its start. */
+				base = start;
+				size = read(buffer, chunk_size, offset + base);
+				tag.set_window(buffer, size, base);
+				position = base;
+				continue;
+			}
+			unsigned length = id3::get_text(f, text, field_size);
+			if (length > 0)
+				set_field(static_cast<Field>(field), text, length);
+		} else if (position < tag_end && position != base && position + 10 > base + size) {
+			/* The next frame header lies outside of the buffer. */
+			base = position;
+			size = read(buffer, chunk_size, offset + base);
+			if (size == 0)
+				break;
+			tag.set_window(buffer, size, base);
+		} else
+			break;
+	}
+}
+
+/**
+ * Take the text of the ID3v1 and APEv2 tags at the end of the file, unless an
+ * ID3v2 tag already had it.
+ * @return Offset of the first byte after the last frame.
+ */
+unsigned long long probe::set_trailing_fields()
+{
+	unsigned long long audio_end = file_size;
+	unsigned char trailer[160];
+	unsigned size = read(trailer, sizeof(trailer), file_size > 160 ? file_size - 160 : 0);
+	unsigned char *end = &trailer[size];
+	unsigned char *v1 = nullptr;
+
+	if (size >= 128 && memcmp(end - 128, "TAG", 3) == 0) {
+		v1 = end - 128;
+		audio_end -= 128;
+		end -= 128;
+	}
+
+	/* APEv2 is UTF-8, so it goes before ID3v1. */
+	if (end - trailer >= 32 && memcmp(end - 32, "APETAGEX", 8) == 0) {
+		unsigned char *footer = end - 32;
+		unsigned tag_size = little_endian(&footer[12]);
+		bool has_header = footer[23] & 0x80;
+		unsigned long long total = (unsigned long long)tag_size + (has_header ? 32 : 0);
+		if (tag_size >= 32 && total <= audio_end) {
+			set_ape_fields(footer, audio_end - 32);
+			audio_end -= total;
+		}
+	}
+
+	if (v1 != nullptr) {
+		set_field(Title, (const char *)&v1[3], 30);
+		set_field(Artist, (const char *)&v1[33], 30);
+		set_field(Album, (const char *)&v1[63], 30);
+		set_field(Year, (const char *)&v1[93], 4);
+		/* Version 1.1 takes the last two bytes of the comment for the track. */
+		if (v1[125] == 0 && v1[126] != 0) {
+			char track[4];
+			unsigned length = snprintf(track, sizeof(track), "%u", v1[126]);
+			set_field(Comment, (const char *)&v1[97], 28);
+			set_field(Track, track, length);
+		} else
+			set_field(Comment, (const char *)&v1[97], 30);
+		if (v1[127] < 80)
+			set_field(Genre, genres[v1[127]], strlen(genres[v1[127]]));
+	}
+	return audio_end;
+}
+
+/**
+ * Read the items of an APEv2 tag. Large tags, which usually hold pictures, are
+ * skipped.
+ * @param footer The 32 byte footer of the tag.
+ * @param offset Position of the footer in the file.
+ */
+void probe::set_ape_fields(const unsigned char *footer, unsigned long long offset)
+{
+	unsigned char buffer[ape_size];
+	static const char *keys[num_fields] = {
+		"Title", "Artist", "Album", "Year", "Track", "Genre", "Comment"
+	};
+	unsigned items_size = little_endian(&footer[12]) - 32;
+	unsigned items = little_endian(&footer[16]);
+	if (items_size > ape_size)
+		return;
+	unsigned size = read(buffer, items_size, offset - items_size);
+
+	/* | Value size | Flags | Key, terminated | Value | */
+	unsigned position = 0;
+	for (unsigned i = 0; i < items && position + 9 <= size; i++) {
+		unsigned value_size = little_endian(&buffer[position]);
+		unsigned flags = little_endian(&buffer[position + 4]);
+		const char *key = (const char *)&buffer[position + 8];
+		unsigned key_length = strnlen(key, size - position - 8);
+		unsigned value = position + 8 + key_length + 1;
+		if (value > size || value_size > size - value)
+			break;
+
+		/* Only UTF-8 text. */
+		if ((flags >> 1 & 3) == 0)
+			for (int j = 0; j < num_fields; j++)
+				if (key_length == strlen(keys[j]) && strncasecmp(key, keys[j], key_length) == 0)
+					set_field(static_cast<Field>(j), (const char *)&buffer[value], value_size);
+		position = value + value_size;
+	}
+}
+
+/**
+ * Set a field if it is still empty. ID3v1 text is Latin-1, so bytes above 0x7F
+ * are converted; text that is valid UTF-8 is taken as it is.
+ * @param field
+ * @param text Not necessarily terminated.
+ * @param length Maximum number of bytes to take from text.
+ */
+void probe::set_field(Field field, const char *text, unsigned length)
+{
+	char *out = fields[field];
+	if (out[0] != '\0')
+		return;
+
+	length = strnlen(text, length);
+	while (length > 0 && text[length - 1] == ' ')
+		length--;
+
+	bool utf8 = true;
+	for (unsigned i = 0; i < length && utf8; i++) {
+		unsigned char c = text[i];
+		unsigned continuation = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+		if (c >= 0x80 && continuation == 0)
+			utf8 = false;
+		for (unsigned j = 1; j <= continuation && utf8; j++)
+			utf8 = i + j < length && (text[i + j] & 0xC0) == 0x80;
+		i += continuation;
+	}
+
+	unsigned n = 0;
+	for (unsigned i = 0; i < length; i++) {
+		unsigned char c = text[i];
+		if (utf8 || c < 0x80) {
+			if (n + 1 >= field_size)
+				break;
+			out[n++] = c;
+		} else {
+			if (n + 2 >= field_size)
+				break;
+			out[n++] = 0xC0 | c >> 6;
+			out[n++] = 0x80 | (c & 0x3F);
+		}
+	}
+	/* Don't leave half a character behind. */
+	if (utf8 && n < length)
+		while (n > 0 && (text[n] & 0xC0) == 0x80)
+			n--;
+	out[n] = '\0';
+}
+
+/**
+ * Find the first frame and take the duration from its Xing/Info tag. Without
+ * one, the first frames are scanned: if they have the same bit rate, the file
+ * is taken to be CBR, otherwise their average bit rate is used.
+ * @param buffer Holds the bytes from audio_start onwards.
+ * @param size Bytes in buffer.
+ * @param audio_start Offset of the first byte after the ID3v2 tags.
+ * @param audio_end Offset of the first byte of the trailing tags.
+ */
+void probe::set_stream(unsigned char *buffer, unsigned size, unsigned long long audio_start, unsigned long long audio_end)
+{
+	static thread_local mp3::workspace work;
+	if (audio_start + size > audio_end)
+		size = audio_end - audio_start;
+
+	/* Two frames in a row make a false sync in junk unlikely. */
+	unsigned position = 0;
+	for (; position + 4 <= size; position++) {
+		if (!is_header(&buffer[position]))
+			continue;
+		mp3 decoder(&buffer[position], &work);
+		unsigned next = position + decoder.get_frame_size();
+		if (decoder.is_valid() && decoder.get_frame_size() > 4 &&
+			(next + 4 > size || is_header(&buffer[next])))
+			break;
+	}
+	if (position + 4 > size)
+		return;
+
+	/* Xing/Info tags need the whole first frame, which is at most 2 KB. */
+	unsigned long long buffer_start = audio_start;
+	audio_start += position;
+	if (position + 2048 > size && buffer_start + size < audio_end) {
+		buffer_start = audio_start;
+		position = 0;
+		size = read(buffer, chunk_size, buffer_start);
+		if (buffer_start + size > audio_end)
+			size = audio_end - buffer_start;
+	}
+
+	mp3 decoder(&buffer[position], &work);
+	valid = true;
+	mpeg_version = decoder.get_mpeg_version();
+	layer = decoder.get_layer();
+	sampling_rate = decoder.get_sampling_rate();
+	channel_mode = decoder.get_channel_mode();
+
+	unsigned samples_per_frame = get_samples_per_frame(mpeg_version, layer);
+	unsigned side_info = 0;
+	if (layer == 3) {
+		if (mpeg_version == 1)
+			side_info = channel_mode == mp3::Mono ? 17 : 32;
+		else
+			side_info = channel_mode == mp3::Mono ? 9 : 17;
+	}
+	unsigned frame_size = decoder.get_frame_size();
+	unsigned available = size - position < frame_size ? size - position : frame_size;
+	xing tag(&buffer[position], (decoder.get_crc() == 0 ? 6 : 4) + side_info, available);
+
+	if (tag.is_valid() && tag.get_xing_extensions()[xing::FrameField] && tag.get_frame_quantity() > 0) {
+		/* The frame with the tag has no audio. */
+		audio_start += frame_size;
+		frames = tag.get_frame_quantity();
+		unsigned long long bytes = audio_end - audio_start;
+		if (tag.get_xing_extensions()[xing::ByteField] && tag.get_byte_quantity() > 0)
+			bytes = tag.get_byte_quantity();
+
+		unsigned long long samples = (unsigned long long)frames * samples_per_frame;
+		if (tag.has_encoder_delay() && tag.get_encoder_delay() + tag.get_encoder_padding() < samples)
+			samples -= tag.get_encoder_delay() + tag.get_encoder_padding();
+		duration = (double)samples / sampling_rate;
+		bit_rate = (double)bytes * 8 * sampling_rate / ((double)frames * samples_per_frame) + 0.5;
+		vbr = !tag.is_info();
+		return;
+	}
+	if (tag.is_valid())
+		audio_start += frame_size;
+
+	/* Scan the frames that follow, a chunk at a time. */
+	unsigned long long scanned_bytes = 0;
+	unsigned scanned = 0;
+	unsigned first_bit_rate = 0;
+	position += tag.is_valid() ? frame_size : 0;
+	while (scanned < scan_frames) {
+		if (position + 4 > size) {
+			buffer_start += position;
+			position = 0;
+			size = read(buffer, chunk_size, buffer_start);
+			if (buffer_start + size > audio_end)
+				size = buffer_start < audio_end ? audio_end - buffer_start : 0;
+			if (size < 4)
+				break;
+		}
+		if (!is_header(&buffer[position]))
+			break;
+		decoder.init_header_params(&buffer[position]);
+		if (!decoder.is_valid() || decoder.get_frame_size() <= 4)
+			break;
+		if (scanned == 0)
+			first_bit_rate = decoder.get_bit_rate();
+		else if (decoder.get_bit_rate() != first_bit_rate)
+			vbr = true;
+		scanned_bytes += decoder.get_frame_size();
+		position += decoder.get_frame_size();
+		scanned++;
+	}
+
+	unsigned long long bytes = audio_end - audio_start;
+	if (scanned == 0) {
+		bit_rate = decoder.get_bit_rate();
+		frames = bytes / frame_size;
+	} else if (!vbr) {
+		bit_rate = first_bit_rate;
+		frames = (double)bytes * sampling_rate / ((double)samples_per_frame * bit_rate / 8) + 0.5;
+	} else {
+		frames = (double)bytes / scanned_bytes * scanned + 0.5;
+		bit_rate = (double)scanned_bytes * 8 * sampling_rate / ((double)scanned * samples_per_frame) + 0.5;
+	}
+	duration = (double)bytes * 8 / bit_rate;
+	estimated = vbr || scanned < scan_frames;
+}
+
+bool probe::is_valid()
+{
+	return valid;
+}
+
+float probe::get_mpeg_version()
+{
+	return mpeg_version;
+}
+
+unsigned probe::get_layer()
+{
+	return layer;
+}
+
+unsigned probe::get_sampling_rate()
+{
+	return sampling_rate;
+}
+
+mp3::ChannelMode probe::get_channel_mode()
+{
+	return channel_mode;
+}
+
+unsigned probe::get_bit_rate()
+{
+	return bit_rate;
+}
+
+bool probe::is_vbr()
+{
+	return vbr;
+}
+
+unsigned long probe::get_frames()
+{
+	return frames;
+}
+
+double probe::get_duration()
+{
+	return duration;
+}
+
+bool probe::is_estimated()
+{
+	return estimated;
+}
+
+const char *probe::get_field(Field field)
+{
+	return fields[field];
+}
+
+unsigned probe::get_bytes_read()
+{
+	return bytes_read;
+}
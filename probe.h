@@ -0,0 +1,75 @@
+/*
+ * Reads the properties and tags of a file without decoding it. Only a few small
+ * ranges are read: the ID3v2 tag, the first frame with its Xing/Info tag, and
+ * the ID3v1 and APE tags at the end.
+ * | ID3v2 | Xing/Info | Frame | ... | Frame | APE | ID3v1 |
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "id3.h"
+#include "mp3.h"
+
+class probe {
+public:
+	enum Field {
+		Title = 0,
+		Artist = 1,
+		Album = 2,
+		Year = 3,
+		Track = 4,
+		Genre = 5,
+		Comment = 6
+	};
+
+	/** @param path */
+	probe(const char *path);
+
+	bool is_valid();
+	float get_mpeg_version();
+	unsigned get_layer();
+	unsigned get_sampling_rate();
+	mp3::ChannelMode get_channel_mode();
+	/** Average bit rate in bits per second. */
+	unsigned get_bit_rate();
+	bool is_vbr();
+	unsigned long get_frames();
+	/** Duration in seconds, without the encoder delay and padding if known. */
+	double get_duration();
+	/** True if the duration is estimated from the first frames. */
+	bool is_estimated();
+	/** @return UTF-8, empty if the file doesn't have the field. */
+	const char *get_field(Field field);
+	unsigned get_bytes_read();
+
+private:
+	static const unsigned chunk_size = 4096;
+	static const unsigned ape_size = 16384;
+	static const unsigned field_size = 256;
+	static const int num_fields = 7;
+
+	int fd;
+	unsigned long long file_size;
+	unsigned bytes_read;
+	bool valid;
+	float mpeg_version;
+	unsigned layer;
+	unsigned sampling_rate;
+	mp3::ChannelMode channel_mode;
+	unsigned bit_rate;
+	bool vbr;
+	unsigned long frames;
+	double duration;
+	bool estimated;
+	char fields[num_fields][field_size];
+
+	unsigned read(unsigned char *buffer, unsigned size, unsigned long long offset);
+	void set_id3_fields(id3 &tag, unsigned char *buffer, unsigned size, unsigned long long offset);
+	unsigned long long set_trailing_fields();
+	void set_ape_fields(const unsigned char *footer, unsigned long long offset);
+	void set_field(Field field, const char *text, unsigned length);
+	void set_stream(unsigned char *buffer, unsigned size, unsigned long long audio_start, unsigned long long audio_end);
+};
+
+#endif	/* PROBE_H */
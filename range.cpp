@@ -0,0 +1,162 @@
+/*
+ * Decodes ranges of frames out of order, such as the first seconds of a file
+ * and then a seek point, through a pcm_cache. Frames that are cached are
+ * copied. A frame that doesn't follow the last one decoded depends on earlier
+ * frames for its bit reservoir and overlap, so decoding starts a few frames
+ * before it, and the samples are the same as when the file is decoded from
+ * the start.
+ */
+
+#include "id3.h"
+#include "range.h"
+
+static bool is_header(const unsigned char *buffer)
+{
+	return buffer[0] == 0xFF && (buffer[1] & 0xE0) == 0xE0 && (buffer[1] & 0x06) != 0 &&
+		(buffer[1] & 0x18) != 0x08 && (buffer[2] & 0xF0) != 0 &&
+		(buffer[2] & 0xF0) != 0xF0 && (buffer[2] & 0x0C) != 0x0C;
+}
+
+/**
+ * Index the frames that follow the ID3 tags, up to the first bytes that
+ * aren't a whole frame, which are where decoding a whole file stops too.
+ */
+range_decoder::range_decoder(const char *path, pcm_cache *cache) : buffer(path)
+{
+	this->cache = cache;
+	decoder = nullptr;
+	next = 0;
+	decoded = 0;
+	if (cache != nullptr && !pcm_cache::identify(path, id))
+		this->cache = nullptr;
+
+	size_t offset = 0;
+	while (offset < buffer.size()) {
+		id3 tag(&buffer[offset], buffer.size() - offset);
+		if (!tag.is_valid())
+			break;
+		offset += tag.get_id3_size();
+	}
+	if (offset + 4 > buffer.size() || !is_header(&buffer[offset]))
+		return;
+
+	/* A decoder that reads an invalid header stays invalid, so the frames
+	 * are found by another one. */
+	mp3 scanner(&buffer[offset]);
+	while (offset + 4 <= buffer.size() && is_header(&buffer[offset])) {
+		scanner.init_header_params(&buffer[offset]);
+		if (!scanner.is_valid() || offset + scanner.get_frame_size() > buffer.size())
+			break;
+		offsets.push_back(offset);
+		offset += scanner.get_frame_size();
+	}
+	offsets.push_back(offset);
+	if (offsets.size() > 1)
+		decoder = new mp3(&buffer[offsets[0]]);
+}
+
+range_decoder::~range_decoder()
+{
+	delete decoder;
+}
+
+bool range_decoder::is_valid()
+{
+	return decoder != nullptr && decoder->is_valid();
+}
+
+unsigned range_decoder::get_frame_count()
+{
+	return offsets.empty() ? 0 : offsets.size() - 1;
+}
+
+unsigned range_decoder::get_sampling_rate()
+{
+	return decoder->get_sampling_rate();
+}
+
+unsigned range_decoder::get_channels()
+{
+	return decoder->get_channel_mode() == mp3::Mono ? 1 : 2;
+}
+
+unsigned range_decoder::get_samples_per_frame()
+{
+	return decoder->get_mpeg_version() == 1 ? 1152 : 576;
+}
+
+unsigned range_decoder::get_frame(double seconds)
+{
+	double frame = seconds * get_sampling_rate() / get_samples_per_frame();
+	return frame < 0 ? 0 : frame < 4e9 ? (unsigned)frame : 4000000000u;
+}
+
+bool range_decoder::read(unsigned first, unsigned count, sink &output)
+{
+	unsigned last = get_frame_count();
+	if (first < last && count < last - first)
+		last = first + count;
+	unsigned channels = get_channels();
+
+	for (unsigned frame = first; frame < last; frame++) {
+		unsigned n;
+		if (cache != nullptr && cache->read(id, frame, samples, n)) {
+			if (!output.write(samples, n))
+				return false;
+			continue;
+		}
+		if (frame != next) {
+			unsigned start = get_preroll(frame);
+			if (start == 0) {
+				/* The first frames are decoded from the initial state. */
+				delete decoder;
+				decoder = nullptr;
+				decoder = new mp3(&buffer[offsets[0]]);
+			}
+			for (unsigned earlier = start; earlier < frame; earlier++)
+				decode(earlier);
+		}
+		decode(frame);
+		n = decoder->get_sample_count();
+		if (cache != nullptr)
+			cache->write(id, frame, decoder->get_samples(), n, channels);
+		if (!output.write(decoder->get_samples(), n))
+			return false;
+	}
+	return true;
+}
+
+unsigned long long range_decoder::get_decoded()
+{
+	return decoded;
+}
+
+/**
+ * The frame to start decoding at for a frame to come out as it does when the
+ * file is decoded from the start. Its samples depend on the granule before
+ * it, which needs the main data of the frames it is in to be whole: one frame
+ * in MPEG-1 and two in MPEG-2, since they hold a granule each. Their main data
+ * may begin in the frames before them, which are decoded too so that the
+ * reservoir holds them.
+ */
+unsigned range_decoder::get_preroll(unsigned frame)
+{
+	unsigned whole = decoder->get_mpeg_version() == 1 ? 1 : 2;
+	unsigned start = frame > whole ? frame - whole : 0;
+	unsigned reservoir = 0;
+	while (start > 0 && reservoir < max_main_data_begin) {
+		start--;
+		unsigned size = offsets[start + 1] - offsets[start];
+		reservoir += size > max_side_size ? size - max_side_size : 0;
+	}
+	return start;
+}
+
+void range_decoder::decode(unsigned frame)
+{
+	unsigned char *data = &buffer[offsets[frame]];
+	decoder->init_header_params(data);
+	decoder->init_frame_params(data);
+	next = frame + 1;
+	decoded++;
+}
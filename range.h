@@ -0,0 +1,74 @@
+/*
+ * Decodes ranges of frames out of order, such as the first seconds of a file
+ * and then a seek point, through a pcm_cache. Frames that are cached are
+ * copied. A frame that doesn't follow the last one decoded depends on earlier
+ * frames for its bit reservoir and overlap, so decoding starts a few frames
+ * before it, and the samples are the same as when the file is decoded from
+ * the start.
+ */
+
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <vector>
+#include "cache.h"
+#include "mapped_file.h"
+#include "mp3.h"
+#include "sink.h"
+
+class range_decoder {
+public:
+	/**
+	 * @param path
+	 * @param cache Shared with other decoders, or nullptr to decode every frame.
+	 * @throws std::bad_alloc If the file can't be read.
+	 */
+	range_decoder(const char *path, pcm_cache *cache);
+	~range_decoder();
+	range_decoder(const range_decoder &) = delete;
+	range_decoder &operator=(const range_decoder &) = delete;
+
+	/** False if the file doesn't start with a frame after its ID3 tags. */
+	bool is_valid();
+	unsigned get_frame_count();
+	unsigned get_sampling_rate();
+	unsigned get_channels();
+	unsigned get_samples_per_frame();
+	/** The frame that holds a time, which may be past the last frame. */
+	unsigned get_frame(double seconds);
+
+	/**
+	 * Write frames to a sink, from the cache if it has them.
+	 * @param first
+	 * @param count Frames past the end of the file are left out.
+	 * @param output
+	 * @return False if the sink failed.
+	 * @throws std::bad_alloc
+	 */
+	bool read(unsigned first, unsigned count, sink &output);
+
+	/** Frames decoded so far, including those decoded only for their state. */
+	unsigned long long get_decoded();
+
+private:
+	/* The most main data that a frame can take from frames before it. */
+	static const unsigned max_main_data_begin = 511;
+	/* The most that a header, CRC and side information take of a frame. */
+	static const unsigned max_side_size = 4 + 2 + 32;
+
+	mapped_file buffer;
+	pcm_cache *cache;
+	pcm_cache::file_id id;
+	mp3 *decoder;
+	/* Where each frame starts, and where the last one ends. */
+	std::vector<unsigned> offsets;
+	/* The frame that follows the state of the decoder. */
+	unsigned next;
+	unsigned long long decoded;
+	float samples[2 * 1152];
+
+	unsigned get_preroll(unsigned frame);
+	void decode(unsigned frame);
+};
+
+#endif	/* RANGE_H */
@@ -0,0 +1,447 @@
+/*
+ * Reads a list of files into memory on a thread of its own, so that decoders
+ * don't wait for the disk. Several reads are kept in flight per file, and
+ * several files are read at once, through io_uring if the kernel has it and
+ * with pread otherwise. Files are handed out in the order that they finish.
+ */
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "reader.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+/* The submission and completion queues that are shared with the kernel. There
+ * is no liburing, so they are mapped and updated by hand. */
+struct reader::uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_size;
+	void *cq_map;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned unsubmitted;
+};
+#endif
+
+/* A request is identified by its slot and its offset in the file. */
+static const int offset_bits = 40;
+
+reader::reader(const std::vector<std::string> &paths, unsigned depth, unsigned files, bool uring)
+	: paths(paths), slots(files > 0 ? files : 1)
+{
+	this->depth = depth > 0 ? depth : 1;
+	next_path = 0;
+	waiting = 0;
+	taken = 0;
+	stopped = false;
+	for (slot &file : slots)
+		file.index = -1;
+
+	ring = nullptr;
+	if (uring)
+		open_uring(this->depth * slots.size());
+	uring_open = ring != nullptr;
+	thread = std::thread(&reader::run, this);
+}
+
+reader::~reader()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopped = true;
+	}
+	room.notify_all();
+	thread.join();
+
+	for (done &file : finished)
+		if (file.buffer != nullptr)
+			munmap(file.buffer, file.size);
+	close_uring();
+}
+
+mapped_file reader::take(int &index)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (finished.empty() && taken < paths.size())
+		ready.wait(guard);
+	if (finished.empty()) {
+		index = -1;
+		return mapped_file();
+	}
+
+	done file = finished.front();
+	finished.erase(finished.begin());
+	taken++;
+	waiting--;
+	guard.unlock();
+	room.notify_one();
+	index = file.index;
+	return mapped_file(file.buffer, file.size);
+}
+
+bool reader::is_uring()
+{
+	return uring_open;
+}
+
+/**
+ * Keep every slot reading a file, with up to depth requests in flight each,
+ * until all files are read. A slot isn't refilled while the files that have
+ * been read but not taken, and the ones being read, would exceed the slots.
+ */
+void reader::run()
+{
+	unsigned in_flight = 0;
+	while (true) {
+		unsigned open = 0;
+		for (slot &file : slots) {
+			if (file.index < 0 && !stopped && next_path < paths.size()) {
+				std::lock_guard<std::mutex> guard(lock);
+				unsigned reading = 0;
+				for (slot &other : slots)
+					reading += other.index >= 0;
+				if (waiting + reading < slots.size())
+					open_slot(file);
+			}
+			open += file.index >= 0;
+		}
+
+		if (open == 0) {
+			std::unique_lock<std::mutex> guard(lock);
+			if (stopped || (next_path == paths.size() && in_flight == 0))
+				break;
+			while (!stopped && waiting >= slots.size())
+				room.wait(guard);
+			continue;
+		}
+
+#ifdef HAVE_IO_URING
+		if (ring != nullptr) {
+			for (slot &file : slots)
+				while (file.index >= 0 && !stopped && file.pending < depth &&
+					file.submitted < file.size && submit(file))
+					in_flight++;
+
+			unsigned submitted = ring->unsubmitted;
+			ring->unsubmitted = 0;
+			long result = syscall(__NR_io_uring_enter, ring->fd, submitted,
+				in_flight > 0 ? 1 : 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				drop_uring(in_flight);
+			else
+				in_flight -= reap();
+		} else
+#endif
+		{
+			for (slot &file : slots)
+				if (file.index >= 0 && !stopped)
+					read_blocking(file);
+		}
+
+		for (slot &file : slots) {
+			if (file.index < 0 || file.pending > 0)
+				continue;
+			if (file.failed || stopped || file.completed == file.size)
+				close_slot(file);
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	ready.notify_all();
+}
+
+/**
+ * Open the next file into a slot, with a buffer for all of it. If it can't be
+ * opened, it is passed on as a failure straight away.
+ * @return False if it failed.
+ */
+bool reader::open_slot(slot &file)
+{
+	file.index = next_path++;
+	file.fd = open(paths[file.index].c_str(), O_RDONLY | O_CLOEXEC);
+	file.buffer = nullptr;
+	file.size = 0;
+	file.submitted = 0;
+	file.completed = 0;
+	file.pending = 0;
+	file.failed = true;
+
+	struct stat status;
+	if (file.fd >= 0 && fstat(file.fd, &status) == 0 && status.st_size > 0 &&
+		(unsigned long long)status.st_size < (unsigned long long)1 << offset_bits) {
+		void *map = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map != MAP_FAILED) {
+			file.buffer = static_cast<unsigned char *>(map);
+			file.size = status.st_size;
+			file.failed = false;
+		}
+	}
+	if (file.failed) {
+		/* lock is held by the caller. */
+		if (file.fd >= 0)
+			close(file.fd);
+		finished.push_back({file.index, nullptr, 0});
+		waiting++;
+		file.index = -1;
+		ready.notify_one();
+	}
+	return !file.failed;
+}
+
+/** Pass a file on to take(), or its failure. */
+void reader::close_slot(slot &file)
+{
+	close(file.fd);
+	if (file.failed && file.buffer != nullptr) {
+		munmap(file.buffer, file.size);
+		file.buffer = nullptr;
+		file.size = 0;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (!stopped) {
+		finished.push_back({file.index, file.buffer, file.size});
+		waiting++;
+		ready.notify_one();
+	} else if (file.buffer != nullptr)
+		munmap(file.buffer, file.size);
+	file.index = -1;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Finish the reads that have completed.
+ * @return The number of reads.
+ */
+unsigned reader::reap()
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned count = tail - head;
+	for (; head != tail; head++) {
+		io_uring_cqe &cqe = ring->cqes[head & *ring->cq_mask];
+		slot &file = slots[cqe.user_data >> offset_bits];
+		size_t offset = cqe.user_data & (((unsigned long long)1 << offset_bits) - 1);
+		size_t length = file.size - offset < chunk_size ? file.size - offset : chunk_size;
+		file.pending--;
+		if (cqe.res >= 0 && (size_t)cqe.res < length && cqe.res > 0) {
+			/* A short read, which is rare enough to finish here. */
+			ssize_t rest = pread(file.fd, &file.buffer[offset + cqe.res],
+				length - cqe.res, offset + cqe.res);
+			complete(file, rest == (ssize_t)(length - cqe.res) ? length : -1);
+		} else
+			complete(file, cqe.res == (int)length ? length : -1);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * Give up on a ring that can't be entered any more and read with pread from
+ * then on. The reads that the kernel took still complete into their buffers,
+ * so they are waited for before any buffer can be released. The files that
+ * were being read are read again from the start.
+ * @param in_flight Reads queued or submitted, which is 0 afterwards.
+ */
+void reader::drop_uring(unsigned &in_flight)
+{
+	unsigned queued = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	in_flight -= queued;
+	std::chrono::microseconds nap(100);
+	while (in_flight > 0) {
+		in_flight -= reap();
+		if (in_flight > 0)
+			std::this_thread::sleep_for(nap);
+	}
+	close_uring();
+	uring_open = false;
+
+	for (slot &file : slots)
+		if (file.index >= 0) {
+			file.submitted = 0;
+			file.completed = 0;
+			file.pending = 0;
+			file.failed = false;
+		}
+}
+
+/**
+ * Queue a read of the next chunk of a file. It is submitted with the next
+ * io_uring_enter.
+ * @return False if the submission queue is full.
+ */
+bool reader::submit(slot &file)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail;
+	if (tail - head > *ring->sq_mask)
+		return false;
+
+	size_t length = file.size - file.submitted < chunk_size ? file.size - file.submitted : chunk_size;
+	unsigned index = tail & *ring->sq_mask;
+	io_uring_sqe &sqe = ring->sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = file.fd;
+	sqe.addr = (unsigned long)&file.buffer[file.submitted];
+	sqe.len = length;
+	sqe.off = file.submitted;
+	sqe.user_data = ((unsigned long long)(&file - &slots[0]) << offset_bits) | file.submitted;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->unsubmitted++;
+	file.submitted += length;
+	file.pending++;
+	return true;
+}
+#else
+unsigned reader::reap()
+{
+	return 0;
+}
+
+void reader::drop_uring(unsigned &)
+{
+}
+
+bool reader::submit(slot &)
+{
+	return false;
+}
+#endif
+
+/**
+ * @param file
+ * @param result Bytes read, or -1 if the read failed.
+ */
+void reader::complete(slot &file, long result)
+{
+	if (result < 0)
+		file.failed = true;
+	else
+		file.completed += result;
+}
+
+/** Read the next chunk of a file with pread, for kernels without io_uring. */
+void reader::read_blocking(slot &file)
+{
+	if (file.failed || file.submitted == file.size)
+		return;
+	size_t length = file.size - file.submitted < chunk_size ? file.size - file.submitted : chunk_size;
+	ssize_t n;
+	do
+		n = pread(file.fd, &file.buffer[file.submitted], length, file.submitted);
+	while (n < 0 && errno == EINTR);
+	if (n <= 0) {
+		complete(file, -1);
+		return;
+	}
+	file.submitted += n;
+	complete(file, n);
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Set up a ring and map its queues. ring is left null if the kernel doesn't
+ * support io_uring or doesn't allow it.
+ * @param entries Requests that may be in flight.
+ */
+void reader::open_uring(unsigned entries)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return;
+
+	ring = new uring();
+	ring->fd = fd;
+	ring->unsubmitted = 0;
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_map = mmap(nullptr, ring->sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_map = ring->sq_map;
+	if (ring->sq_map != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+		ring->cq_map = mmap(nullptr, ring->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = MAP_FAILED;
+	if (ring->sq_map != MAP_FAILED && ring->cq_map != MAP_FAILED)
+		sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+			munmap(ring->cq_map, ring->cq_size);
+		if (ring->sq_map != MAP_FAILED)
+			munmap(ring->sq_map, ring->sq_size);
+		close(fd);
+		delete ring;
+		ring = nullptr;
+		return;
+	}
+
+	unsigned char *sq = static_cast<unsigned char *>(ring->sq_map);
+	unsigned char *cq = static_cast<unsigned char *>(ring->cq_map);
+	ring->sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	ring->sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	ring->sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	ring->sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	ring->sqes = static_cast<io_uring_sqe *>(sqes);
+	ring->cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	ring->cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	ring->cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	ring->cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+void reader::close_uring()
+{
+	if (ring == nullptr)
+		return;
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_size);
+	munmap(ring->sq_map, ring->sq_size);
+	close(ring->fd);
+	delete ring;
+	ring = nullptr;
+}
+#else
+void reader::open_uring(unsigned)
+{
+}
+
+void reader::close_uring()
+{
+}
+#endif
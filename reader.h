@@ -0,0 +1,99 @@
+/*
+ * Reads a list of files into memory on a thread of its own, so that decoders
+ * don't wait for the disk. Several reads are kept in flight per file, and
+ * several files are read at once, through io_uring if the kernel has it and
+ * with pread otherwise. Files are handed out in the order that they finish.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mapped_file.h"
+
+class reader {
+public:
+	/** Bytes read by one request. */
+	static const unsigned chunk_size = 256 * 1024;
+
+	/**
+	 * Start reading.
+	 * @param paths Read in this order.
+	 * @param depth Reads in flight per file. pread reads one chunk at a time.
+	 * @param files Files that are read or waiting to be taken at once, which
+	 * bounds the memory used.
+	 * @param uring False to use pread even if io_uring is available.
+	 */
+	reader(const std::vector<std::string> &paths, unsigned depth, unsigned files, bool uring = true);
+	~reader();
+	reader(const reader &) = delete;
+	reader &operator=(const reader &) = delete;
+
+	/**
+	 * Wait for the next file that has been read. Can be called by any thread.
+	 * @param index Receives the index of the file in paths, or -1 once every
+	 * file has been taken.
+	 * @return The contents, which are empty if the file couldn't be read.
+	 */
+	mapped_file take(int &index);
+
+	/**
+	 * True if reads go through io_uring, which stops being the case if the
+	 * ring fails.
+	 */
+	bool is_uring();
+
+private:
+	struct slot {
+		int index;
+		int fd;
+		unsigned char *buffer;
+		size_t size;
+		size_t submitted;
+		size_t completed;
+		unsigned pending;
+		bool failed;
+	};
+	struct done {
+		int index;
+		unsigned char *buffer;
+		size_t size;
+	};
+	struct uring;
+
+	const std::vector<std::string> &paths;
+	unsigned depth;
+	std::vector<slot> slots;
+	uring *ring;
+	/* Whether ring is set, for other threads. */
+	std::atomic<bool> uring_open;
+	unsigned next_path;
+	std::thread thread;
+
+	std::mutex lock;
+	std::condition_variable ready;
+	std::condition_variable room;
+	std::vector<done> finished;
+	/* Files that were read but not taken yet. */
+	unsigned waiting;
+	unsigned taken;
+	std::atomic<bool> stopped;
+
+	void open_uring(unsigned entries);
+	void close_uring();
+	unsigned reap();
+	void drop_uring(unsigned &in_flight);
+	void run();
+	bool open_slot(slot &file);
+	void close_slot(slot &file);
+	bool submit(slot &file);
+	void complete(slot &file, long result);
+	void read_blocking(slot &file);
+};
+
+#endif	/* READER_H */
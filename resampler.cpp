@@ -0,0 +1,222 @@
+/*
+ * Converts the sampling rate of a stream with a polyphase windowed sinc
+ * filter. The ratio of the rates is reduced to up/down, and each output sample
+ * is the dot product of one of up filter phases with the latest input samples.
+ * The filter and the history are allocated once, so converting a block doesn't
+ * allocate, and the latency is a fixed half filter.
+ */
+
+#include <cmath>
+#include <string.h>
+#include "resampler.h"
+#include "util.h"
+
+/* Taps per phase, Kaiser window beta, and passband as a fraction of the lower
+ * Nyquist frequency. Stopband attenuation is roughly 60, 85 and 120 dB. */
+static const struct {
+	unsigned taps;
+	double beta;
+	double bandwidth;
+} tiers[3] = {
+	{16, 6.0, 0.85},
+	{32, 8.6, 0.91},
+	{64, 12.0, 0.95}
+};
+
+static unsigned gcd(unsigned a, unsigned b)
+{
+	while (b != 0) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/** Modified Bessel function of the first kind, for the Kaiser window. */
+static double bessel_i0(double x)
+{
+	double sum = 1;
+	double term = 1;
+	for (int k = 1; k < 64 && term > 1e-12 * sum; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+resampler::resampler(unsigned input_rate, unsigned output_rate, unsigned channels, Quality quality)
+{
+	valid = false;
+	filter = nullptr;
+	history[0] = history[1] = nullptr;
+	this->channels = channels;
+	this->quality = quality;
+	taps = tiers[quality].taps;
+	up = 1;
+	down = 1;
+
+	if (input_rate == 0 || output_rate == 0 || output_rate > input_rate * max_ratio ||
+		channels < 1 || channels > 2)
+		return;
+	unsigned divisor = gcd(input_rate, output_rate);
+	up = output_rate / divisor;
+	down = input_rate / divisor;
+	if (up > max_phases)
+		return;
+
+	filter = static_cast<float *>(allocate(up * taps * sizeof(float)));
+	for (unsigned ch = 0; ch < channels; ch++) {
+		history[ch] = static_cast<float *>(allocate((taps - 1 + max_input) * sizeof(float)));
+		memset(history[ch], 0, (taps - 1) * sizeof(float));
+		position[ch] = (taps - 1) * up;
+	}
+	set_filter(quality);
+	valid = true;
+}
+
+resampler::~resampler()
+{
+	release(filter);
+	release(history[0]);
+	release(history[1]);
+}
+
+bool resampler::is_valid()
+{
+	return valid;
+}
+
+unsigned resampler::get_latency()
+{
+	return taps / 2;
+}
+
+resampler::Quality resampler::get_quality()
+{
+	return quality;
+}
+
+/**
+ * | up | down | taps | channels | position | taps - 1 samples | ... |
+ * with a position and history for each channel.
+ */
+unsigned resampler::get_state_size()
+{
+	return 4 * 4 + channels * 4 * taps;
+}
+
+unsigned char *resampler::save_state(unsigned char *state)
+{
+	state = put_word(state, up);
+	state = put_word(state, down);
+	state = put_word(state, taps);
+	state = put_word(state, channels);
+	for (unsigned ch = 0; ch < channels; ch++) {
+		state = put_word(state, position[ch]);
+		state = put_floats(state, history[ch], taps - 1);
+	}
+	return state;
+}
+
+bool resampler::load_state(const unsigned char *state, unsigned size)
+{
+	if (!valid || size < get_state_size() || get_word(state) != up || get_word(state + 4) != down ||
+		get_word(state + 8) != taps || get_word(state + 12) != channels)
+		return false;
+	state += 16;
+	/* Between blocks the next output is at most one step past the last input
+	   sample, which is further than the sample after it when downsampling. */
+	for (unsigned ch = 0; ch < channels; ch++)
+		if (get_word(state + ch * 4 * taps) >= (taps - 1) * up + down)
+			return false;
+	for (unsigned ch = 0; ch < channels; ch++) {
+		position[ch] = get_word(state);
+		state = get_floats(state + 4, history[ch], taps - 1);
+	}
+	return true;
+}
+
+/**
+ * Sample a Kaiser windowed sinc at up times the input rate and split it into
+ * phases. Each phase is scaled to a gain of one, so that the phases don't add
+ * a ripple of their own.
+ */
+void resampler::set_filter(Quality quality)
+{
+	const double pi = 3.14159265358979323846;
+	double ratio = (double)up / down;
+	/* In cycles per input sample. */
+	double cutoff = 0.5 * tiers[quality].bandwidth * (ratio < 1 ? ratio : 1);
+	double length = taps * up;
+	double center = (length - 1) / 2;
+	double beta = tiers[quality].beta;
+
+	for (unsigned p = 0; p < up; p++) {
+		float *phase = &filter[p * taps];
+		double sum = 0;
+		for (unsigned k = 0; k < taps; k++) {
+			double n = k * up + p - center;
+			double t = n / up;
+			double x = 2 * pi * cutoff * t;
+			double sinc = x == 0 ? 1 : std::sin(x) / x;
+			double r = n / (length / 2);
+			double window = bessel_i0(beta * std::sqrt(r * r < 1 ? 1 - r * r : 0)) / bessel_i0(beta);
+			phase[taps - 1 - k] = sinc * window;
+			sum += phase[taps - 1 - k];
+		}
+		for (unsigned k = 0; k < taps; k++)
+			phase[k] /= sum;
+	}
+}
+
+unsigned resampler::process(int ch, const float *input, unsigned count, float *output, unsigned stride)
+{
+	switch (taps) {
+		case 16:
+			return convolve<16>(ch, input, count, output, stride);
+		case 32:
+			return convolve<32>(ch, input, count, output, stride);
+		default:
+			return convolve<64>(ch, input, count, output, stride);
+	}
+}
+
+/**
+ * The number of taps is a constant, so the dot product is unrolled into four
+ * independent sums that the compiler can vectorize.
+ */
+template<unsigned num_taps>
+unsigned resampler::convolve(int ch, const float *input, unsigned count, float *output, unsigned stride)
+{
+	float *samples = history[ch];
+	memcpy(&samples[num_taps - 1], input, count * sizeof(float));
+
+	unsigned end = num_taps - 1 + count;
+	unsigned index = position[ch] / up;
+	unsigned p = position[ch] % up;
+	unsigned n = 0;
+	while (index < end) {
+		const float *h = &filter[p * num_taps];
+		const float *x = &samples[index + 1 - num_taps];
+		float sum[4] = {0, 0, 0, 0};
+		for (unsigned k = 0; k < num_taps; k += 4) {
+			sum[0] += h[k] * x[k];
+			sum[1] += h[k + 1] * x[k + 1];
+			sum[2] += h[k + 2] * x[k + 2];
+			sum[3] += h[k + 3] * x[k + 3];
+		}
+		output[n++ * stride] = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+
+		p += down;
+		while (p >= up) {
+			p -= up;
+			index++;
+		}
+	}
+
+	/* Keep the latest num_taps - 1 samples for the next block. */
+	memmove(samples, &samples[count], (num_taps - 1) * sizeof(float));
+	position[ch] = (unsigned long)(index - count) * up + p;
+	return n;
+}
@@ -0,0 +1,97 @@
+/*
+ * Converts the sampling rate of a stream with a polyphase windowed sinc
+ * filter. The ratio of the rates is reduced to up/down, and each output sample
+ * is the dot product of one of up filter phases with the latest input samples.
+ * The filter and the history are allocated once, so converting a block doesn't
+ * allocate, and the latency is a fixed half filter.
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+class resampler {
+public:
+	enum Quality {
+		Low = 0,
+		Medium = 1,
+		High = 2
+	};
+
+	/** Input samples per channel that one call of process() may take. */
+	static const unsigned max_input = 576;
+	/** The most output samples there can be for one input sample. */
+	static const unsigned max_ratio = 2;
+
+	/**
+	 * @param input_rate
+	 * @param output_rate At most max_ratio times input_rate.
+	 * @param channels 1 or 2.
+	 * @param quality More taps give a steeper filter at a higher cost.
+	 * @throws std::bad_alloc
+	 */
+	resampler(unsigned input_rate, unsigned output_rate, unsigned channels, Quality quality);
+	~resampler();
+	resampler(const resampler &) = delete;
+	resampler &operator=(const resampler &) = delete;
+
+	/** False if the rates can't be converted. */
+	bool is_valid();
+
+	/**
+	 * Convert a block of one channel. Every channel must be given the same
+	 * number of samples before the next block.
+	 * @param ch
+	 * @param input count samples.
+	 * @param count At most max_input.
+	 * @param output Receives the samples stride floats apart, so that channels
+	 * can be interleaved as they are converted.
+	 * @param stride
+	 * @return Samples written.
+	 */
+	unsigned process(int ch, const float *input, unsigned count, float *output, unsigned stride);
+
+	/** Delay of the filter in input samples. */
+	unsigned get_latency();
+	Quality get_quality();
+
+	/** Bytes that save_state() writes. */
+	unsigned get_state_size();
+	/**
+	 * Write the history and the position of each channel, which is all that
+	 * the next block depends on besides the filter.
+	 * @param state Room for get_state_size() bytes.
+	 * @return The byte after the state.
+	 */
+	unsigned char *save_state(unsigned char *state);
+	/**
+	 * @param state
+	 * @param size Bytes in state, at least get_state_size().
+	 * @return False if the state is of a resampler with other rates, taps or
+	 * channels; this one is unchanged then.
+	 */
+	bool load_state(const unsigned char *state, unsigned size);
+
+private:
+	static const unsigned max_phases = 1024;
+
+	bool valid;
+	unsigned up;
+	unsigned down;
+	unsigned taps;
+	Quality quality;
+	unsigned channels;
+	/* Phase p holds taps coefficients, the last of which applies to the latest
+	 * input sample. */
+	float *filter;
+	/* taps - 1 earlier samples followed by a block of input, per channel. */
+	float *history[2];
+	/* Position of the next output sample in 1/up input samples, from the start
+	 * of the history. */
+	unsigned long position[2];
+
+	void set_filter(Quality quality);
+	template<unsigned num_taps>
+	unsigned convolve(int ch, const float *input, unsigned count, float *output, unsigned stride);
+};
+
+#endif	/* RESAMPLER_H */
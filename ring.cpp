@@ -0,0 +1,73 @@
+/*
+ * A queue of PCM samples between one producer thread and one consumer thread.
+ * Neither side locks: each side only stores its own index and loads the other.
+ */
+
+#include <string.h>
+#include "ring.h"
+#include "util.h"
+
+ring::ring(unsigned capacity)
+{
+	unsigned size = 1;
+	while (size < capacity)
+		size <<= 1;
+	buffer = static_cast<float *>(allocate(size * sizeof(float)));
+	mask = size - 1;
+	head.store(0);
+	tail.store(0);
+}
+
+ring::~ring()
+{
+	release(buffer);
+}
+
+unsigned ring::get_capacity()
+{
+	return mask + 1;
+}
+
+unsigned ring::get_readable()
+{
+	return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+unsigned ring::get_writable()
+{
+	return get_capacity() - get_readable();
+}
+
+/**
+ * The samples are copied before head is published, so the consumer never sees
+ * samples that aren't there yet.
+ */
+unsigned ring::write(const float *samples, unsigned count)
+{
+	unsigned position = head.load(std::memory_order_relaxed);
+	unsigned free = get_capacity() - (position - tail.load(std::memory_order_acquire));
+	if (count > free)
+		count = free;
+
+	unsigned start = position & mask;
+	unsigned first = count < get_capacity() - start ? count : get_capacity() - start;
+	memcpy(&buffer[start], samples, first * sizeof(float));
+	memcpy(buffer, &samples[first], (count - first) * sizeof(float));
+	head.store(position + count, std::memory_order_release);
+	return count;
+}
+
+unsigned ring::read(float *samples, unsigned count)
+{
+	unsigned position = tail.load(std::memory_order_relaxed);
+	unsigned available = head.load(std::memory_order_acquire) - position;
+	if (count > available)
+		count = available;
+
+	unsigned start = position & mask;
+	unsigned first = count < get_capacity() - start ? count : get_capacity() - start;
+	memcpy(samples, &buffer[start], first * sizeof(float));
+	memcpy(&samples[first], buffer, (count - first) * sizeof(float));
+	tail.store(position + count, std::memory_order_release);
+	return count;
+}
@@ -0,0 +1,50 @@
+/*
+ * A queue of PCM samples between one producer thread and one consumer thread.
+ * Neither side locks: each side only stores its own index and loads the other.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <atomic>
+
+class ring {
+private:
+	float *buffer;
+	unsigned mask;
+	/* The indices only grow and wrap around; they are kept on separate cache
+	 * lines so that the two threads don't contend for one. */
+	std::atomic<unsigned> head;
+	char padding[64];
+	std::atomic<unsigned> tail;
+
+public:
+	/**
+	 * @param capacity Samples, rounded up to a power of two.
+	 * @throws std::bad_alloc
+	 */
+	ring(unsigned capacity);
+	~ring();
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	unsigned get_capacity();
+	/** Samples that can be read. Exact for the consumer, a lower bound for the producer. */
+	unsigned get_readable();
+	/** Samples that can be written. Exact for the producer, a lower bound for the consumer. */
+	unsigned get_writable();
+
+	/**
+	 * Only called by the producer.
+	 * @return Samples written, fewer than count if the ring is full.
+	 */
+	unsigned write(const float *samples, unsigned count);
+
+	/**
+	 * Only called by the consumer.
+	 * @return Samples read, fewer than count if the ring is empty.
+	 */
+	unsigned read(float *samples, unsigned count);
+};
+
+#endif	/* RING_H */
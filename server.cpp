@@ -0,0 +1,267 @@
+/*
+ * Decodes many streams at once for local clients. A client connects to a Unix
+ * domain socket, writes MP3 bytes and reads back PCM: the sampling rate and
+ * the number of channels as two little endian 32 bit words, followed by
+ * interleaved 32 bit floats. It shuts down its side of the socket once the
+ * stream ends, and the server closes the connection when every frame has been
+ * returned.
+ *
+ * A fixed number of threads wait on one epoll instance. A connection is
+ * armed for one event at a time, so only one thread works on it, with that
+ * thread's workspace. Each connection buffers at most one frame of input and
+ * one frame of output, and isn't read from while its output can't be sent.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "server.h"
+#include "util.h"
+
+static void put_little_endian(unsigned char *buffer, unsigned value)
+{
+	for (int i = 0; i < 4; i++)
+		buffer[i] = value >> (8 * i);
+}
+
+server::server(const char *path, unsigned max_connections)
+{
+	this->path = path;
+	this->max_connections = max_connections;
+	connections = 0;
+	streams = 0;
+	stopped = false;
+	epoll = -1;
+	wake = -1;
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	listener = -1;
+	if (strlen(path) >= sizeof(address.sun_path))
+		return;
+	strcpy(address.sun_path, path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(path);
+	if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+		listen(listener, SOMAXCONN) != 0) {
+		if (listener >= 0)
+			close(listener);
+		listener = -1;
+		return;
+	}
+
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = &listener;
+	bool added = epoll >= 0 && epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) == 0;
+	/* Level triggered, so that it wakes every thread. */
+	event.events = EPOLLIN;
+	event.data.ptr = &wake;
+	if (!added || wake < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, wake, &event) != 0) {
+		close(listener);
+		listener = -1;
+	}
+}
+
+server::~server()
+{
+	for (connection *client : open) {
+		close(client->fd);
+		delete client;
+	}
+	if (listener >= 0) {
+		close(listener);
+		unlink(path.c_str());
+	}
+	if (epoll >= 0)
+		close(epoll);
+	if (wake >= 0)
+		close(wake);
+}
+
+bool server::is_valid()
+{
+	return listener >= 0;
+}
+
+void server::run(unsigned threads)
+{
+	if (!is_valid())
+		return;
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threads; i++)
+		workers.emplace_back(&server::work, this);
+	work();
+	for (std::thread &worker : workers)
+		worker.join();
+}
+
+void server::stop()
+{
+	stopped = true;
+	unsigned long long one = 1;
+	if (write(wake, &one, sizeof(one)) < 0)
+		return;
+}
+
+unsigned long server::get_streams()
+{
+	return streams;
+}
+
+void server::work()
+{
+	mp3::workspace *work = static_cast<mp3::workspace *>(allocate(sizeof(mp3::workspace)));
+	epoll_event events[64];
+	while (!stopped) {
+		int count = epoll_wait(epoll, events, 64, -1);
+		for (int i = 0; i < count && !stopped; i++) {
+			if (events[i].data.ptr == &listener)
+				accept_all();
+			else if (events[i].data.ptr != &wake)
+				handle(static_cast<connection *>(events[i].data.ptr), work);
+		}
+	}
+	release(work);
+}
+
+void server::accept_all()
+{
+	while (true) {
+		int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (connections >= max_connections) {
+			close(fd);
+			continue;
+		}
+
+		connection *client = new connection();
+		client->fd = fd;
+		client->output_begin = client->output_end = 0;
+		client->sent_format = false;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			open.insert(client);
+		}
+		connections++;
+
+		epoll_event event;
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = client;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+			close_connection(client);
+	}
+}
+
+/**
+ * Send what was decoded, decode what was received and receive more, until the
+ * socket would block one way or the other. A connection that has had its turn
+ * is armed for writing, which is normally ready at once, so it continues after
+ * the others.
+ */
+void server::handle(connection *client, mp3::workspace *work)
+{
+	unsigned frames = 0;
+	while (true) {
+		if (client->output_begin < client->output_end) {
+			ssize_t n = send(client->fd, &client->output[client->output_begin],
+				client->output_end - client->output_begin, MSG_NOSIGNAL);
+			if (n > 0) {
+				client->output_begin += n;
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				arm(client, EPOLLOUT);
+			else
+				close_connection(client);
+			return;
+		}
+		client->output_begin = client->output_end = 0;
+
+		if (frames == frames_per_turn) {
+			arm(client, EPOLLOUT);
+			return;
+		}
+		stream_decoder::Status status;
+		try {
+			status = client->stream.decode(work);
+		} catch (std::bad_alloc) {
+			close_connection(client);
+			return;
+		}
+		if (status == stream_decoder::Frame) {
+			add_output(client);
+			frames++;
+			continue;
+		} else if (status == stream_decoder::End) {
+			if (client->sent_format)
+				streams++;
+			close_connection(client);
+			return;
+		}
+
+		unsigned room;
+		unsigned char *input = client->stream.get_input(room);
+		ssize_t n = recv(client->fd, input, room, 0);
+		if (n > 0)
+			client->stream.add_input(n);
+		else if (n == 0)
+			client->stream.set_end_of_input();
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			arm(client, EPOLLIN);
+			return;
+		} else if (errno != EINTR) {
+			close_connection(client);
+			return;
+		}
+	}
+}
+
+/** Append the samples of the frame that was just decoded. */
+void server::add_output(connection *client)
+{
+	mp3 &decoder = *client->stream.get_decoder();
+	unsigned channels = client->stream.get_channels();
+	if (!client->sent_format) {
+		put_little_endian(&client->output[0], decoder.get_sampling_rate());
+		put_little_endian(&client->output[4], channels);
+		client->output_end = 8;
+		client->sent_format = true;
+	}
+	unsigned bytes = decoder.get_sample_count() * channels * sizeof(float);
+	memcpy(&client->output[client->output_end], decoder.get_samples(), bytes);
+	client->output_end += bytes;
+}
+
+void server::arm(connection *client, unsigned events)
+{
+	epoll_event event;
+	event.events = events | EPOLLONESHOT;
+	event.data.ptr = client;
+	if (epoll_ctl(epoll, EPOLL_CTL_MOD, client->fd, &event) != 0)
+		close_connection(client);
+}
+
+void server::close_connection(connection *client)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		open.erase(client);
+	}
+	close(client->fd);
+	delete client;
+	connections--;
+}
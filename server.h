@@ -0,0 +1,84 @@
+/*
+ * Decodes many streams at once for local clients. A client connects to a Unix
+ * domain socket, writes MP3 bytes and reads back PCM: the sampling rate and
+ * the number of channels as two little endian 32 bit words, followed by
+ * interleaved 32 bit floats. It shuts down its side of the socket once the
+ * stream ends, and the server closes the connection when every frame has been
+ * returned.
+ *
+ * A fixed number of threads wait on one epoll instance. A connection is
+ * armed for one event at a time, so only one thread works on it, with that
+ * thread's workspace. Each connection buffers at most one frame of input and
+ * one frame of output, and isn't read from while its output can't be sent.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include "stream.h"
+
+class server {
+public:
+	/**
+	 * Listen on a socket. An existing socket file at path is replaced.
+	 * @param path
+	 * @param max_connections Connections beyond this are closed right away.
+	 */
+	server(const char *path, unsigned max_connections);
+	~server();
+	server(const server &) = delete;
+	server &operator=(const server &) = delete;
+
+	/** False if the socket couldn't be created. */
+	bool is_valid();
+
+	/**
+	 * Serve clients until stop() is called.
+	 * @param threads Threads to decode on, including the calling thread.
+	 */
+	void run(unsigned threads);
+
+	/** Make run() return. Safe to call from a signal handler. */
+	void stop();
+
+	/** Streams that were decoded to the end. */
+	unsigned long get_streams();
+
+private:
+	static const unsigned output_size = 8 + 1152 * 2 * sizeof(float);
+	/* Frames decoded for a connection before others get a turn. */
+	static const unsigned frames_per_turn = 16;
+
+	struct connection {
+		int fd;
+		stream_decoder stream;
+		unsigned char output[output_size];
+		unsigned output_begin;
+		unsigned output_end;
+		bool sent_format;
+	};
+
+	int listener;
+	int epoll;
+	int wake;
+	std::string path;
+	unsigned max_connections;
+	std::atomic<unsigned> connections;
+	std::atomic<unsigned long> streams;
+	std::atomic<bool> stopped;
+	std::mutex lock;
+	std::unordered_set<connection *> open;
+
+	void work();
+	void accept_all();
+	void handle(connection *client, mp3::workspace *work);
+	void add_output(connection *client);
+	void arm(connection *client, unsigned events);
+	void close_connection(connection *client);
+};
+
+#endif	/* SERVER_H */
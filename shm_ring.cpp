@@ -0,0 +1,332 @@
+/*
+ * Hands decoded PCM to other processes on the same host through a named
+ * POSIX shared memory ring. The writer copies each frame into the ring once,
+ * and any number of readers read it in place, so more readers cost neither
+ * decoding nor copying. Readers and the writer wait for each other on futexes
+ * in the ring.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <new>
+#include "shm_ring.h"
+
+static_assert(sizeof(std::atomic<unsigned>) == sizeof(unsigned), "futex words must be plain ints");
+
+/* Slot states. A claimed slot doesn't hold the writer back until it has a
+ * position. */
+static const unsigned slot_free = 0;
+static const unsigned slot_claimed = 1;
+static const unsigned slot_reading = 2;
+
+/** Long enough not to poll, short enough to notice a process that died. */
+static const long wait_nanoseconds = 100 * 1000 * 1000;
+
+/**
+ * Sleep while a word that is shared with other processes holds a value, for at
+ * most wait_nanoseconds.
+ * @param word
+ * @param value
+ * @return True if it gave up.
+ */
+static bool wait_word(std::atomic<unsigned> &word, unsigned value)
+{
+	timespec timeout = {0, wait_nanoseconds};
+	return syscall(SYS_futex, reinterpret_cast<unsigned *>(&word), FUTEX_WAIT, value,
+		&timeout, nullptr, 0) != 0 && errno == ETIMEDOUT;
+}
+
+static void wake_word(std::atomic<unsigned> &word)
+{
+	syscall(SYS_futex, reinterpret_cast<unsigned *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+float *shm_ring::get_samples()
+{
+	return reinterpret_cast<float *>(reinterpret_cast<unsigned char *>(this) + sizeof(shm_ring));
+}
+
+size_t shm_ring::get_size(unsigned capacity, unsigned channels)
+{
+	return sizeof(shm_ring) + (size_t)capacity * channels * sizeof(float);
+}
+
+shm_sink::shm_sink(const char *name, unsigned sampling_rate, unsigned channels,
+	unsigned capacity, unsigned readers)
+{
+	this->name = name;
+	this->readers = readers;
+	ring = nullptr;
+	unsigned rounded = 2048;
+	while (rounded < capacity)
+		rounded *= 2;
+	size = shm_ring::get_size(rounded, channels);
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		return;
+	}
+
+	/* The mapping is zeroed, which is a valid state for every atomic. */
+	ring = new (map) shm_ring();
+	ring->format_version = shm_ring::version;
+	ring->sampling_rate = sampling_rate;
+	ring->channels = channels;
+	ring->capacity = rounded;
+	ring->writer_pid = getpid();
+	ring->finished = 0;
+	ring->position = 0;
+	ring->written = 0;
+	ring->released = 0;
+	ring->writer_waiting = 0;
+	ring->readers_waiting = 0;
+	for (shm_ring::reader_slot &slot : ring->readers) {
+		slot.active = slot_free;
+		slot.pid = 0;
+		slot.position = 0;
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+	ring->identifier = shm_ring::magic;
+}
+
+shm_sink::~shm_sink()
+{
+	if (ring == nullptr)
+		return;
+	finish();
+	munmap(ring, size);
+	shm_unlink(name.c_str());
+}
+
+bool shm_sink::is_valid()
+{
+	return ring != nullptr;
+}
+
+/**
+ * The writer waits on released, which readers increment when they release
+ * samples, attach or detach. It wakes up regularly regardless, to drop readers
+ * whose process has ended.
+ */
+bool shm_sink::write(const float *samples, unsigned count)
+{
+	if (ring == nullptr || ring->finished)
+		return false;
+
+	unsigned channels = ring->channels;
+	unsigned capacity = ring->capacity;
+	float *data = ring->get_samples();
+	unsigned long long position = ring->position.load(std::memory_order_relaxed);
+
+	while (readers > 0) {
+		unsigned sequence = ring->released;
+		unsigned attached = 0;
+		for (shm_ring::reader_slot &slot : ring->readers)
+			attached += slot.active == slot_reading;
+		if (attached >= readers) {
+			readers = 0;
+			break;
+		}
+		ring->writer_waiting++;
+		wait_word(ring->released, sequence);
+		ring->writer_waiting--;
+	}
+
+	while (count > 0) {
+		unsigned n = count < capacity ? count : capacity;
+		bool timed_out = false;
+		while (true) {
+			unsigned sequence = ring->released;
+			ring->writer_waiting++;
+			bool full = position + n - get_oldest(position, timed_out) > capacity;
+			timed_out = full && wait_word(ring->released, sequence);
+			ring->writer_waiting--;
+			if (!full)
+				break;
+		}
+
+		unsigned start = position & (capacity - 1);
+		unsigned first = capacity - start < n ? capacity - start : n;
+		memcpy(&data[start * channels], samples, first * channels * sizeof(float));
+		memcpy(data, &samples[first * channels], (n - first) * channels * sizeof(float));
+
+		position += n;
+		samples += n * channels;
+		count -= n;
+		ring->position.store(position, std::memory_order_release);
+		ring->written++;
+		if (ring->readers_waiting > 0)
+			wake_word(ring->written);
+	}
+	return true;
+}
+
+bool shm_sink::finish()
+{
+	if (ring == nullptr)
+		return false;
+	if (!ring->finished) {
+		ring->finished = 1;
+		ring->written++;
+		wake_word(ring->written);
+	}
+	return true;
+}
+
+/**
+ * The earliest sample that a reader still needs.
+ * @param position The next sample to write, if there are no readers.
+ * @param reap Drop readers that have exited without detaching.
+ */
+unsigned long long shm_sink::get_oldest(unsigned long long position, bool reap)
+{
+	unsigned long long oldest = position;
+	for (shm_ring::reader_slot &slot : ring->readers) {
+		if (slot.active != slot_reading)
+			continue;
+		int pid = slot.pid;
+		if (reap && pid > 0 && kill(pid, 0) != 0 && errno == ESRCH) {
+			slot.active = slot_free;
+			continue;
+		}
+		unsigned long long read = slot.position.load(std::memory_order_acquire);
+		if (read < oldest)
+			oldest = read;
+	}
+	return oldest;
+}
+
+shm_reader::shm_reader(const char *name)
+{
+	ring = nullptr;
+	slot = nullptr;
+	size = 0;
+
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	struct stat status;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(shm_ring))
+		map = mmap(nullptr, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	ring = static_cast<shm_ring *>(map);
+	size = status.st_size;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (ring->identifier != shm_ring::magic || ring->format_version != shm_ring::version ||
+		size < shm_ring::get_size(ring->capacity, ring->channels)) {
+		munmap(ring, size);
+		ring = nullptr;
+		return;
+	}
+
+	for (shm_ring::reader_slot &candidate : ring->readers) {
+		unsigned expected = slot_free;
+		if (candidate.active.compare_exchange_strong(expected, slot_claimed)) {
+			slot = &candidate;
+			break;
+		}
+	}
+	if (slot == nullptr) {
+		munmap(ring, size);
+		ring = nullptr;
+		return;
+	}
+
+	/* The writer may pass the first position before it sees the slot, but not
+	 * the second one. */
+	slot->pid = getpid();
+	slot->position = ring->position.load();
+	slot->active = slot_reading;
+	slot->position = ring->position.load();
+	ring->released++;
+	wake_word(ring->released);
+}
+
+shm_reader::~shm_reader()
+{
+	if (ring == nullptr)
+		return;
+	slot->active = slot_free;
+	ring->released++;
+	wake_word(ring->released);
+	munmap(ring, size);
+}
+
+bool shm_reader::is_valid()
+{
+	return ring != nullptr;
+}
+
+unsigned shm_reader::get_sampling_rate()
+{
+	return ring->sampling_rate;
+}
+
+unsigned shm_reader::get_channels()
+{
+	return ring->channels;
+}
+
+const float *shm_reader::read(unsigned &count)
+{
+	unsigned long long position = slot->position.load(std::memory_order_relaxed);
+	unsigned capacity = ring->capacity;
+	while (true) {
+		unsigned sequence = ring->written;
+		unsigned long long end = ring->position.load(std::memory_order_acquire);
+		if (end > position) {
+			unsigned start = position & (capacity - 1);
+			unsigned long long available = end - position;
+			count = available < capacity - start ? available : capacity - start;
+			return &ring->get_samples()[start * ring->channels];
+		}
+		/* The end is marked after the last samples are written. */
+		if (ring->finished && ring->position.load(std::memory_order_acquire) == position) {
+			count = 0;
+			return nullptr;
+		}
+
+		ring->readers_waiting++;
+		bool timed_out = ring->written == sequence && !ring->finished &&
+			wait_word(ring->written, sequence);
+		ring->readers_waiting--;
+		/* A writer that died never marks the end. */
+		if (timed_out && kill(ring->writer_pid, 0) != 0 && errno == ESRCH) {
+			count = 0;
+			return nullptr;
+		}
+	}
+}
+
+void shm_reader::release(unsigned count)
+{
+	slot->position.store(slot->position.load(std::memory_order_relaxed) + count, std::memory_order_release);
+	ring->released++;
+	if (ring->writer_waiting > 0)
+		wake_word(ring->released);
+}
+
+unsigned long long shm_reader::get_position()
+{
+	return slot->position;
+}
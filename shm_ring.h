@@ -0,0 +1,136 @@
+/*
+ * Hands decoded PCM to other processes on the same host through a named
+ * POSIX shared memory ring. The writer copies each frame into the ring once,
+ * and any number of readers read it in place, so more readers cost neither
+ * decoding nor copying. Readers and the writer wait for each other on futexes
+ * in the ring.
+ *
+ * The ring starts with a header: format, the number of samples written so far
+ * (the sequence number of the next sample), and one slot per reader with the
+ * sequence number it has read up to. The writer doesn't overwrite samples that
+ * a reader hasn't released, and a reader that dies is dropped once the writer
+ * notices that its process is gone. Likewise, readers see the end of the
+ * stream if the writer dies before it finishes.
+ *
+ * shm_reader is all that a consumer needs; build it from shm_ring.cpp.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <string>
+#include "sink.h"
+
+struct shm_ring {
+	static const unsigned magic = 0x474E5250; /* "PRNG" */
+	static const unsigned version = 2;
+	static const unsigned max_readers = 16;
+
+	struct reader_slot {
+		std::atomic<unsigned> active;
+		std::atomic<int> pid;
+		std::atomic<unsigned long long> position;
+	};
+
+	unsigned identifier;
+	unsigned format_version;
+	unsigned sampling_rate;
+	unsigned channels;
+	/* Samples per channel, a power of two. */
+	unsigned capacity;
+	int writer_pid;
+	std::atomic<unsigned> finished;
+	std::atomic<unsigned long long> position;
+	/* Futex words, incremented whenever samples are written or released. */
+	std::atomic<unsigned> written;
+	std::atomic<unsigned> released;
+	std::atomic<unsigned> writer_waiting;
+	std::atomic<unsigned> readers_waiting;
+	reader_slot readers[max_readers];
+
+	/** Interleaved samples, which follow the header. */
+	float *get_samples();
+	/** Bytes of the header and the samples. */
+	static size_t get_size(unsigned capacity, unsigned channels);
+};
+
+/**
+ * Writes to a new ring. Nothing waits for a reader unless a reader is
+ * attached, so samples that no reader was attached for are lost.
+ */
+class shm_sink : public sink {
+public:
+	/**
+	 * @param name A shared memory name, such as "/mp3decoder". A ring of the
+	 * same name is replaced.
+	 * @param sampling_rate
+	 * @param channels
+	 * @param capacity Samples per channel, rounded up to a power of two.
+	 * @param readers Readers to wait for before the first samples are written.
+	 */
+	shm_sink(const char *name, unsigned sampling_rate, unsigned channels,
+		unsigned capacity = 1 << 16, unsigned readers = 0);
+	~shm_sink();
+	shm_sink(const shm_sink &) = delete;
+	shm_sink &operator=(const shm_sink &) = delete;
+
+	/** False if the ring couldn't be created. */
+	bool is_valid();
+	/** Waits until every reader has room for the samples. */
+	bool write(const float *samples, unsigned count);
+	/** Mark the end of the stream, which readers see after the last samples. */
+	bool finish();
+
+private:
+	std::string name;
+	shm_ring *ring;
+	size_t size;
+	unsigned readers;
+
+	unsigned long long get_oldest(unsigned long long position, bool reap);
+};
+
+/** Attaches to a ring as one of its readers. */
+class shm_reader {
+public:
+	/**
+	 * Start reading at the next sample that is written.
+	 * @param name
+	 */
+	shm_reader(const char *name);
+	~shm_reader();
+	shm_reader(const shm_reader &) = delete;
+	shm_reader &operator=(const shm_reader &) = delete;
+
+	/** False if there is no such ring, or it has no free reader slot. */
+	bool is_valid();
+	unsigned get_sampling_rate();
+	unsigned get_channels();
+
+	/**
+	 * Wait for samples and point to them in the ring. They stay in place until
+	 * they are released.
+	 * @param count Receives the samples per channel, which may be fewer than
+	 * are available when the ring wraps around.
+	 * @return Interleaved samples, or nullptr at the end of the stream, which
+	 * is also where a writer that died stopped.
+	 */
+	const float *read(unsigned &count);
+
+	/**
+	 * Let the writer reuse samples that were read.
+	 * @param count Samples per channel, at most what read() returned.
+	 */
+	void release(unsigned count);
+
+	/** The sequence number of the next sample to read. */
+	unsigned long long get_position();
+
+private:
+	shm_ring *ring;
+	size_t size;
+	shm_ring::reader_slot *slot;
+};
+
+#endif	/* SHM_RING_H */
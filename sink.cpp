@@ -0,0 +1,145 @@
+/*
+ * Where decoded PCM goes: the sound card (see player.h), a file, a pipe, or
+ * nowhere at all for benchmarks. Samples are interleaved 32 bit floats.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "sink.h"
+#include "util.h"
+
+static void put_little_endian(unsigned char *buffer, unsigned value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		buffer[i] = value >> (8 * i);
+}
+
+bool null_sink::write(const float *, unsigned)
+{
+	return true;
+}
+
+file_sink::file_sink(const char *path, Format format, unsigned sampling_rate, unsigned channels)
+{
+	this->format = format;
+	this->sampling_rate = sampling_rate;
+	this->channels = channels;
+	buffered = 0;
+	data_size = 0;
+	buffer = nullptr;
+	valid = false;
+
+	if (strcmp(path, "-") == 0) {
+		fd = STDOUT_FILENO;
+		owns_fd = false;
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		owns_fd = true;
+	}
+	if (fd < 0)
+		return;
+
+	buffer = static_cast<unsigned char *>(allocate(block_size));
+	if (format == Wav) {
+		/* The size isn't known yet, which is what a pipe will be left with. */
+		set_wav_header(buffer, 0xFFFFFFFF);
+		buffered = wav_header_size;
+	}
+	valid = true;
+}
+
+file_sink::~file_sink()
+{
+	finish();
+	if (buffer != nullptr)
+		release(buffer);
+	if (owns_fd && fd >= 0)
+		close(fd);
+}
+
+bool file_sink::is_valid()
+{
+	return valid;
+}
+
+bool file_sink::write(const float *samples, unsigned count)
+{
+	if (!valid)
+		return false;
+
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(samples);
+	unsigned size = count * channels * sizeof(float);
+	data_size += size;
+	while (size > 0) {
+		unsigned n = block_size - buffered < size ? block_size - buffered : size;
+		memcpy(&buffer[buffered], bytes, n);
+		buffered += n;
+		bytes += n;
+		size -= n;
+		if (buffered == block_size && !flush(block_size))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Write the last partial block. A WAV header is written again with the final
+ * sizes, unless the output is a pipe.
+ */
+bool file_sink::finish()
+{
+	if (!valid)
+		return false;
+	valid = false;
+	if (buffered > 0 && !flush(buffered))
+		return false;
+
+	if (format == Wav) {
+		unsigned char header[wav_header_size];
+		set_wav_header(header, data_size);
+		if (pwrite(fd, header, wav_header_size, 0) != wav_header_size && errno != ESPIPE)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Describe 32 bit float PCM.
+ * @param header Receives 44 bytes.
+ * @param bytes Bytes of PCM, limited to what the header can hold.
+ */
+void file_sink::set_wav_header(unsigned char *header, unsigned long long bytes)
+{
+	unsigned size = bytes > 0xFFFFFFFF - 36 ? 0xFFFFFFFF - 36 : bytes;
+	memcpy(&header[0], "RIFF", 4);
+	put_little_endian(&header[4], size + 36, 4);
+	memcpy(&header[8], "WAVEfmt ", 8);
+	put_little_endian(&header[16], 16, 4);
+	put_little_endian(&header[20], 3, 2);
+	put_little_endian(&header[22], channels, 2);
+	put_little_endian(&header[24], sampling_rate, 4);
+	put_little_endian(&header[28], sampling_rate * channels * sizeof(float), 4);
+	put_little_endian(&header[32], channels * sizeof(float), 2);
+	put_little_endian(&header[34], 32, 2);
+	memcpy(&header[36], "data", 4);
+	put_little_endian(&header[40], size, 4);
+}
+
+bool file_sink::flush(unsigned size)
+{
+	unsigned written = 0;
+	while (written < size) {
+		ssize_t n = ::write(fd, &buffer[written], size - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			valid = false;
+			return false;
+		}
+		written += n;
+	}
+	buffered = 0;
+	return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * Where decoded PCM goes: the sound card (see player.h), a file, a pipe, or
+ * nowhere at all for benchmarks. Samples are interleaved 32 bit floats.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+class sink {
+public:
+	virtual ~sink() {}
+
+	/**
+	 * @param samples Interleaved.
+	 * @param count Samples per channel.
+	 * @return False if the samples couldn't be written.
+	 */
+	virtual bool write(const float *samples, unsigned count) = 0;
+
+	/**
+	 * Write whatever is still buffered.
+	 * @return False if it couldn't be written.
+	 */
+	virtual bool finish() { return true; }
+};
+
+/** Discards samples, so that only decoding is measured. */
+class null_sink : public sink {
+public:
+	bool write(const float *samples, unsigned count);
+};
+
+/**
+ * Writes raw PCM or a WAV file. Samples are gathered into a large buffer that
+ * is written in whole blocks at block aligned offsets, so the decoder isn't
+ * slowed down by a small write per frame.
+ */
+class file_sink : public sink {
+public:
+	enum Format {
+		Raw = 0,
+		Wav = 1
+	};
+
+	/**
+	 * @param path A file to create, or "-" for raw PCM on stdout.
+	 * @param format
+	 * @param sampling_rate
+	 * @param channels
+	 */
+	file_sink(const char *path, Format format, unsigned sampling_rate, unsigned channels);
+	~file_sink();
+	file_sink(const file_sink &) = delete;
+	file_sink &operator=(const file_sink &) = delete;
+
+	/** False if the file couldn't be created. */
+	bool is_valid();
+	bool write(const float *samples, unsigned count);
+	bool finish();
+
+private:
+	static const unsigned block_size = 1 << 20;
+	static const unsigned wav_header_size = 44;
+
+	int fd;
+	bool owns_fd;
+	bool valid;
+	Format format;
+	unsigned sampling_rate;
+	unsigned channels;
+	unsigned char *buffer;
+	unsigned buffered;
+	unsigned long long data_size;
+
+	void set_wav_header(unsigned char *header, unsigned long long bytes);
+	bool flush(unsigned size);
+};
+
+#endif	/* SINK_H */
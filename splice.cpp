@@ -0,0 +1,338 @@
+/*
+ * Cuts and joins MPEG-1 layer 3 streams without decoding them. Frames are copied
+ * as they are, except that the main data of every frame is laid out again so
+ * that main_data_begin never points to bytes that were cut away.
+ * | ID3 (from first input) | Xing/Info (optional) | Frame | Frame | ... |
+ */
+
+#include <string.h>
+#include "splice.h"
+#include "id3.h"
+#include "util.h"
+
+static const unsigned bit_rates[15] {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320};
+static const unsigned sampling_rates[3] {44100, 48000, 32000};
+
+static void put_int(unsigned char *buffer, unsigned value)
+{
+	for (int i = 0; i < 4; i++)
+		buffer[i] = value >> (24 - 8 * i);
+}
+
+splice::splice()
+{
+	num_recent = 0;
+	xing_offset = -1;
+	sampling_index = 3;
+	mono = false;
+	main_cap = 0;
+	main_end = 0;
+	bridging = 0;
+	resized = 0;
+}
+
+/** MPEG-1 layer 3 with a valid bit rate (not free format) and sampling rate. */
+bool splice::is_header(unsigned char *buffer)
+{
+	unsigned bit_rate_index = buffer[2] >> 4;
+	return buffer[0] == 0xFF && (buffer[1] & 0xFE) == 0xFA && bit_rate_index != 0 &&
+		bit_rate_index != 15 && (buffer[2] & 0x0C) != 0x0C;
+}
+
+unsigned splice::get_frame_size(unsigned char *buffer, unsigned bit_rate_index, bool padding)
+{
+	unsigned sampling_rate = sampling_rates[(buffer[2] >> 2) & 0x03];
+	return 144000 * bit_rates[bit_rate_index] / sampling_rate + padding;
+}
+
+/** Header, CRC and side information. */
+unsigned splice::get_side_info_size(unsigned char *buffer)
+{
+	unsigned size = (buffer[3] >> 6) == 3 ? 21 : 36;
+	if ((buffer[1] & 0x01) == 0)
+		size += 2;
+	return size;
+}
+
+/** Sum of part2_3_length in bytes. */
+unsigned splice::get_main_data_length(unsigned char *side_info, bool mono)
+{
+	int bit = mono ? 18 : 20;
+	unsigned length = 0;
+	for (int i = 0; i < (mono ? 2 : 4); i++) {
+		length += get_bits(side_info, bit, bit + 12);
+		bit += 59;
+	}
+	return (length + 7) / 8;
+}
+
+/**
+ * @param lame If set, use the CRC of the LAME tag (reflected 0x8005) rather than
+ * the CRC that protects frame headers.
+ */
+unsigned short splice::crc16(unsigned short crc, unsigned char *buffer, unsigned size, bool lame)
+{
+	for (unsigned i = 0; i < size; i++) {
+		if (lame) {
+			crc ^= buffer[i];
+			for (int bit = 0; bit < 8; bit++)
+				crc = crc & 0x0001 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		} else {
+			crc ^= buffer[i] << 8;
+			for (int bit = 0; bit < 8; bit++)
+				crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+bool splice::add(unsigned char *buffer, unsigned size, int first, int last)
+{
+	unsigned offset = 0;
+	while (offset + 14 < size) {
+		id3 tag(&buffer[offset], size - offset);
+		if (!tag.is_valid())
+			break;
+		offset += tag.get_id3_size();
+	}
+
+	if (offset + 4 > size || !is_header(&buffer[offset]))
+		return false;
+	if (sampling_index == 3) {
+		sampling_index = (buffer[offset + 2] >> 2) & 0x03;
+		mono = (buffer[offset + 3] >> 6) == 3;
+		output.insert(output.end(), buffer, buffer + offset);
+	} else if (sampling_index != ((buffer[offset + 2] >> 2) & 0x03u) ||
+			mono != ((buffer[offset + 3] >> 6) == 3))
+		return false;
+
+	/* Index the frames and their position in the stream of main data. */
+	std::vector<frame> frames;
+	int main_pos = 0;
+	bool tag_frame = true;
+	while (offset + 4 <= size && is_header(&buffer[offset])) {
+		frame f;
+		f.offset = offset;
+		f.size = get_frame_size(&buffer[offset], buffer[offset + 2] >> 4, buffer[offset + 2] & 0x02);
+		f.side = offset + ((buffer[offset + 1] & 0x01) ? 4 : 6);
+		f.main = offset + get_side_info_size(&buffer[offset]);
+		f.main_pos = main_pos;
+		if (offset + f.size > size || mono != ((buffer[offset + 3] >> 6) == 3))
+			break;
+
+		if (tag_frame && (memcmp(&buffer[f.main], "Xing", 4) == 0 ||
+				memcmp(&buffer[f.main], "Info", 4) == 0)) {
+			/* The tag frame of the first file is kept at the front of the output. */
+			if (xing_offset < 0 && frame_offsets.empty()) {
+				xing_offset = output.size();
+				output.insert(output.end(), &buffer[offset], &buffer[offset + f.size]);
+			}
+		} else {
+			frames.push_back(f);
+			main_pos += f.offset + f.size - f.main;
+		}
+		tag_frame = false;
+		offset += f.size;
+	}
+
+	if (first < 0)
+		first = 0;
+	if (last < 0 || last > (int)frames.size())
+		last = frames.size();
+
+	unsigned char data[2048];
+	for (int i = first; i < last; i++) {
+		const frame &f = frames[i];
+		unsigned char side_info[32];
+		unsigned side_size = f.main - f.side;
+		memcpy(side_info, &buffer[f.side], side_size);
+
+		int length = get_main_data_length(side_info, mono);
+		int start = f.main_pos - (int)get_bits(side_info, 0, 9);
+		if (start < 0 || start + length > main_pos) {
+			/* The reservoir starts before the first frame of the file. */
+			memset(side_info, 0, side_size);
+			length = 0;
+			bridging++;
+		}
+
+		/* Gather the main data, which may begin in one of the previous frames. */
+		int k = i;
+		while (k > 0 && frames[k].main_pos > start)
+			k--;
+		for (int copied = 0, pos = start; copied < length; k++) {
+			int n = frames[k].main_pos + (int)(frames[k].offset + frames[k].size - frames[k].main) - pos;
+			if (n > length - copied)
+				n = length - copied;
+			memcpy(&data[copied], &buffer[frames[k].main + pos - frames[k].main_pos], n);
+			copied += n;
+			pos += n;
+		}
+
+		emit(&buffer[f.offset], side_info, data, length);
+	}
+
+	return true;
+}
+
+/**
+ * Place a frame and its main data in the output. The main data starts as far
+ * back in the reservoir as main_data_begin allows. If it still doesn't fit, the
+ * frame is given a higher bit rate, or silent frames are inserted to grow the
+ * reservoir.
+ */
+void splice::emit(unsigned char *header, unsigned char *side_info, unsigned char *data, int length)
+{
+	unsigned index = header[2] >> 4;
+	bool padding = header[2] & 0x02;
+	unsigned overhead = get_side_info_size(header);
+
+	if (length > 511 + (int)(get_frame_size(header, 14, false) - overhead)) {
+		/* Damaged side information. */
+		memset(side_info, 0, mono ? 17 : 32);
+		length = 0;
+		bridging++;
+	}
+
+	while (true) {
+		int start = main_end > main_cap - 511 ? main_end : main_cap - 511;
+		if (length == 0)
+			start = main_cap;
+
+		for (unsigned i = index; i < 15; i++) {
+			bool pad = i == index && padding;
+			if (start + length <= main_cap + (int)(get_frame_size(header, i, pad) - overhead)) {
+				emit_frame(header, side_info, data, length, start, i, pad);
+				if (i != index)
+					resized++;
+				return;
+			}
+		}
+
+		unsigned char silence[32] = {0};
+		emit_frame(header, silence, data, 0, main_cap, index, padding);
+		bridging++;
+	}
+}
+
+void splice::emit_frame(unsigned char *header, unsigned char *side_info, unsigned char *data,
+	int length, int start, unsigned bit_rate_index, bool padding)
+{
+	unsigned offset = output.size();
+	unsigned size = get_frame_size(header, bit_rate_index, padding);
+	unsigned side_offset = (header[1] & 0x01) ? 4 : 6;
+	unsigned side_size = mono ? 17 : 32;
+
+	output.resize(offset + size, 0);
+	unsigned char *frame = &output[offset];
+	memcpy(frame, header, 4);
+	frame[2] = (bit_rate_index << 4) | (header[2] & 0x0D) | (padding ? 0x02 : 0);
+	memcpy(frame + side_offset, side_info, side_size);
+
+	unsigned main_data_begin = main_cap - start;
+	frame[side_offset] = main_data_begin >> 1;
+	frame[side_offset + 1] = (frame[side_offset + 1] & 0x7F) | ((main_data_begin & 0x01) << 7);
+
+	if (side_offset == 6) {
+		unsigned short crc = crc16(0xFFFF, frame + 2, 2, false);
+		crc = crc16(crc, frame + side_offset, side_size, false);
+		frame[4] = crc >> 8;
+		frame[5] = crc & 0xFF;
+	}
+
+	/* Remember enough frames to cover the largest main_data_begin. */
+	if (num_recent == 16) {
+		memmove(recent, recent + 1, 15 * sizeof(area));
+		num_recent--;
+	}
+	recent[num_recent].offset = offset + side_offset + side_size;
+	recent[num_recent].main_pos = main_cap;
+	recent[num_recent].size = size - side_offset - side_size;
+	num_recent++;
+
+	main_end = length > 0 ? start + length : main_end;
+	main_cap += size - side_offset - side_size;
+
+	for (unsigned i = 0; i < num_recent && length > 0; i++) {
+		const area &a = recent[i];
+		int end = a.main_pos + a.size;
+		if (start >= end)
+			continue;
+		int n = end - start < length ? end - start : length;
+		memcpy(&output[a.offset + start - a.main_pos], data, n);
+		data += n;
+		start += n;
+		length -= n;
+	}
+
+	frame_offsets.push_back(offset);
+}
+
+void splice::finish()
+{
+	if (xing_offset < 0)
+		return;
+
+	unsigned char *frame = &output[xing_offset];
+	unsigned char *xing = frame + get_side_info_size(frame);
+	unsigned char *field = xing + 8;
+	unsigned char flags = xing[7];
+	unsigned frames = frame_offsets.size();
+	unsigned bytes = output.size() - xing_offset;
+
+	/* Frames with a different bit rate make the file VBR. */
+	if (resized > 0)
+		memcpy(xing, "Xing", 4);
+
+	if (flags & 0x01) {
+		put_int(field, frames);
+		field += 4;
+	}
+	if (flags & 0x02) {
+		put_int(field, bytes);
+		field += 4;
+	}
+	if (flags & 0x04) {
+		for (unsigned i = 0; i < 100 && frames > 0; i++) {
+			unsigned position = frame_offsets[i * frames / 100] - xing_offset;
+			field[i] = (unsigned long long)position * 256 / bytes;
+		}
+		field += 100;
+	}
+	if (flags & 0x08)
+		field += 4;
+
+	/* The LAME extension follows the Xing fields. */
+	unsigned tag_size = field - frame + 36;
+	if (xing_offset + tag_size <= output.size() && memcmp(field, "LAME", 4) == 0) {
+		put_int(field + 28, bytes);
+		unsigned short crc = 0;
+		if (frames > 0)
+			crc = crc16(0, &output[frame_offsets[0]], output.size() - frame_offsets[0], true);
+		field[32] = crc >> 8;
+		field[33] = crc & 0xFF;
+		crc = crc16(0, frame, field + 34 - frame, true);
+		field[34] = crc >> 8;
+		field[35] = crc & 0xFF;
+	}
+}
+
+const std::vector<unsigned char> &splice::get_output()
+{
+	return output;
+}
+
+unsigned splice::get_frame_count()
+{
+	return frame_offsets.size();
+}
+
+unsigned splice::get_bridging_frames()
+{
+	return bridging;
+}
+
+unsigned splice::get_resized_frames()
+{
+	return resized;
+}
@@ -0,0 +1,75 @@
+/*
+ * Cuts and joins MPEG-1 layer 3 streams without decoding them. Frames are copied
+ * as they are, except that the main data of every frame is laid out again so
+ * that main_data_begin never points to bytes that were cut away.
+ * | ID3 (from first input) | Xing/Info (optional) | Frame | Frame | ... |
+ */
+
+#ifndef SPLICE_H
+#define SPLICE_H
+
+#include <vector>
+
+class splice {
+public:
+	splice();
+
+	/**
+	 * Append frames [first, last) of a file. Frame indices exclude the Xing/Info
+	 * frame.
+	 * @param buffer The whole file.
+	 * @param size Size of the buffer in bytes.
+	 * @param first Index of the first frame to copy.
+	 * @param last Index one past the last frame to copy, or -1 for the last frame.
+	 * @return False if the file isn't MPEG-1 layer 3 or doesn't match previous files.
+	 */
+	bool add(unsigned char *buffer, unsigned size, int first, int last);
+
+	/** Update the Xing/Info frame. Call once after the last add(). */
+	void finish();
+
+	const std::vector<unsigned char> &get_output();
+	unsigned get_frame_count();
+	/** Number of silent frames inserted or substituted to bridge the reservoir. */
+	unsigned get_bridging_frames();
+	/** Number of frames given a higher bit rate to hold their main data. */
+	unsigned get_resized_frames();
+
+private:
+	struct frame {
+		unsigned offset;
+		unsigned size;
+		unsigned side;
+		unsigned main;
+		int main_pos;
+	};
+	struct area {
+		unsigned offset;
+		int main_pos;
+		unsigned size;
+	};
+
+	std::vector<unsigned char> output;
+	std::vector<unsigned> frame_offsets;
+	area recent[16];
+	unsigned num_recent;
+	int xing_offset;
+	unsigned sampling_index;
+	bool mono;
+	int main_cap;
+	int main_end;
+	unsigned bridging;
+	unsigned resized;
+
+	static bool is_header(unsigned char *buffer);
+	static unsigned get_frame_size(unsigned char *buffer, unsigned bit_rate_index, bool padding);
+	static unsigned get_side_info_size(unsigned char *buffer);
+	static unsigned get_main_data_length(unsigned char *side_info, bool mono);
+	static unsigned short crc16(unsigned short crc, unsigned char *buffer, unsigned size, bool lame);
+
+	void emit(unsigned char *header, unsigned char *side_info, unsigned char *data, int length);
+	void emit_frame(unsigned char *header, unsigned char *side_info, unsigned char *data,
+		int length, int start, unsigned bit_rate_index, bool padding);
+};
+
+#endif	/* SPLICE_H */
@@ -0,0 +1,196 @@
+/*
+ * Decodes a stream that arrives in pieces, such as from a socket. Input is
+ * gathered until it holds a whole frame; a leading ID3v2 tag and bytes before
+ * the first frame are skipped. Decoding ends at the first bytes after that
+ * which aren't a frame, as it does for files, and the rest of the input is
+ * ignored.
+ */
+
+#include <string.h>
+#include "stream.h"
+
+stream_decoder::stream_decoder()
+{
+	decoder = nullptr;
+	input_used = 0;
+	offset = 0;
+	frame_used = 0;
+	skip = 0;
+	ended = false;
+	end_of_input = false;
+	resync = false;
+	output_rate = 0;
+	quality = resampler::Medium;
+}
+
+stream_decoder::~stream_decoder()
+{
+	delete decoder;
+}
+
+unsigned char *stream_decoder::get_input(unsigned &room)
+{
+	room = input_size - input_used;
+	return &input[input_used];
+}
+
+void stream_decoder::add_input(unsigned bytes)
+{
+	input_used += bytes;
+}
+
+unsigned stream_decoder::feed(const unsigned char *data, unsigned size)
+{
+	unsigned room;
+	unsigned char *free = get_input(room);
+	unsigned n = size < room ? size : room;
+	memcpy(free, data, n);
+	add_input(n);
+	return n;
+}
+
+void stream_decoder::set_end_of_input()
+{
+	end_of_input = true;
+}
+
+void stream_decoder::restart(unsigned long long offset)
+{
+	delete decoder;
+	decoder = nullptr;
+	input_used = 0;
+	this->offset = offset;
+	frame_used = 0;
+	skip = 0;
+	ended = false;
+	end_of_input = false;
+	resync = offset > 0;
+}
+
+bool stream_decoder::set_output_rate(unsigned rate, resampler::Quality quality)
+{
+	output_rate = rate;
+	this->quality = quality;
+	return decoder == nullptr || decoder->set_output_rate(rate, quality);
+}
+
+stream_decoder::Status stream_decoder::decode(mp3::workspace *work)
+{
+	while (true) {
+		Step result = step(work);
+		if (result == Decoded)
+			return Frame;
+		if (result == Stuck)
+			return end_of_input ? End : NeedInput;
+	}
+}
+
+mp3 *stream_decoder::get_decoder()
+{
+	return decoder;
+}
+
+unsigned stream_decoder::get_sample_count()
+{
+	return decoder != nullptr ? decoder->get_sample_count() : 0;
+}
+
+unsigned stream_decoder::get_channels()
+{
+	return decoder != nullptr && decoder->get_channel_mode() == mp3::Mono ? 1 : 2;
+}
+
+const unsigned char *stream_decoder::get_frame()
+{
+	return input;
+}
+
+unsigned long long stream_decoder::get_frame_offset()
+{
+	return offset;
+}
+
+/**
+ * Take the next step in the input: skip an ID3v2 tag, look for the first
+ * frame, or decode a frame.
+ * @return Stuck if more input is needed, or the stream has ended.
+ */
+stream_decoder::Step stream_decoder::step(mp3::workspace *work)
+{
+	if (frame_used > 0) {
+		consume(frame_used);
+		frame_used = 0;
+	}
+	if (ended) {
+		/* Such as an ID3v1 tag. */
+		unsigned n = input_used;
+		consume(n);
+		return n > 0 ? Skipped : Stuck;
+	}
+	if (skip > 0) {
+		unsigned n = skip < input_used ? skip : input_used;
+		consume(n);
+		skip -= n;
+		return n > 0 ? Skipped : Stuck;
+	}
+
+	if (decoder == nullptr) {
+		/* Enough to tell a tag from a frame. */
+		if (input_used < 10)
+			return Stuck;
+		if (!resync && memcmp(input, "ID3", 3) == 0) {
+			skip = 10 + (input[6] << 21 | input[7] << 14 | input[8] << 7 | input[9]);
+			if (input[5] & 0x10)
+				skip += 10;
+			return Skipped;
+		}
+		unsigned sync = 0;
+		while (sync + 1 < input_used && !(input[sync] == 0xFF && input[sync + 1] >= 0xE0))
+			sync++;
+		if (sync > 0) {
+			consume(sync);
+			return Skipped;
+		}
+		decoder = new mp3(input, work);
+		if (output_rate != 0 && decoder->is_valid())
+			decoder->set_output_rate(output_rate, quality);
+	}
+
+	if (input_used < 4)
+		return Stuck;
+	decoder->set_workspace(work);
+	decoder->init_header_params(input);
+	unsigned frame_size = decoder->get_frame_size();
+	if (resync) {
+		/* A sync word in the middle of a frame is taken for a header only if
+		 * another header follows it. */
+		if (decoder->is_valid() && frame_size + 4 > input_used && !end_of_input)
+			return Stuck;
+		bool followed = frame_size + 1 < input_used && input[frame_size] == 0xFF &&
+			input[frame_size + 1] >= 0xE0;
+		if (!decoder->is_valid() || frame_size + 4 > input_size || !followed) {
+			/* A decoder that read an invalid header stays invalid. */
+			delete decoder;
+			decoder = nullptr;
+			consume(1);
+			return Skipped;
+		}
+		resync = false;
+	}
+	if (!decoder->is_valid() || frame_size > input_size) {
+		ended = true;
+		return Skipped;
+	}
+	if (input_used < frame_size)
+		return Stuck;
+	decoder->init_frame_params(input);
+	frame_used = frame_size;
+	return Decoded;
+}
+
+void stream_decoder::consume(unsigned bytes)
+{
+	input_used -= bytes;
+	offset += bytes;
+	memmove(input, &input[bytes], input_used);
+}
@@ -0,0 +1,114 @@
+/*
+ * Decodes a stream that arrives in pieces, such as from a socket. Input is
+ * gathered until it holds a whole frame; a leading ID3v2 tag and bytes before
+ * the first frame are skipped. Decoding ends at the first bytes after that
+ * which aren't a frame, as it does for files, and the rest of the input is
+ * ignored.
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "mp3.h"
+
+class stream_decoder {
+public:
+	enum Status {
+		/* The decoder holds the samples of a new frame. */
+		Frame = 0,
+		/* Add input and decode again. */
+		NeedInput = 1,
+		/* There is no more input, or it no longer holds frames. */
+		End = 2
+	};
+
+	/** Enough for the largest frame, 1441 bytes, and an ID3v2 header. */
+	static const unsigned input_size = 4096;
+
+	stream_decoder();
+	~stream_decoder();
+	stream_decoder(const stream_decoder &) = delete;
+	stream_decoder &operator=(const stream_decoder &) = delete;
+
+	/**
+	 * Where input can be written without copying it, for instance by recv().
+	 * @param room Receives the bytes that fit, which aren't 0 while the status
+	 * is NeedInput.
+	 */
+	unsigned char *get_input(unsigned &room);
+	/** @param bytes Written at get_input(). */
+	void add_input(unsigned bytes);
+	/**
+	 * Copy as much input as fits.
+	 * @return Bytes taken.
+	 */
+	unsigned feed(const unsigned char *data, unsigned size);
+	/** No input follows what was added. */
+	void set_end_of_input();
+	/**
+	 * Drop the input and the state of the decoder, and continue with input
+	 * from another position in the stream, such as after a seek. The position
+	 * needn't be at a frame: bytes up to the first frame that is followed by
+	 * another one are skipped.
+	 * @param offset The position of the next input in the stream.
+	 */
+	void restart(unsigned long long offset);
+
+	/**
+	 * Convert the samples to another rate, from the first frame on; see
+	 * mp3::set_output_rate().
+	 * @param rate
+	 * @param quality
+	 * @return False if the rate can't be converted to. The decoder isn't
+	 * known before the first frame, so until then this is found out later and
+	 * the samples are left at their rate.
+	 * @throws std::bad_alloc
+	 */
+	bool set_output_rate(unsigned rate, resampler::Quality quality = resampler::Medium);
+
+	/**
+	 * Decode the next frame.
+	 * @param work The workspace of the calling thread, or nullptr to use one
+	 * of the decoder's own.
+	 * @throws std::bad_alloc
+	 */
+	Status decode(mp3::workspace *work = nullptr);
+
+	/** The decoder of the stream, once its first frame has been found. */
+	mp3 *get_decoder();
+	/** Samples per channel of the last frame. */
+	unsigned get_sample_count();
+	unsigned get_channels();
+	/** The bytes of the last frame, which stay in place until the next decode(). */
+	const unsigned char *get_frame();
+	/** Where the last frame starts in the stream. */
+	unsigned long long get_frame_offset();
+
+private:
+	enum Step {
+		Stuck = 0,
+		Skipped = 1,
+		Decoded = 2
+	};
+
+	mp3 *decoder;
+	unsigned char input[input_size];
+	unsigned input_used;
+	/* The position of input[0] in the stream. */
+	unsigned long long offset;
+	/* Bytes of the last frame, dropped at the next step. */
+	unsigned frame_used;
+	/* Bytes of an ID3v2 tag that are still to be skipped. */
+	unsigned long skip;
+	bool ended;
+	bool end_of_input;
+	/* Looking for a frame after a restart. */
+	bool resync;
+	unsigned output_rate;
+	resampler::Quality quality;
+
+	Step step(mp3::workspace *work);
+	void consume(unsigned bytes);
+};
+
+#endif	/* STREAM_H */
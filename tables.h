@@ -57,8 +57,8 @@ static const char slen[16][2] {
 	{2, 1}, {2, 2}, {2, 3}, {3, 1}, {3, 2}, {3, 3}, {4, 2}, {4, 3}
 };
 
-static const char pretab[21] {
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 3, 2
+static const char pretab[22] {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 3, 3, 2, 0
 };
 
 static const struct {
@@ -566,4 +566,138 @@ static const double synth_window[512] {
 	 0.000015259,  0.000015259
 };
 
+/* The tables below are computed by the compiler. They are read-only data shared
+ * by all decoders and need no initialization when the first frame is decoded. */
+namespace constexpr_math {
+
+constexpr double pi = 3.141592653589793;
+
+/** Taylor series of the sine: x - x^3/3! + x^5/5! ... */
+constexpr double sin_series(double x2, double term, double sum, int n)
+{
+	return n > 41 ? sum : sin_series(x2, -term * x2 / ((n + 1) * (n + 2)), sum + term, n + 2);
+}
+
+/** sin(pi * n / d) where -d / 2 <= n <= d / 2. */
+constexpr double sin_reduced(long n, long d)
+{
+	return sin_series((pi * n / d) * (pi * n / d), pi * n / d, 0, 1);
+}
+
+/** sin(pi * n / d) where -d < n <= d. sin(x) == sin(pi - x). */
+constexpr double sin_half(long n, long d)
+{
+	return 2 * n > d ? sin_reduced(d - n, d) : (2 * n < -d ? sin_reduced(-d - n, d) : sin_reduced(n, d));
+}
+
+/** sin(pi * n / d) where 0 <= n < 2 * d. */
+constexpr double sin_period(long n, long d)
+{
+	return n > d ? sin_half(n - 2 * d, d) : sin_half(n, d);
+}
+
+/** The sine of a rational multiple of pi, reduced exactly with integers. */
+constexpr double sin_pi(long n, long d)
+{
+	return sin_period((n % (2 * d) + 2 * d) % (2 * d), d);
+}
+
+/** cos(pi * n / d) == sin(pi * (2n + d) / 2d) */
+constexpr double cos_pi(long n, long d)
+{
+	return sin_pi(2 * n + d, 2 * d);
+}
+
+/** Cube root by Newton's method. */
+constexpr double cbrt_newton(double x, double y, int n)
+{
+	return n == 0 ? y : cbrt_newton(x, (2 * y + x / (y * y)) / 3, n - 1);
+}
+
+/** x^(4/3) == x * cbrt(x), starting from a guess within a factor of two. */
+constexpr double pow43(double x)
+{
+	return x == 0 ? 0 : x * cbrt_newton(x, x < 8 ? 1.5 : x < 64 ? 3 : x < 512 ? 6 : x < 4096 ? 12 : 18, 8);
+}
+
+/* The indices 0, 1, ..., N - 1 as a parameter pack (with logarithmic recursion). */
+template<unsigned... I> struct index_list {};
+
+template<class A, class B> struct index_concat;
+template<unsigned... A, unsigned... B> struct index_concat<index_list<A...>, index_list<B...> > {
+	typedef index_list<A..., (sizeof...(A) + B)...> type;
+};
+
+template<unsigned N> struct make_index_list {
+	typedef typename index_concat<typename make_index_list<N / 2>::type,
+		typename make_index_list<N - N / 2>::type>::type type;
+};
+template<> struct make_index_list<0> { typedef index_list<> type; };
+template<> struct make_index_list<1> { typedef index_list<0> type; };
+
+template<typename T, unsigned N> struct array {
+	T value[N];
+	const T &operator[](unsigned i) const { return value[i]; }
+};
+
+template<typename T, unsigned R, unsigned C> struct table {
+	T value[R][C];
+	const T *operator[](unsigned row) const { return value[row]; }
+};
+
+/** Window of each block type (0: normal, 1: start, 2: short, 3: stop). */
+constexpr double imdct_window(unsigned type, long i)
+{
+	return type == 0 ? sin_pi(2 * i + 1, 72) :
+		type == 1 ? (i < 18 ? sin_pi(2 * i + 1, 72) : i < 24 ? 1 : i < 30 ? sin_pi(2 * i - 35, 24) : 0) :
+		type == 2 ? (i < 12 ? sin_pi(2 * i + 1, 24) : 0) :
+		(i < 6 ? 0 : i < 12 ? sin_pi(2 * i - 11, 24) : i < 18 ? 1 : sin_pi(2 * i + 1, 72));
+}
+
+template<unsigned... I>
+constexpr table<float, 4, 36> make_imdct_window(index_list<I...>)
+{
+	return {{ (float)imdct_window(I / 36, I % 36)... }};
+}
+
+/** cos(pi / 2n * (2i + 1 + n / 2) * (2k + 1)) for n = 36 and n = 12. */
+template<unsigned... I>
+constexpr table<double, 36, 18> make_imdct_cos_long(index_list<I...>)
+{
+	return {{ cos_pi((2 * (I / 18) + 1 + 18) * (2 * (I % 18) + 1), 72)... }};
+}
+
+template<unsigned... I>
+constexpr table<double, 12, 6> make_imdct_cos_short(index_list<I...>)
+{
+	return {{ cos_pi((2 * (I / 6) + 1 + 6) * (2 * (I % 6) + 1), 24)... }};
+}
+
+/** |s|^(4/3) for every quantized sample: up to 15 plus 13 linbits. */
+template<unsigned... I>
+constexpr array<float, 8207> make_pow43(index_list<I...>)
+{
+	return {{ (float)pow43(I)... }};
+}
+
+/** cos((16 + i) * (2j + 1) * pi / 64) */
+template<unsigned... I>
+constexpr table<float, 64, 32> make_synth_cos(index_list<I...>)
+{
+	return {{ (float)cos_pi((16 + I / 32) * (2 * (I % 32) + 1), 64)... }};
+}
+
+}
+
+static constexpr constexpr_math::table<float, 4, 36> imdct_window =
+	constexpr_math::make_imdct_window(constexpr_math::make_index_list<4 * 36>::type());
+static constexpr constexpr_math::table<double, 36, 18> imdct_cos_long =
+	constexpr_math::make_imdct_cos_long(constexpr_math::make_index_list<36 * 18>::type());
+static constexpr constexpr_math::table<double, 12, 6> imdct_cos_short =
+	constexpr_math::make_imdct_cos_short(constexpr_math::make_index_list<12 * 6>::type());
+static constexpr constexpr_math::array<float, 8207> pow43 =
+	constexpr_math::make_pow43(constexpr_math::make_index_list<8207>::type());
+static constexpr constexpr_math::table<float, 64, 32> synth_cos =
+	constexpr_math::make_synth_cos(constexpr_math::make_index_list<64 * 32>::type());
+
 #endif	/* TABLES_H */
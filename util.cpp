@@ -3,8 +3,25 @@
  * Date: May 2015
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <new>
 #include "util.h"
 
+static void *default_allocate(size_t size, void *)
+{
+	return malloc(size);
+}
+
+static void default_release(void *pointer, void *)
+{
+	free(pointer);
+}
+
+static allocate_function allocate_hook = default_allocate;
+static release_function release_hook = default_release;
+static void *allocator_context = nullptr;
+
 unsigned get_bits(unsigned char *buffer, int start_bit, int end_bit)
 {
 	int start_byte = 0;
@@ -45,3 +62,59 @@ int char_to_int(unsigned char *buffer)
 		num = (num << 7) + buffer[i];
 	return num;
 }
+
+unsigned char *put_word(unsigned char *buffer, unsigned word)
+{
+	buffer[0] = word;
+	buffer[1] = word >> 8;
+	buffer[2] = word >> 16;
+	buffer[3] = word >> 24;
+	return buffer + 4;
+}
+
+unsigned get_word(const unsigned char *buffer)
+{
+	return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (unsigned)buffer[3] << 24;
+}
+
+unsigned char *put_floats(unsigned char *buffer, const float *values, unsigned count)
+{
+	static_assert(sizeof(float) == sizeof(unsigned), "floats are saved as words");
+	for (unsigned i = 0; i < count; i++) {
+		unsigned word;
+		memcpy(&word, &values[i], sizeof(word));
+		buffer = put_word(buffer, word);
+	}
+	return buffer;
+}
+
+const unsigned char *get_floats(const unsigned char *buffer, float *values, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++) {
+		unsigned word = get_word(buffer);
+		memcpy(&values[i], &word, sizeof(word));
+		buffer += 4;
+	}
+	return buffer;
+}
+
+void set_allocator(allocate_function allocate, release_function release, void *context)
+{
+	allocate_hook = allocate;
+	release_hook = release;
+	allocator_context = context;
+}
+
+void *allocate(size_t size)
+{
+	void *pointer = allocate_hook(size, allocator_context);
+	if (pointer == nullptr)
+		throw std::bad_alloc();
+	return pointer;
+}
+
+void release(void *pointer)
+{
+	if (pointer != nullptr)
+		release_hook(pointer, allocator_context);
+}
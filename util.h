@@ -6,6 +6,8 @@
 #ifndef UTIL_H
 #define	UTIL_H
 
+#include <stddef.h>
+
 /**
  * Assumes that end_bit is greater than start_bit and that the result is less than
  * 32 bits, length of an unsigned type.
@@ -27,4 +29,42 @@ unsigned get_bits_inc(unsigned char *buffer, int *offset, int count);
 /** Puts four bytes into a single four byte integer type. */
 int char_to_int(unsigned char *buffer);
 
+/**
+ * Write a word as four little endian bytes, which is how decoder states are
+ * saved so that they can be loaded on another machine.
+ * @param buffer
+ * @param word
+ * @return The byte after the word.
+ */
+unsigned char *put_word(unsigned char *buffer, unsigned word);
+/** Read four little endian bytes. */
+unsigned get_word(const unsigned char *buffer);
+/** Write floats with put_word(). */
+unsigned char *put_floats(unsigned char *buffer, const float *values, unsigned count);
+/** Read floats that put_floats() wrote. @return The byte after them. */
+const unsigned char *get_floats(const unsigned char *buffer, float *values, unsigned count);
+
+typedef void *(*allocate_function)(size_t size, void *context);
+typedef void (*release_function)(void *pointer, void *context);
+
+/**
+ * Decoders allocate memory when they are constructed and when they are set up
+ * with set_output_rate(), set_workspace(), set_concealment() or load_state(),
+ * but never while decoding frames. The allocator that is used for this can be
+ * replaced, for instance by an arena. Set it before any memory is allocated,
+ * as memory must be released by the allocator that allocated it.
+ * @param allocate Returns null if there is no memory left.
+ * @param release
+ * @param context Passed to allocate and release.
+ */
+void set_allocator(allocate_function allocate, release_function release, void *context);
+
+/**
+ * Allocate memory with the current allocator.
+ * @throws std::bad_alloc
+ */
+void *allocate(size_t size);
+
+void release(void *pointer);
+
 #endif	/* UTIL_H */
@@ -2,82 +2,102 @@
  * The Xing header acts as an index to the MP3 file. It's contained within the first
  * MP3 frame. (Optional.)
  * | ID | Flags | Number of frames (optional) | Bytes in file (optional) |
- * | TOC (optional) | Quality (optional) |
+ * | TOC (optional) | Quality (optional) | LAME extension (optional) |
  */
 
+#include <string.h>
 #include "xing.h"
-#include "util.h"
-#include <string>
 
-xing::xing(unsigned char *buffer, unsigned int offset)
+static unsigned big_endian(const unsigned char *buffer)
 {
-	std::string id;
+	return (unsigned)buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+}
+
+xing::xing(unsigned char *buffer, unsigned int offset, unsigned int size)
+{
+	valid = false;
+	info = false;
+	byte_quantity = 0;
+	frame_quantity = 0;
+	quality = 0;
+	toc = nullptr;
+	lame = false;
+	encoder_delay = 0;
+	encoder_padding = 0;
+	for (int i = 0; i < 4; i++)
+		xing_extensions[i] = false;
 
 	/* The position of the Xing header within the first MP3 frame is unknown. */
-	while (true) {
-		if (buffer[offset] == 'I' || buffer[offset] == 'X') {
-			for (int byte = 0; byte < 4; byte++)
-				id += buffer[offset + byte];
-
-			if (id == "Info" || id == "Xing") {
-				this->start = offset + 4;
-				set_xing_extensions(buffer, offset);
-
-				if (this->xing_extensions[1]) set_frame_quantity(buffer);
-				if (this->xing_extensions[0]) set_byte_quantity(buffer);
-				/* if (this->xing_extensions[3]) TODO: TOC */
-				if (this->xing_extensions[2]) set_quality(buffer);
+	for (; offset + 8 <= size; offset++) {
+		if (memcmp(&buffer[offset], "Info", 4) == 0 || memcmp(&buffer[offset], "Xing", 4) == 0) {
+			info = buffer[offset] == 'I';
+			start = offset + 4;
+			set_xing_extensions(buffer);
+
+			unsigned fields = (xing_extensions[FrameField] ? 4 : 0) + (xing_extensions[ByteField] ? 4 : 0) +
+				(xing_extensions[TOC] ? 100 : 0) + (xing_extensions[Quality] ? 4 : 0);
+			if (start + fields > size)
 				break;
-			}
+
+			valid = true;
+			if (xing_extensions[FrameField])
+				set_frame_quantity(buffer);
+			if (xing_extensions[ByteField])
+				set_byte_quantity(buffer);
+			if (xing_extensions[TOC])
+				set_toc(buffer);
+			if (xing_extensions[Quality])
+				set_quality(buffer);
+			set_lame(buffer, size);
+			break;
 		} else if (buffer[offset] == 0xFF && buffer[offset+1] >= 0xE0)
 			break;
-
-		offset++;
 	}
 }
 
-xing::xing(const xing &orig)
+bool xing::is_valid()
 {
-	this->byte_quantity = orig.byte_quantity;
-	this->frame_quantity = orig.frame_quantity;
-	this->quality = orig.quality;
-	for (int byte = 0; byte < 4; byte++)
-		this->xing_extensions[byte] = orig.xing_extensions[byte];
+	return valid;
 }
 
-void xing::set_xing_extensions(unsigned char* buffer, unsigned int offset)
+bool xing::is_info()
 {
-	unsigned char flag_byte = buffer[this->start + 3];
+	return info;
+}
+
+void xing::set_xing_extensions(unsigned char* buffer)
+{
+	unsigned char flag_byte = buffer[start + 3];
 
 	for (int bit_num = 0; bit_num < 4; bit_num++)
 		if (flag_byte >> bit_num & 1)
-			this->xing_extensions[bit_num] = true;
+			xing_extensions[bit_num] = true;
 		else
-			this->xing_extensions[bit_num] = false;
+			xing_extensions[bit_num] = false;
 
-	this->start += 4;
+	start += 4;
 }
 
 const bool *xing::get_xing_extensions()
 {
-	return this->xing_extensions;
+	return xing_extensions;
 }
 
 void xing::set_frame_quantity(unsigned char *buffer)
 {
-	this->frame_quantity = char_to_int(&buffer[this->start + this->field_num*4]);
-	this->field_num++;
+	frame_quantity = big_endian(&buffer[start]);
+	start += 4;
 }
 
 int xing::get_frame_quantity()
 {
-	return this->frame_quantity;
+	return frame_quantity;
 }
 
 void xing::set_byte_quantity(unsigned char *buffer)
 {
-	this->byte_quantity = char_to_int(&buffer[this->start + this->field_num*4]);
-	this->field_num++;
+	byte_quantity = big_endian(&buffer[start]);
+	start += 4;
 }
 
 int xing::get_byte_quantity()
@@ -85,13 +105,54 @@ int xing::get_byte_quantity()
 	return byte_quantity;
 }
 
+void xing::set_toc(unsigned char *buffer)
+{
+	toc = &buffer[start];
+	start += 100;
+}
+
+const unsigned char *xing::get_toc()
+{
+	return toc;
+}
+
 void xing::set_quality(unsigned char *buffer)
 {
-	unsigned char size = (this->xing_extensions[TOC] == true ? 100 : 0);
-	this->quality = buffer[this->start + size + this->field_num*4 + 3];
+	quality = buffer[start + 3];
+	start += 4;
 }
 
 unsigned char xing::get_quality()
 {
-	return this->quality;
+	return quality;
+}
+
+/**
+ * The LAME extension follows the Xing fields. Its encoder delay and padding
+ * are two 12 bit numbers at byte 21.
+ */
+void xing::set_lame(unsigned char *buffer, unsigned int size)
+{
+	if (start + 24 > size || memcmp(&buffer[start], "LAME", 4) != 0)
+		return;
+
+	unsigned char *delay = &buffer[start + 21];
+	lame = true;
+	encoder_delay = delay[0] << 4 | delay[1] >> 4;
+	encoder_padding = (delay[1] & 0x0F) << 8 | delay[2];
+}
+
+bool xing::has_encoder_delay()
+{
+	return lame;
+}
+
+unsigned xing::get_encoder_delay()
+{
+	return encoder_delay;
+}
+
+unsigned xing::get_encoder_padding()
+{
+	return encoder_padding;
 }
@@ -2,7 +2,7 @@
  * The Xing header acts as an index to the MP3 file. It's contained within the first
  * MP3 frame. (Optional.)
  * | ID | Flags | Number of frames (optional) | Bytes in file (optional) |
- * | TOC (optional) | Quality (optional) |
+ * | TOC (optional) | Quality (optional) | LAME extension (optional) |
  */
 
 #ifndef XING_H
@@ -11,19 +11,24 @@
 class xing {
 private:
 	unsigned int start;
-	unsigned char field_num = 0;
+	bool valid;
+	bool info;
 
 	bool xing_extensions[4];
 	int byte_quantity;
 	int frame_quantity;
 	unsigned char quality;
-	bool test[4];
-	/* char *TOC; */
+	const unsigned char *toc;
+	bool lame;
+	unsigned encoder_delay;
+	unsigned encoder_padding;
 
-	void set_xing_extensions(unsigned char *buffer, unsigned int offset);
-	void set_byte_quantity(unsigned char *buffer);
+	void set_xing_extensions(unsigned char *buffer);
 	void set_frame_quantity(unsigned char *buffer);
+	void set_byte_quantity(unsigned char *buffer);
+	void set_toc(unsigned char *buffer);
 	void set_quality(unsigned char *buffer);
+	void set_lame(unsigned char *buffer, unsigned int size);
 
 public:
 	enum Extension {
@@ -33,15 +38,29 @@ public:
 		Quality = 3
 	};
 
-	xing(unsigned char *buffer, unsigned int offset);
-	xing(const xing &orig);
+	/**
+	 * @param buffer The first MP3 frame.
+	 * @param offset Where to start looking for the tag, usually after the side info.
+	 * @param size Bytes in the buffer.
+	 */
+	xing(unsigned char *buffer, unsigned int offset, unsigned int size);
 
+	bool is_valid();
+	/** The tag is called "Info" in constant bit rate files and "Xing" otherwise. */
+	bool is_info();
 	const bool *get_xing_extensions();
 	int get_byte_quantity();
 	int get_frame_quantity();
+	/** 100 bytes: the position of each percent of the duration in 256ths of the file. */
+	const unsigned char *get_toc();
 
 	/** A rating of the Xing quality ranging from 0 (best) to 100 (worst). */
 	unsigned char get_quality();
+
+	/** Samples the encoder added at the start and end, from the LAME extension. */
+	bool has_encoder_delay();
+	unsigned get_encoder_delay();
+	unsigned get_encoder_padding();
 };
 
 #endif	/* XING_H */